@@ -0,0 +1,287 @@
+#!/usr/bin/env python3
+#
+# Usage: compile_scene.py SCENE_FILE OUTPUT_HEADER
+#
+# This script turns a scene description (see scenes/demo.scene for the format)
+# into a C++ header. The header contains the scene as constexpr arrays in
+# structure-of-arrays layout, together with a prebuilt bounding volume
+# hierarchy (BVH). That way the static part of the world doesn't need any
+# allocations or any building when the program starts, and the compiler knows
+# all the counts and bounds when it compiles the traversal loops.
+#
+# The header is only rewritten when its contents change, so that an unchanged
+# scene doesn't cause a rebuild.
+#
+
+import sys
+import os
+
+# Parse the inputs...
+if len(sys.argv) != 3:
+    raise ValueError(
+        "compile_scene.py needs two arguments: "
+        "A scene file and the path of the header it should write.\n"
+        f"It was given {len(sys.argv) - 1} arguments: {sys.argv}")
+
+scene_path = sys.argv[1]
+output_path = sys.argv[2]
+
+# Say hello...
+print(f'Compiling scene "{scene_path}" into "{output_path}"...')
+
+# Groups of at most this many primitives become a leaf of the BVH.
+MAX_LEAF_SIZE = 2
+
+
+# Read the scene...
+
+class Primitive:
+    def __init__(self, kind, scene_index, light, dark):
+        self.kind = kind  # "cuboid" or "sphere"
+        self.scene_index = scene_index  # The position in the scene file.
+        self.light = light
+        self.dark = dark
+        self.min = None
+        self.max = None
+        self.center = None
+        self.radius = None
+
+    def bounds(self):
+        if self.kind == "cuboid":
+            return self.min, self.max
+        return ([c - self.radius for c in self.center],
+                [c + self.radius for c in self.center])
+
+    def centroid(self):
+        low, high = self.bounds()
+        return [(a + b) / 2 for a, b in zip(low, high)]
+
+
+colors = {}
+primitives = []
+
+
+def fail(line_number, message):
+    raise ValueError(f"{scene_path}:{line_number}: {message}")
+
+
+def parse_color(line_number, text):
+    result = [0.0, 0.0, 0.0, 0.0]
+    for name in text.split("+"):
+        if name not in colors:
+            fail(line_number, f'Unknown color "{name}"')
+        result = [a + b for a, b in zip(result, colors[name])]
+    return result
+
+
+def parse_numbers(line_number, words):
+    try:
+        return [float(word) for word in words]
+    except ValueError:
+        fail(line_number, f"Expected numbers but got {words}")
+
+
+with open(scene_path) as scene_file:
+    for line_number, line in enumerate(scene_file, start=1):
+        words = line.split("#")[0].split()
+        if not words:
+            continue
+
+        kind = words[0]
+
+        if kind == "color" and len(words) == 6:
+            colors[words[1]] = parse_numbers(line_number, words[2:6])
+
+        elif kind == "cuboid" and len(words) == 11:
+            numbers = parse_numbers(line_number, words[1:9])
+            primitive = Primitive(kind, len(primitives),
+                                  parse_color(line_number, words[9]),
+                                  parse_color(line_number, words[10]))
+            primitive.min = numbers[0:4]
+            primitive.max = numbers[4:8]
+            primitives.append(primitive)
+
+        elif kind == "sphere" and len(words) == 8:
+            numbers = parse_numbers(line_number, words[1:6])
+            primitive = Primitive(kind, len(primitives),
+                                  parse_color(line_number, words[6]),
+                                  parse_color(line_number, words[7]))
+            primitive.center = numbers[0:4]
+            primitive.radius = numbers[4]
+            primitives.append(primitive)
+
+        else:
+            fail(line_number, f"Can't make sense of this line: {line.strip()}")
+
+
+# Build the BVH...
+#
+# The nodes are stored in depth-first order. Every node knows where its
+# subtree ends (`skip`), so the traversal doesn't need a stack: If a ray misses
+# a node, it continues at `skip`, otherwise it continues at the next node.
+# The primitives of each leaf are stored next to each other, cuboids and
+# spheres separately.
+
+class Node:
+    def __init__(self):
+        self.min = None
+        self.max = None
+        self.skip = 0
+        self.first_cuboid = 0
+        self.cuboid_count = 0
+        self.first_sphere = 0
+        self.sphere_count = 0
+
+
+nodes = []
+ordered_cuboids = []
+ordered_spheres = []
+
+
+def merge_bounds(group):
+    low = [min(p.bounds()[0][i] for p in group) for i in range(4)]
+    high = [max(p.bounds()[1][i] for p in group) for i in range(4)]
+    return low, high
+
+
+def build(group):
+    node = Node()
+    node.min, node.max = merge_bounds(group)
+    nodes.append(node)
+
+    if len(group) <= MAX_LEAF_SIZE:
+        cuboids = [p for p in group if p.kind == "cuboid"]
+        spheres = [p for p in group if p.kind == "sphere"]
+        node.first_cuboid = len(ordered_cuboids)
+        node.cuboid_count = len(cuboids)
+        node.first_sphere = len(ordered_spheres)
+        node.sphere_count = len(spheres)
+        ordered_cuboids.extend(cuboids)
+        ordered_spheres.extend(spheres)
+    else:
+        # Split the primitives in half along the axis where their centroids
+        # are the most spread out.
+        centroids = [p.centroid() for p in group]
+        spread = [max(c[i] for c in centroids) - min(c[i] for c in centroids)
+                  for i in range(4)]
+        axis = spread.index(max(spread))
+        group = sorted(group, key=lambda p: (p.centroid()[axis],
+                                             p.scene_index))
+        middle = len(group) // 2
+        build(group[:middle])
+        build(group[middle:])
+
+    node.skip = len(nodes)
+
+
+if primitives:
+    build(primitives)
+
+
+# Write the header...
+
+def number(value):
+    # repr gives the shortest text that turns back into exactly the same double
+    return repr(float(value))
+
+
+def array(values, format_value=number):
+    # Arrays of length 0 aren't allowed, so empty arrays get a dummy element.
+    if not values:
+        return "{0}"
+    return "{" + ", ".join(format_value(v) for v in values) + "}"
+
+
+def array_2d(rows, format_value=number):
+    return "{\n" + ",\n".join("    " + array(row, format_value)
+                              for row in rows) + "\n}"
+
+
+def axes(values_per_axis):
+    return array_2d([[v[i] for v in values_per_axis] for i in range(4)])
+
+
+cuboid_count = len(ordered_cuboids)
+sphere_count = len(ordered_spheres)
+node_count = len(nodes)
+size = lambda n: max(n, 1)
+primitive_size = size(len(primitives))
+
+lines = [
+    f"// Generated by compile_scene.py from {os.path.basename(scene_path)}.",
+    "// Don't edit this file, edit the scene file instead.",
+    "#pragma once",
+    "",
+    "namespace static_scene {",
+    "",
+    f"inline constexpr unsigned primitive_count = {len(primitives)};",
+    f"inline constexpr unsigned cuboid_count = {cuboid_count};",
+    f"inline constexpr unsigned sphere_count = {sphere_count};",
+    f"inline constexpr unsigned node_count = {node_count};",
+    "",
+    "// Cuboids. The first index of min and max is the axis.",
+    f"inline constexpr double cuboid_min[4][{size(cuboid_count)}] = "
+    f"{axes([p.min for p in ordered_cuboids])};",
+    f"inline constexpr double cuboid_max[4][{size(cuboid_count)}] = "
+    f"{axes([p.max for p in ordered_cuboids])};",
+    f"inline constexpr double cuboid_light_color[{size(cuboid_count)}][4] = "
+    f"{array_2d([p.light for p in ordered_cuboids])};",
+    f"inline constexpr double cuboid_dark_color[{size(cuboid_count)}][4] = "
+    f"{array_2d([p.dark for p in ordered_cuboids])};",
+    f"inline constexpr unsigned cuboid_scene_index[{size(cuboid_count)}] = "
+    f"{array([p.scene_index for p in ordered_cuboids], str)};",
+    "",
+    "// Spheres. The first index of center is the axis.",
+    f"inline constexpr double sphere_center[4][{size(sphere_count)}] = "
+    f"{axes([p.center for p in ordered_spheres])};",
+    f"inline constexpr double sphere_radius[{size(sphere_count)}] = "
+    f"{array([p.radius for p in ordered_spheres])};",
+    f"inline constexpr double sphere_light_color[{size(sphere_count)}][4] = "
+    f"{array_2d([p.light for p in ordered_spheres])};",
+    f"inline constexpr double sphere_dark_color[{size(sphere_count)}][4] = "
+    f"{array_2d([p.dark for p in ordered_spheres])};",
+    f"inline constexpr unsigned sphere_scene_index[{size(sphere_count)}] = "
+    f"{array([p.scene_index for p in ordered_spheres], str)};",
+    "",
+    "// The colors of every primitive, by scene index, so that a hit that's",
+    "// only known by its index can be shaded without a search.",
+    f"inline constexpr double primitive_light_color[{primitive_size}][4] = "
+    f"{array_2d([p.light for p in primitives])};",
+    f"inline constexpr double primitive_dark_color[{primitive_size}][4] = "
+    f"{array_2d([p.dark for p in primitives])};",
+    "",
+    "// The BVH, in depth-first order.",
+    f"inline constexpr double node_min[4][{size(node_count)}] = "
+    f"{axes([n.min for n in nodes])};",
+    f"inline constexpr double node_max[4][{size(node_count)}] = "
+    f"{axes([n.max for n in nodes])};",
+    f"inline constexpr unsigned node_skip[{size(node_count)}] = "
+    f"{array([n.skip for n in nodes], str)};",
+    f"inline constexpr unsigned node_first_cuboid[{size(node_count)}] = "
+    f"{array([n.first_cuboid for n in nodes], str)};",
+    f"inline constexpr unsigned node_cuboid_count[{size(node_count)}] = "
+    f"{array([n.cuboid_count for n in nodes], str)};",
+    f"inline constexpr unsigned node_first_sphere[{size(node_count)}] = "
+    f"{array([n.first_sphere for n in nodes], str)};",
+    f"inline constexpr unsigned node_sphere_count[{size(node_count)}] = "
+    f"{array([n.sphere_count for n in nodes], str)};",
+    "",
+    "}  // namespace static_scene",
+    "",
+]
+header = "\n".join(lines)
+
+os.makedirs(os.path.dirname(os.path.abspath(output_path)), exist_ok=True)
+
+if os.path.exists(output_path):
+    with open(output_path) as old_file:
+        if old_file.read() == header:
+            print("The scene header is up to date. Nothing was written.")
+            sys.exit(0)
+
+with open(output_path, "w") as output_file:
+    output_file.write(header)
+
+# Say goodbye...
+print(f"Wrote {cuboid_count} cuboids, {sphere_count} spheres and "
+      f"{node_count} BVH nodes.")
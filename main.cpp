@@ -12,11 +12,11 @@
 
 #include <SDL2/SDL.h>
 
-void realMain();
+void realMain(int argument_count, char* arguments[]);
 
 // SDL-Compatible main function
 extern "C" int main(int argument_count, char* arguments[])
 {
-  realMain();
+  realMain(argument_count, arguments);
   return 0;
 }
@@ -123,6 +123,12 @@ struct AlignedHypercuboid : public iIntersectable, public iColored {
     return ray.p + ray.d * t_near;
   }
   
+  bool findBoundingBall(Vec4& center, double& radius) const override {
+    center = (min + max) / 2;
+    radius = (max - min).calcLength() / 2;
+    return true;
+  }
+  
   Vec4 getLightColor() const override {
     return lightColor;
   }
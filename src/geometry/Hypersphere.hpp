@@ -36,6 +36,12 @@ struct Hypersphere : public iIntersectable, public iColored {
     return ray.p + ray.d * distance;
   }
   
+  bool findBoundingBall(Vec4& center, double& radius) const override {
+    center = this->center;
+    radius = this->radius;
+    return true;
+  }
+  
   Vec4 getLightColor() const override {
     return lightColor;
   }
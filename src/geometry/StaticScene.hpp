@@ -0,0 +1,238 @@
+#pragma once
+
+#include "math.hpp"
+
+// This header is generated from scenes/demo.scene by compile_scene.py.
+// It lives in the build folder.
+#include "static_scene_data.hpp"
+
+
+// The static part of the world, which is compiled into constexpr arrays at
+// build time. Everything in here is found through the BVH that
+// compile_scene.py builds, so there's no loop over every primitive.
+//
+// Each primitive of the static scene has an index, which is its position in
+// the scene file. Forms that are added to `world` at runtime come after them.
+
+
+struct StaticSceneHit {
+  double distance = Limits<double>::infinity();
+  uint sceneIndex = maxOf<uint>;
+  const double* lightColor = nullptr;
+  const double* darkColor = nullptr;
+  uint work = 0;  // BVH nodes + primitives tested, if they're being counted.
+  
+  bool isHit() const {
+    return lightColor != nullptr;
+  }
+  
+  // Replaces the current hit if the new one is closer.
+  // Hits at the same distance go to the primitive that comes first in the
+  // scene file, just like they did when the scene was a list of forms.
+  void consider(double newDistance, uint newIndex,
+                const double* newLightColor, const double* newDarkColor) {
+    if (newDistance < distance
+        || (newDistance == distance && newIndex < sceneIndex)) {
+      distance = newDistance;
+      sceneIndex = newIndex;
+      lightColor = newLightColor;
+      darkColor = newDarkColor;
+    }
+  }
+};
+
+
+namespace static_scene {
+
+// The amount of steps along the ray to where it enters the box, or a negative
+// number if it misses the box. This is the same algorithm as in
+// AlignedHypercuboid.
+// `inverse_d` is 1 / ray.d for each axis.
+template<class GetMin, class GetMax>
+inline double findBoxEntry(
+    const Ray& ray, const Vec4& inverse_d, GetMin getMin, GetMax getMax
+) {
+  double t_near = -Limits<double>::infinity();
+  double t_far = Limits<double>::infinity();
+  
+  for (uint axis = 0; axis < 4; axis++) {
+    double t0 = (getMin(axis) - ray.p[axis]) * inverse_d[axis];
+    double t1 = (getMax(axis) - ray.p[axis]) * inverse_d[axis];
+    
+    if (t1 < t0)
+      std::swap(t0, t1);
+    
+    t_near = std::max(t_near, t0);
+    t_far = std::min(t_far, t1);
+  }
+  
+  if (t_near > t_far)
+    return -Limits<double>::infinity();
+  return t_near;
+}
+
+
+// The BVH nodes also have to accept rays that start inside them.
+inline bool isNodeCloserThan(
+    const Ray& ray, const Vec4& inverse_d, uint node, double distance
+) {
+  double t_near = -Limits<double>::infinity();
+  double t_far = distance;
+  
+  for (uint axis = 0; axis < 4; axis++) {
+    double t0 = (node_min[axis][node] - ray.p[axis]) * inverse_d[axis];
+    double t1 = (node_max[axis][node] - ray.p[axis]) * inverse_d[axis];
+    
+    if (t1 < t0)
+      std::swap(t0, t1);
+    
+    t_near = std::max(t_near, t0);
+    t_far = std::min(t_far, t1);
+  }
+  
+  return t_near <= t_far && t_far >= 0;
+}
+
+
+inline void intersectCuboid(
+    const Ray& ray, const Vec4& inverse_d, uint i, StaticSceneHit& hit
+) {
+  double t = findBoxEntry(
+      ray, inverse_d,
+      [&](uint axis) { return cuboid_min[axis][i]; },
+      [&](uint axis) { return cuboid_max[axis][i]; }
+  );
+  
+  // A ray that starts inside a cuboid doesn't hit it either (t < 0).
+  if (t >= 0) {
+    hit.consider(t, cuboid_scene_index[i],
+                 cuboid_light_color[i], cuboid_dark_color[i]);
+  }
+}
+
+
+inline void intersectSphere(const Ray& ray, uint i, StaticSceneHit& hit) {
+  // The same algorithm as Hypersphere::findIntersection
+  Vec4 O_C = ray.p - Vec4(sphere_center[0][i], sphere_center[1][i],
+                          sphere_center[2][i], sphere_center[3][i]);
+  double p = ray.d.dot(O_C);
+  double q = O_C.dot(O_C) - sphere_radius[i] * sphere_radius[i];
+  
+  double discriminant = p*p - q;
+  if (discriminant < 0.0)
+    return;
+  
+  double t = -p - sqrt(discriminant);
+  
+  if (t >= 0) {
+    hit.consider(t, sphere_scene_index[i],
+                 sphere_light_color[i], sphere_dark_color[i]);
+  }
+}
+
+}  // namespace static_scene
+
+
+/** Finds the nearest primitive of the static scene that the ray hits.
+ * With `countWork`, the hit also says how much work it took to find it. */
+template<bool countWork = false>
+StaticSceneHit findNearestStaticHit(const Ray& ray) {
+  using namespace static_scene;
+  
+  StaticSceneHit hit;
+  
+  // Division by zero gives infinity here, which is what the slab test wants.
+  const Vec4 inverse_d = {1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z, 1 / ray.d.w};
+  
+  uint node = 0;
+  
+  while (node < node_count) {
+    if constexpr (countWork)
+      hit.work++;
+    
+    if (!isNodeCloserThan(ray, inverse_d, node, hit.distance)) {
+      node = node_skip[node];
+      continue;
+    }
+    
+    const uint first_cuboid = node_first_cuboid[node];
+    const uint end_cuboid = first_cuboid + node_cuboid_count[node];
+    for (uint i = first_cuboid; i < end_cuboid; i++)
+      intersectCuboid(ray, inverse_d, i, hit);
+    
+    const uint first_sphere = node_first_sphere[node];
+    const uint end_sphere = first_sphere + node_sphere_count[node];
+    for (uint i = first_sphere; i < end_sphere; i++)
+      intersectSphere(ray, i, hit);
+    
+    if constexpr (countWork)
+      hit.work += node_cuboid_count[node] + node_sphere_count[node];
+    
+    node++;
+  }
+  
+  return hit;
+}
+
+
+
+#ifdef ENABLE_DOCTEST
+#include <doctest/doctest.h>
+TEST_CASE("the static scene is laid out correctly") {
+  using namespace static_scene;
+  
+  // Every primitive is in exactly one leaf.
+  uint cuboids = 0;
+  uint spheres = 0;
+  
+  for (uint node = 0; node < node_count; node++) {
+    cuboids += node_cuboid_count[node];
+    spheres += node_sphere_count[node];
+    CHECK(node_skip[node] > node);
+    CHECK(node_skip[node] <= node_count);
+  }
+  
+  CHECK(cuboids == cuboid_count);
+  CHECK(spheres == sphere_count);
+  CHECK(cuboid_count + sphere_count == primitive_count);
+  
+  // Every primitive has its colors under its scene index.
+  for (uint i = 0; i < cuboid_count; i++)
+    CHECK(primitive_light_color[cuboid_scene_index[i]][0]
+          == cuboid_light_color[i][0]);
+  for (uint i = 0; i < sphere_count; i++)
+    CHECK(primitive_dark_color[sphere_scene_index[i]][2]
+          == sphere_dark_color[i][2]);
+}
+
+
+TEST_CASE("the static scene BVH finds the same hits as a brute force search") {
+  using namespace static_scene;
+  
+  auto bruteForce = [](const Ray& ray) {
+    const Vec4 inverse_d = {1/ray.d.x, 1/ray.d.y, 1/ray.d.z, 1/ray.d.w};
+    StaticSceneHit hit;
+    for (uint i = 0; i < cuboid_count; i++)
+      intersectCuboid(ray, inverse_d, i, hit);
+    for (uint i = 0; i < sphere_count; i++)
+      intersectSphere(ray, i, hit);
+    return hit;
+  };
+  
+  // Look around in a bunch of directions from a few places.
+  const Vec4 origins[] = {{0,0,0,0}, {35,-25,-1.5,35}, {-50,60,20,-40}};
+  
+  for (const Vec4& origin : origins) {
+    for (int i = 0; i < 200; i++) {
+      Vec4 direction = dir_vec(i * 0.37, (i % 17) * 0.17 - 1.4, i * 0.11);
+      Ray ray = {origin, direction};
+      
+      StaticSceneHit expected = bruteForce(ray);
+      StaticSceneHit actual = findNearestStaticHit(ray);
+      
+      CHECK(actual.sceneIndex == expected.sceneIndex);
+      CHECK(actual.distance == expected.distance);
+    }
+  }
+}
+#endif
@@ -5,4 +5,12 @@
 struct iIntersectable {
   virtual ~iIntersectable() = default;
   virtual Vec4 findIntersection(const Ray& ray) const = 0;
+  
+  // A ball that the form fits in, for finding where it is on the screen.
+  // Returns false if the form doesn't know one.
+  virtual bool findBoundingBall(Vec4& center, double& radius) const {
+    (void) center;
+    (void) radius;
+    return false;
+  }
 };
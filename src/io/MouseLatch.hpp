@@ -0,0 +1,123 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+
+#include "util.hpp"
+
+
+// Mouse movement that hasn't turned the camera yet.
+//
+// Movement is added as the mouse events come in, and whoever turns the camera
+// takes all of it at once. That can be the main thread in update(), or the
+// tracer right before it makes the rays of a frame (late latching), which
+// shows the movement one update sooner.
+//
+// It also remembers when the oldest movement came in, which is used to
+// measure how long it takes for a mouse movement to show up on the screen.
+class MouseLatch {
+public:
+  using clock = std::chrono::steady_clock;
+  
+  struct Delta {
+    int x = 0;
+    int y = 0;
+    clock::time_point since;  // When the oldest movement came in
+    
+    bool isEmpty() const {
+      return x == 0 && y == 0;
+    }
+  };
+  
+  
+  /** Adds movement. Only for the thread that handles the events. */
+  void add(int x, int y) {
+    if (x == 0 && y == 0)
+      return;
+    
+    // Both axes are packed into one atomic, so nobody ever takes just one
+    // half of a movement.
+    u64 packed = pending.load(std::memory_order_relaxed);
+    
+    do {
+      // The first movement since the last take() sets the time.
+      if (packed == 0)
+        since.store(toTicks(clock::now()), std::memory_order_relaxed);
+    } while (!pending.compare_exchange_weak(
+        packed, pack(unpackX(packed) + x, unpackY(packed) + y),
+        std::memory_order_release, std::memory_order_relaxed
+    ));
+  }
+  
+  
+  /** The movement that was added so far, without taking it. */
+  Delta peek() const {
+    Delta delta;
+    u64 packed = pending.load(std::memory_order_acquire);
+    delta.x = unpackX(packed);
+    delta.y = unpackY(packed);
+    return delta;
+  }
+  
+  
+  /** Takes all the movement that was added so far. Any thread can do this. */
+  Delta take() {
+    Delta delta;
+    u64 packed = pending.exchange(0, std::memory_order_acquire);
+    if (packed == 0)
+      return delta;
+    
+    delta.x = unpackX(packed);
+    delta.y = unpackY(packed);
+    delta.since = clock::time_point(
+        clock::duration(since.load(std::memory_order_relaxed))
+    );
+    return delta;
+  }
+
+
+private:
+  std::atomic<u64> pending = 0;  // x in the high half, y in the low half
+  std::atomic<clock::rep> since = 0;
+  
+  
+  static clock::rep toTicks(clock::time_point time) {
+    return time.time_since_epoch().count();
+  }
+  
+  static u64 pack(int x, int y) {
+    return (u64(u32(x)) << 32) | u32(y);
+  }
+  
+  static int unpackX(u64 packed) {
+    return int(u32(packed >> 32));
+  }
+  
+  static int unpackY(u64 packed) {
+    return int(u32(packed));
+  }
+};
+
+
+
+#ifdef ENABLE_DOCTEST
+#include <doctest/doctest.h>
+TEST_CASE("mouse latch") {
+  MouseLatch latch;
+  CHECK(latch.take().isEmpty());
+  
+  auto before = MouseLatch::clock::now();
+  latch.add(3, -2);
+  latch.add(-5, 1);
+  
+  MouseLatch::Delta delta = latch.take();
+  CHECK(delta.x == -2);
+  CHECK(delta.y == -1);
+  CHECK(delta.since >= before);
+  CHECK(latch.take().isEmpty());
+  
+  latch.add(4, 0);
+  CHECK(latch.peek().x == 4);
+  CHECK(latch.take().x == 4);
+}
+#endif
@@ -25,6 +25,8 @@ void handleInput() {
   placeholder_initScalars_();
   
   while (SDL_PollEvent(&event)) {
+    inputEventCount++;
+    
     if (event.type == SDL_QUIT)
       please_stop = true;
     
@@ -49,6 +51,21 @@ void handleInput() {
 }
 
 
+void handleMouseMovement() {
+  SDL_Event events[16];
+  SDL_PumpEvents();
+  
+  int count;
+  do {
+    count = SDL_PeepEvents(
+        events, 16, SDL_GETEVENT, SDL_MOUSEMOTION, SDL_MOUSEMOTION
+    );
+    for (int i = 0; i < count; i++)
+      onMouseMove(events[i]);
+  } while (count == 16);
+}
+
+
 static void activateKey(SDL_Keysym key) {
   auto range = inputbools.equal_range(key.sym);
   
@@ -106,15 +123,13 @@ static void onWindowEvent(SDL_Event& event) {
 
 
 static void placeholder_initScalars_() {
-  turn_horizontally.value = 0;
-  turn_vertically.value = 0;
   turn_4D.value = 0;
 }
 
 
 static void placeholder_handleMouseMove_(int xrel, int yrel) {
-  turn_horizontally.value += xrel;
-  turn_vertically.value += yrel;
+  // The mouse movement is taken by whoever turns the camera.
+  mouse_movement.add(xrel, yrel);
 }
 
 
@@ -4,4 +4,11 @@
 
 inline MultiMap<SDL_Keycode, class InputBool*> inputbools;
 
+// How many events handleInput has seen so far.
+inline uint inputEventCount = 0;
+
 void handleInput();
+
+// Handles only the mouse movement events, and leaves the rest for the next
+// handleInput. Meant to be called often while waiting for a frame.
+void handleMouseMovement();
@@ -3,6 +3,8 @@
 #include <SDL2/SDL.h>
 
 #include "math.hpp"
+#include "render/TileScheduler.hpp"
+#include "render/ViewRays.hpp"
 
 
 class FlyingCameraController {
@@ -46,10 +48,11 @@ public:
   
   
   void applyMovement(double deltaTime) {
-    Vec4 direction = dir_vec(yaw, pitch, wy_rotation);
-    Vec4 right = dir_vec(yaw + pi/2, 0, wy_rotation);
-    Vec4 up = dir_vec(yaw, pitch + pi/2, wy_rotation);
-    Vec4 w_up = {0,sin(wy_rotation),0,cos(wy_rotation)};
+    Matrix<4,4> orientation = calcOrientation();
+    Vec4 direction = column(orientation, 0);
+    Vec4 right = column(orientation, 1);
+    Vec4 up = column(orientation, 2);
+    Vec4 w_up = column(orientation, 3);
     
     pos += speed * deltaTime * velocity.y * direction;
     pos += speed * deltaTime * velocity.x * right;
@@ -68,107 +71,128 @@ public:
   }
   
   
-  // Calculates a ray for each pixel on the screen, and hands that ray to the
-  // provided function (stored in `doSomething`).
-  template<class CustomFunction>
-  void forEachRay(int width, int height, CustomFunction doSomething) const {
-    const auto wy_r = wy_rotation;
-    
+  // The rotation of the camera as one matrix. The columns of the matrix are
+  // the forward, right, up and W-up directions of the camera.
+  Matrix<4,4> calcOrientation() const {
+    // Pitch on the XZ plane, then yaw on the XY plane, and finally turn the
+    // Y axis towards W.
+    return rotationMatrix(3, 1, wy_rotation)
+           * rotationMatrix(0, 1, yaw)
+           * rotationMatrix(0, 2, pitch);
+  }
+  
+  
+  // The view basis turns (xn, yn, 1, 0) into the direction of the ray through
+  // that point of the screen, where xn and yn go from -0.5 to 0.5.
+  Matrix<4,4> calcViewBasis(int width, int height) const {
     double screen_ratio = width / double(height);
     double fov_x = screen_ratio * fov_y;
     
-    // The direction vector for the ray of the center of the screen
-    Vec4 centerDir = dir_vec(yaw, pitch, wy_r);
-  
     // The view rectangle is a slice of the view frustrum.
-    // These two vectors define the orientation and size of the view rectangle
-    // where viewrect_x determines the horizontal direction (which is on the xy
-    // or xw plane when wy_rot is a multiple of 90 degrees)
-    // and viewrect_y determines the vertical direction,
-    // which should be orthogonal to viewrect_x and the forwards direction.
-    // viewrect_y is inverted so that the z-axis points upwards instead of down.
+    // The first column of `viewrect` determines the horizontal direction of
+    // the view rectangle and the second column the vertical direction, which
+    // is inverted so that the z-axis points upwards instead of down.
+    // The third column points to the center of the rectangle.
     double viewrect_width = 2 * tan(fov_x/2);
     double viewrect_height = 2 * tan(fov_y/2);
-    Vec4 viewrect_x = dir_vec(yaw + pi/2, 0, wy_r) * viewrect_width;
-    Vec4 viewrect_y = dir_vec(yaw, pitch + pi/2, wy_r) * viewrect_height * -1;
+    Matrix<4,4> viewrect = {
+        0,              0,                1, 0,
+        viewrect_width, 0,                0, 0,
+        0,              -viewrect_height, 0, 0,
+        0,              0,                0, 0
+    };
+    
+    return calcOrientation() * viewrect;
+  }
+  
+  
+  // Everything that's needed to make the rays of this frame.
+  ViewRays calcViewRays(int width, int height) const {
+    return {pos, calcViewBasis(width, height), width, height};
+  }
   
   
+  // Calculates a ray for each pixel on the screen, and hands that ray to the
+  // provided function (stored in `doSomething`).
+  template<class CustomFunction>
+  void forEachRay(int width, int height, CustomFunction doSomething) const {
+    const ViewRays view = calcViewRays(width, height);
+  
     // For each pixel...
     for (int y = 0; y < height; y++) {
       for (int x = 0; x < width; x++) {
-        // Create a ray...
-        double xn = x / double(width-1) - 0.5;  // xn: x from -0.5 to 0.5
-        double yn = y / double(height-1) - 0.5;
-        Vec4 rayDir = normalize(centerDir + xn*viewrect_x + yn*viewrect_y);
-        Ray ray = {pos, rayDir};
-      
-        // And call the given function...
-        doSomething(x, y, ray);
+        // Create a ray and call the given function...
+        doSomething(x, y, view.rayAt(x, y));
       }
     }
   }
 
 
 #ifdef ENABLE_THREADS
-  template<class CustomFunction>
+  // Like the other forEachRay, but the screen is cut into tiles, which are
+  // spread over the threads (see TileScheduler).
+  //
+  // Only the rays of the refinement pass are made (all of them by default).
+  // Tiles that the scheduler wants traced sparsely (because the deadline is
+  // close) may get even fewer. After that, fillTile(tile, step) is called to
+  // fill in the rest of the tile (with step 1 if it was traced whole).
+  template<class CustomFunction, class FillFunction>
   void forEachRay(
-      int width, int height, ThreadPool& threadPool, CustomFunction doSomething
-  ) {
-    // See the other implementation of forEachRay for comments on this part
-    const auto wy_r = wy_rotation;
-    double screen_ratio = width / double(height);
-    double fov_x = screen_ratio * fov_y;
-    Vec4 centerDir = dir_vec(yaw, pitch, wy_r);
-    double viewrect_width = 2 * tan(fov_x/2);
-    double viewrect_height = 2 * tan(fov_y/2);
-    Vec4 viewrect_x = dir_vec(yaw + pi/2, 0, wy_r) * viewrect_width;
-    Vec4 viewrect_y = dir_vec(yaw, pitch + pi/2, wy_r) * viewrect_height * -1;
-    
-    // Here's the new stuff:
+      int width, int height, ThreadPool& threadPool, TileScheduler& tiles,
+      RefinementPass pass, CustomFunction doSomething, FillFunction fillTile
+  ) const {
+    const ViewRays view = calcViewRays(width, height);
     
-    auto handleRow = [=](uint y) {
-      for (int x = 0; x < width; x++) {
-        // Create a ray...
-        double xn = x / double(width-1) - 0.5;  // xn: x from -0.5 to 0.5
-        double yn = y / double(height-1) - 0.5;
-        Vec4 rayDir = normalize(centerDir + xn*viewrect_x + yn*viewrect_y);
-        Ray ray = {pos, rayDir};
+    // Everyone gets some work units, the calling thread included.
+    tiles.prepare(width, height, threadPool.num_threads() + 1);
     
-        // And call the given function...
-        doSomething(x, y, ray);
-      }
-    };
-    
-    
-    uint task_count = 4 * threadPool.num_threads();
-    uint rows_per_task = height / task_count;
-    List<std::future<void>> futures;
-  
-    // Create the first n-1 tasks...
-    for (uint i = 0; i < task_count-1; i++) {
-      futures.emplace_back(threadPool.Submit([=]() {
-        uint min_y = rows_per_task * i;
-        uint max_y = min_y + rows_per_task;
+    // The threads take the work units in order, and the calling thread helps.
+    threadPool.ParallelFor(tiles.getWorkUnits().size(), [&](std::size_t i) {
+      tiles.runWorkUnit(i, [&](const Tile& tile, int step) {
+        if (step == 1 && pass.isComplete()) {
+          for (int y = tile.y; y < tile.y + tile.height; y++)
+            for (int x = tile.x; x < tile.x + tile.width; x++)
+              doSomething(x, y, view.rayAt(x, y));
+          fillTile(tile, 1);
+          return;
+        }
         
-        for (uint y = min_y; y < max_y; y++)
-          handleRow(y);
-      }));
-    }
-    
-    // Create the last task...
-    // The last task might have a few more rows if `height` isn't
-    // divisible by `task_count`.
-    futures.emplace_back(threadPool.Submit([=]() {
-      uint min_y = rows_per_task * (task_count - 1);
-      uint max_y = height;
-      
-      for (uint y = min_y; y < max_y; y++)
-        handleRow(y);
-    }));
-    
-    // Wait until all the threads are done rendering.
-    for (const auto& future : futures)
-      future.wait();
+        // A tile that's sparser than the pass starts over.
+        const RefinementPass tilePass = step > pass.step ? RefinementPass{step}
+                                                         : pass;
+        forEachRefinedPixel(tile, tilePass, [&](int x, int y) {
+          doSomething(x, y, view.rayAt(x, y));
+        });
+        fillTile(tile, tilePass.step);
+      });
+    });
   }
 #endif
 };
+
+
+
+#ifdef ENABLE_DOCTEST
+#include <doctest/doctest.h>
+TEST_CASE("camera view basis") {
+  auto approxEquals = [](Vec4 a, Vec4 b) -> bool {
+    Vec4 diff = a - b;
+    return diff.calcLength() < 0.000001;
+  };
+  
+  FlyingCameraController camera;
+  camera.yaw = 0.4;
+  camera.pitch = 0.2;
+  camera.wy_rotation = 2.5;
+  
+  // The center of the screen looks straight ahead.
+  Matrix<4,4> basis = camera.calcViewBasis(800, 600);
+  Vec4 center = normalize(basis * Vec4(0, 0, 1, 0));
+  CHECK(approxEquals(center, dir_vec(0.4, 0.2, 2.5)));
+  
+  // The right edge of the screen is towards the camera's right.
+  Vec4 right = dir_vec(0.4 + pi/2, 0, 2.5);
+  Vec4 edge = basis * Vec4(0.5, 0, 1, 0);
+  CHECK(edge.dot(right) > 0);
+}
+#endif
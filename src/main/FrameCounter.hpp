@@ -1,6 +1,7 @@
 #pragma once
 
 
+#include <algorithm>
 #include <chrono>
 #include "util.hpp"
 
@@ -13,6 +14,34 @@ struct FrameCounter {
   uint framesElapsed = 0;
   clock::time_point next_second = clock::now() + seconds(1);
   
+  // The average time between a mouse movement and the frame that shows it
+  // appearing on the screen, in seconds. Zero if the mouse didn't move.
+  double inputLatency = 0;
+  double latencySum = 0;
+  uint latencySamples = 0;
+  
+  // The time that 99% of the recent frames took at most, in seconds. The
+  // slow frames stand out more than they do in the framerate.
+  static constexpr uint FRAME_TIME_SAMPLES = 500;
+  double p99FrameTime = 0;
+  List<double> frameTimes;  // The most recent ones, as a ring buffer
+  uint nextFrameTime = 0;
+  
+  
+  void addInputLatency(double seconds) {
+    latencySum += seconds;
+    latencySamples++;
+  }
+  
+  
+  void addFrameTime(double seconds) {
+    if (frameTimes.size() < FRAME_TIME_SAMPLES)
+      frameTimes.push_back(seconds);
+    else
+      frameTimes[nextFrameTime] = seconds;
+    nextFrameTime = (nextFrameTime + 1) % FRAME_TIME_SAMPLES;
+  }
+  
   
   bool updateFramerate() {
     framesElapsed++;
@@ -34,6 +63,17 @@ struct FrameCounter {
     framerate = framesElapsed / double(secondsElapsed);
     framesElapsed = 0;
     
+    inputLatency = latencySamples == 0 ? 0 : latencySum / latencySamples;
+    latencySum = 0;
+    latencySamples = 0;
+    
+    if (!frameTimes.empty()) {
+      List<double> sorted = frameTimes;
+      auto p99 = sorted.begin() + sorted.size() * 99 / 100;
+      std::nth_element(sorted.begin(), p99, sorted.end());
+      p99FrameTime = *p99;
+    }
+    
     return true;
   }
 };
\ No newline at end of file
@@ -1,10 +1,14 @@
 #include <SDL2/SDL.h>
 #include <cassert>
+#include <cstring>
 
 #include "MainScreen.hpp"
 #include "inputs.hpp"
+#include "io/handleInput.hpp"
 #include "realMain.hpp"
 #include "raytrace.hpp"
+#include "render/Autotuner.hpp"
+#include "render/renderPixel.hpp"
 #include "util/debug.hpp"
 #include "math/shape_rasterize.hpp"
 
@@ -13,6 +17,15 @@ MainScreen::~MainScreen() {
   toggle_controls_display->onActivate = nullptr;
   toggle_status_display->onActivate = nullptr;
   toggle_smaller_view->onActivate = nullptr;
+  toggle_heatmap->onActivate = nullptr;
+  toggle_antialiasing->onActivate = nullptr;
+  start_autotuning->onActivate = nullptr;
+  toggle_dynamic_resolution->onActivate = nullptr;
+  toggle_progressive->onActivate = nullptr;
+  toggle_reprojection->onActivate = nullptr;
+  toggle_subsampling->onActivate = nullptr;
+  toggle_checkerboard->onActivate = nullptr;
+  toggle_foveation->onActivate = nullptr;
   turn_4D_up->onActivate = nullptr;
   turn_4D_down->onActivate = nullptr;
 }
@@ -20,6 +33,13 @@ MainScreen::~MainScreen() {
 
 void MainScreen::init() {
   initAssets();
+  resolution.targetSeconds = 1 / TARGET_FRAMERATE;
+  pipeline.queueDepth = renderSettings.frameQueueDepth;
+  isFoveated = renderSettings.foveationFalloff > 0;
+  edges.maxSamples = renderSettings.edgeAaSamples;
+  pipeline.init(int(windowWidth), int(windowHeight));
+  firstTouchCanvas();
+  autotune(false);
   
   toggle_controls_display->onActivate = [this]() {
     isControlsVisible = !isControlsVisible;
@@ -37,6 +57,42 @@ void MainScreen::init() {
     if (targetZoomFactor <= 0.1)
       targetZoomFactor = 1;
   };
+  toggle_heatmap->onActivate = [this]() {
+    renderFlags ^= RENDER_HEATMAP;
+  };
+  toggle_antialiasing->onActivate = [this]() {
+    // No antialiasing, then four rays per pixel, then averaged frames, then
+    // more rays only on the edges.
+    if (renderFlags & RENDER_ANTIALIASING)
+      renderFlags ^= RENDER_ANTIALIASING | RENDER_TEMPORAL_AA;
+    else if (renderFlags & RENDER_TEMPORAL_AA)
+      renderFlags ^= RENDER_TEMPORAL_AA | RENDER_EDGE_AA;
+    else if (renderFlags & RENDER_EDGE_AA)
+      renderFlags ^= RENDER_EDGE_AA;
+    else
+      renderFlags ^= RENDER_ANTIALIASING;
+  };
+  start_autotuning->onActivate = [this]() {
+    autotune(true);
+  };
+  toggle_dynamic_resolution->onActivate = [this]() {
+    isResolutionDynamic = !isResolutionDynamic;
+  };
+  toggle_progressive->onActivate = [this]() {
+    isProgressive = !isProgressive;
+  };
+  toggle_reprojection->onActivate = [this]() {
+    isReprojecting = !isReprojecting;
+  };
+  toggle_subsampling->onActivate = [this]() {
+    isSubsampling = !isSubsampling;
+  };
+  toggle_checkerboard->onActivate = [this]() {
+    isCheckerboard = !isCheckerboard;
+  };
+  toggle_foveation->onActivate = [this]() {
+    isFoveated = !isFoveated;
+  };
   turn_4D_up->onActivate = [this]() {
     queuedWyRotations++;
   };
@@ -46,39 +102,490 @@ void MainScreen::init() {
 }
 
 
-void MainScreen::render() {
-  clearScreen();
+// Clears the canvases, tile by tile, on all the threads. Which thread traces a
+// tile changes from frame to frame, so this can't put a tile's memory close
+// to the thread that traces it. But the memory does end up spread over the
+// NUMA nodes of all the threads, instead of all of it on the node of the
+// main thread, so no single node's memory bandwidth holds the others up.
+void MainScreen::firstTouchCanvas() {
+  for (int i = 0; i < 2; i++) {
+    SDL_Surface* canvas = pipeline.getBuffers()[i].surface;
+    u8* pixels = reinterpret_cast<u8*>(canvas->pixels);
+    float* distances = pipeline.getBuffers()[i].distances.get();
+    u32* primitives = pipeline.getBuffers()[i].primitives.get();
+    const int pitch = canvas->pitch;
+    
+    auto clearTile = [&](const Tile& tile) {
+      for (int y = tile.y; y < tile.y + tile.height; y++) {
+        memset(pixels + y * pitch + tile.x * 4, 0, tile.width * 4);
+        std::fill_n(distances + y * canvas->w + tile.x, tile.width,
+                    Limits<float>::infinity());
+        std::fill_n(primitives + y * canvas->w + tile.x, tile.width,
+                    NO_PRIMITIVE);
+      }
+    };
+
+#ifdef ENABLE_THREADS
+    tiles.prepare(canvas->w, canvas->h, threads->num_threads() + 1);
+    threads->ParallelFor(tiles.getWorkUnits().size(), [&](std::size_t i) {
+      tiles.runWorkUnit(i, clearTile);
+    });
+#else
+    clearTile({0, 0, canvas->w, canvas->h});
+#endif
+  }
+}
+
+
+// Picks the tile size and thread count that render the fastest on this
+// machine, at the resolution that's traced. The choice is remembered in
+// autotune.txt, so this only measures anything on the first run (or when
+// it's forced).
+//
+// With dynamic resolution, that's a fraction of the window size. At the
+// start, the fraction is estimated from a frame at the full size (the time
+// grows with the amount of pixels), and the resolution controller starts
+// there. The fraction is rounded to eighths for the cache.
+void MainScreen::autotune(bool isForced) {
+#ifdef ENABLE_THREADS
+  // The threads and the tiles are about to be used and maybe replaced. The
+  // frame that's being traced is finished first, so that it's the one that
+  // gets presented, and not the frames traced here.
+  finishTracing();
+  
+  static String$ cachePath = "autotune.txt";
+  static String$ pinNames[] = {"none", "cores", "numa"};
+  
+  // Thread counts that were chosen by the user aren't tuned.
+  const bool isThreadCountFixed = threadSettings.threadCount != 0;
+  const uint maxThreads = threadSettings.calcThreadCount();
+  
+  // The canvas that's traced next holds a frame that was already shown, so
+  // it can be drawn over here.
+  CanvasBuffer& canvas = pipeline.getTracingBuffer();
+  const DynamicScene& scene = world.getLatest();
+  tiles.deadline = TileScheduler::clock::time_point::max();
+  tiles.foveation = {};
+  auto timeFrame = [&](int width, int height) {
+    auto start = std::chrono::steady_clock::now();
+    traceViewport<RENDER_DEFAULT>(canvas, camera, scene, width, height);
+    std::chrono::duration<double> duration =
+        std::chrono::steady_clock::now() - start;
+    return duration.count();
+  };
+  
+  int width = int(windowWidth);
+  int height = int(windowHeight);
+  if (isResolutionDynamic) {
+    double scale = resolution.getScale();
+    if (!isForced) {
+      timeFrame(width, height);  // Teaches the tile scheduler the costs
+      const double seconds = timeFrame(width, height);
+      scale = std::sqrt(resolution.targetSeconds / seconds);
+      scale = std::clamp(scale, resolution.minScale, resolution.maxScale);
+      resolution.reset(scale);
+    }
+    scale = std::max(std::round(scale * 8) / 8, resolution.minScale);
+    width = std::max(int(width * scale), 2);
+    height = std::max(int(height * scale), 2);
+  }
+  
+  const String key =
+      $(width)+"x"+$(height)
+      +"-cpus"+$(std::thread::hardware_concurrency())
+      +"-pin"+pinNames[int(threadSettings.pinMode)]
+      +(isThreadCountFixed ? "-threads"+$(maxThreads) : "");
+  
+  auto cache = loadTuningCache(cachePath);
+  RenderConfig best;
+  
+  if (cache.count(key) != 0 && !isForced) {
+    best = cache[key];
+  } else {
+    printf("Autotuning for %s...\n", key.c_str());
+    
+    List<uint> threadCounts = candidateThreadCounts(maxThreads);
+    if (isThreadCountFixed)
+      threadCounts = {maxThreads};
+    
+    auto configs = combineConfigs({8, 16, 32, 64}, threadCounts);
+    
+    best = findFastestConfig(configs, [&](RenderConfig config) {
+      if (threads->num_threads() != config.threadCount)
+        threads = createThreadPool(config.threadCount);
+      tiles.tileSize = config.tileSize;
+      
+      // The first frame teaches the tile scheduler the tile costs.
+      timeFrame(width, height);
+      double fastest = Limits<double>::infinity();
+      for (int frame = 0; frame < 2; frame++)
+        fastest = std::min(fastest, timeFrame(width, height));
+      return fastest;
+    });
+    
+    cache[key] = best;
+    saveTuningCache(cachePath, cache);
+  }
+  
+  printf("Rendering with %u threads and %i pixel tiles.\n",
+         best.threadCount, best.tileSize);
+  
+  if (threads->num_threads() != best.threadCount)
+    threads = createThreadPool(best.threadCount);
+  tiles.tileSize = best.tileSize;
+  
+  // What's on the canvas now doesn't belong to any frame.
+  canvas.viewWidth = 0;
+  canvas.viewHeight = 0;
+  canvas.isFinal = false;
+#else
+  (void) isForced;
+#endif
+}
+
+
+// Calls doSomething(first, end) for blocks of the rows from `first` up to
+// `end`, spread over the worker threads.
+template<class Function>
+void MainScreen::forEachRowBlock(int first, int end, Function doSomething) {
+#ifdef ENABLE_THREADS
+  const int blockHeight = 16;
+  const int blocks = (end - first + blockHeight - 1) / blockHeight;
+  threads->ParallelFor(std::max(blocks, 0), [&](std::size_t i) {
+    const int blockFirst = first + int(i) * blockHeight;
+    doSomething(blockFirst, std::min(blockFirst + blockHeight, end));
+  });
+#else
+  doSomething(first, end);
+#endif
+}
+
+
+template<uint flags>
+void MainScreen::traceViewport(
+    CanvasBuffer& target, const FlyingCameraController& pose,
+    const DynamicScene& scene, int width, int height,
+    const TraceOptions& options
+) {
+  const ViewRays view = pose.calcViewRays(width, height);
+  target.view = view;
+  
+  SDL_Surface* surface = target.surface;
+  float* distances = target.distances.get();
+  u32* primitives = target.primitives.get();
+  constexpr bool isAccumulated = (flags & RENDER_TEMPORAL_AA) != 0;
+  const Vec2 jitter = isAccumulated ? accumulator.getJitter() : Vec2();
+  RefinementPass pass = options.pass;
+  
+  const CanvasBuffer* previous = options.previous;
+  const CanvasBuffer* reprojected = options.isReusingHits ? previous : nullptr;
+  if (previous != nullptr)
+    reprojectHits(*previous, view, surface->w);
+  
+  // The colors are quantized a row of pixels at a time, by the row writer
+  // of each thread. Before anything reads the pixels, it's finished, like at
+  // the start and the end of fillTile. Canvases that don't fit into the
+  // cache are streamed when nothing reads them again in this frame.
+  u32* pixels = target.pixels.get();
+  const bool isStreamed =
+      std::size_t(surface->pitch) * surface->h >= STREAMED_CANVAS_BYTES
+      && options.pass.isComplete() && !options.isAdaptive
+      && (flags & RENDER_EDGE_AA) == 0;
+  auto output = [&](int x, int y, const Vec4& color) {
+    getThreadRowWriter().write(pixels + y * surface->w + x, color, isStreamed);
+  };
+  
+  auto tracePixel = [&](int x, int y, Ray ray) {
+    const int i = y * surface->w + x;
+    
+    // Pixels that can reuse a hit of the previous frame are only shaded.
+    Reprojector::Hit hit;
+    if (reprojected != nullptr
+        && reprojector.findHit(*reprojected, x, y, hit)) {
+      output(x, y,
+             shadePrimitive(scene, ray, hit.primitive, hit.distance));
+      distances[i] = hit.distance;
+      primitives[i] = hit.primitive;
+      return;
+    }
+    
+    if constexpr (isAccumulated)
+      ray = view.rayAt(x + jitter.x, y + jitter.y);
+    
+    PixelSample pixel = renderPixel<flags>(scene, view, x, y, ray);
+    if constexpr (isAccumulated) {
+      // The averages are quantized straight from the accumulator's floats.
+      accumulator.add(x, y, pixel.color);
+      getThreadRowWriter().write(pixels + i, accumulator.getAverage(x, y),
+                                 isStreamed);
+    } else {
+      output(x, y, pixel.color);
+    }
+    distances[i] = pixel.distance;
+    primitives[i] = pixel.primitive;
+  };
   
+  // Adaptive subsampling: Only a sparse grid is traced at first. The gaps
+  // in the grid between four hits of the same primitive (or four misses)
+  // are shaded as if they hit that primitive too, at the interpolated
+  // distance. The rest of the gaps are traced.
+  const bool isSubsampled = options.isAdaptive && pass.isComplete();
+  if (isSubsampled)
+    pass = {ADAPTIVE_STEP};
+  
+  auto fillAdaptively = [&](const Tile& tile, int step) {
+    const int stride = surface->w;
+    forEachGridGap(tile, step, [&](const GridGap& gap) {
+      const int topLeft = gap.top * stride + gap.left;
+      const int topRight = gap.top * stride + gap.right;
+      const int bottomLeft = gap.bottom * stride + gap.left;
+      const int bottomRight = gap.bottom * stride + gap.right;
+      const u32 primitive = primitives[topLeft];
+      const Ray ray = view.rayAt(gap.x, gap.y);
+      
+      if (primitives[topRight] != primitive
+          || primitives[bottomLeft] != primitive
+          || primitives[bottomRight] != primitive) {
+        tracePixel(gap.x, gap.y, ray);
+        return;
+      }
+      
+      float distance = Limits<float>::infinity();
+      Vec4 color;
+      
+      if (primitive != NO_PRIMITIVE) {
+        const double top = lerp<double>(
+            distances[topLeft], distances[topRight], gap.across
+        );
+        const double bottom = lerp<double>(
+            distances[bottomLeft], distances[bottomRight], gap.across
+        );
+        distance = float(lerp(top, bottom, gap.down));
+        color = shadePrimitive(scene, ray, primitive, distance);
+      } else {
+        color = shade(ray, RayHit());
+      }
+      
+      if constexpr ((flags & RENDER_HEATMAP) != 0)
+        color = heatmapColor(0);  // No work at all
+      
+      const int i = gap.y * stride + gap.x;
+      output(gap.x, gap.y, color);
+      distances[i] = distance;
+      primitives[i] = primitive;
+    });
+  };
   
+  // Checkerboard rendering: The pixels that aren't traced reuse the hits of
+  // the previous frame, or are filled in from their neighbours (see
+  // fillCheckerboardTile).
+  auto fillCheckerboard = [&](const Tile& tile) {
+    auto findLanding = [&](int x, int y, u32& primitive, float& distance) {
+      Reprojector::Hit hit;
+      if (previous == nullptr
+          || !reprojector.findLanding(*previous, x, y, hit))
+        return false;
+      primitive = hit.primitive;
+      distance = hit.distance;
+      return true;
+    };
+    auto shadePixel = [&](int x, int y, u32 primitive, double distance) {
+      const Ray ray = view.rayAt(x, y);
+      if constexpr ((flags & RENDER_HEATMAP) != 0)
+        output(x, y, heatmapColor(0));  // No work at all
+      else if (primitive == NO_PRIMITIVE)
+        output(x, y, shade(ray, RayHit()));
+      else
+        output(x, y, shadePrimitive(scene, ray, primitive, distance));
+    };
+    auto trace = [&](int x, int y) {
+      tracePixel(x, y, view.rayAt(x, y));
+    };
+    fillCheckerboardTile(pixels, distances, primitives, surface->w, tile,
+                         pass.parity, findLanding, shadePixel, trace);
+  };
+  
+  auto fillTile = [&](const Tile& tile, int step) {
+    getThreadRowWriter().finish();
+    if (isSubsampled)
+      fillAdaptively(tile, step);
+    else if (pass.parity >= 0 && step == 1)
+      fillCheckerboard(tile);
+    else
+      fillSparseTile(pixels, distances, primitives, surface->w, tile, step);
+    getThreadRowWriter().finish();
+  };
+
+  bool isLate = false;
+#ifdef ENABLE_THREADS
+  tiles.clip = options.region;
+  pose.forEachRay(width, height, *threads, tiles, pass, tracePixel, fillTile);
+  target.missedSeconds = tiles.getMissedSeconds();
+  isLate = target.missedSeconds > 0;
+#else
+  if (pass.isComplete() && options.region.isEmpty()) {
+    pose.forEachRay(width, height, tracePixel);
+    getThreadRowWriter().finish();
+  } else {
+    const Tile viewport = options.region.isEmpty() ? Tile{0, 0, width, height}
+                                                   : options.region;
+    forEachRefinedPixel(viewport, pass, [&](int x, int y) {
+      tracePixel(x, y, view.rayAt(x, y));
+    });
+    fillTile(viewport, pass.step);
+  }
+#endif
+
+  // Once every pixel has its ray, the edges get more, unless the frame is
+  // already late.
+  if constexpr ((flags & RENDER_EDGE_AA) != 0) {
+    const bool isWhole = options.pass.step == 1 && options.pass.parity < 0;
+    if (isWhole && !isLate) {
+      const Tile area = options.region.isEmpty() ? Tile{0, 0, width, height}
+                                                 : options.region;
+      antialiasEdges<flags>(target, scene, area);
+    }
+  }
+}
+
+
+// Traces more rays for the pixels in `area` that are on an edge, after the
+// whole frame is traced (see EdgeAntialiaser).
+template<uint flags>
+void MainScreen::antialiasEdges(
+    CanvasBuffer& target, const DynamicScene& scene, const Tile& area
+) {
+  SDL_Surface* surface = target.surface;
+  const ViewRays& view = target.view;
+  const int right = area.x + area.width;
+  const int bottom = area.y + area.height;
+  edges.prepare(surface->w, target.viewHeight);
+  
+  // All the edges have to be found before any pixel changes, so there are
+  // two rounds.
+  forEachRowBlock(area.y, bottom, [&](int first, int end) {
+    edges.findEdges(target.pixels.get(), target.primitives.get(),
+                    view.width, view.height, area.x, right, first, end);
+  });
+  u32* pixels = target.pixels.get();
+  forEachRowBlock(area.y, bottom, [&](int first, int end) {
+    PixelRowWriter& writer = getThreadRowWriter();
+    for (int y = first; y < end; y++) {
+      for (int x = area.x; x < right; x++) {
+        if (!edges.isEdge(x, y))
+          continue;
+        const Vec4 color = edges.supersample(x, y, [&](double dx, double dy) {
+          return traceRay<flags>(scene, view.rayAt(x + dx, y + dy));
+        });
+        writer.write(pixels + y * surface->w + x, color, false);
+      }
+    }
+    writer.finish();
+  });
+}
+
+
+// Moves the hits of the previous frame to where `view` sees them, so the
+// reprojector can look them up.
+void MainScreen::reprojectHits(
+    const CanvasBuffer& previous, const ViewRays& view, int stride
+) {
+  const int height = previous.viewHeight;
+  reprojector.prepare(stride, height);
+
+  // Everything has to be cleared before anything moves, so there are two
+  // rounds.
+  forEachRowBlock(0, height, [&](int first, int end) {
+    reprojector.clearRows(first, end);
+  });
+  forEachRowBlock(0, height, [&](int first, int end) {
+    reprojector.splatRows(previous, view, first, end);
+  });
+}
+
+
+
+void MainScreen::render() {
   // Zoom...
   
   int viewWidth = int(windowWidth);
   int viewHeight = int(windowHeight);
-  SDL_Rect src = {0, 0, viewWidth, viewHeight};
-  SDL_Rect dest = {0, 0, 0, 0};
   
-  if (zoomFactor != 1) {
+  if (isResolutionDynamic) {
+    // Traced smaller, but shown on the whole window (see below).
+    viewWidth = std::max(int(viewWidth * resolution.getScale()), 2);
+    viewHeight = std::max(int(viewHeight * resolution.getScale()), 2);
+  } else if (zoomFactor != 1) {
     viewWidth = int(viewWidth * zoomFactor);
     viewHeight = int(viewHeight * zoomFactor);
-    int view_x = (int(windowWidth) - viewWidth) / 2;
-    int view_y = (int(windowHeight) - viewHeight) / 2;
-    src = {0, 0, viewWidth, viewHeight};
-    dest = {view_x, view_y, 0, 0};
   }
   
   
   // Viewport raytracing...
-
-#ifdef ENABLE_THREADS
-  camera.forEachRay(viewWidth, viewHeight, threads, [](int x, int y, Ray ray) {
-#else
-  camera.forEachRay(viewWidth, viewHeight, [](int x, int y, Ray ray) {
+  // The frame that was traced during the previous frame is shown, while the
+  // next one is traced in the background. The trace gets a copy of the
+  // camera and a snapshot of the scene, so that update() can change them in
+  // the meantime.
+  // Every combination of render flags gets its own pixel loop.
+  //
+  // With timewarp, a frame that's late isn't waited for. The next frame
+  // keeps being traced, and the last frame is warped to the newest camera.
+  const bool isFrameLate =
+      renderSettings.isTimewarped && pipeline.isPipelined()
+      && pipeline.isBusy() && !pipeline.waitForTracing(TIMEWARP_WAIT);
+  
+  if (!isFrameLate)
+    startNextFrame(viewWidth, viewHeight);
+  
+  
+  // Skipping the screen update...
+  // If there's no new frame and nothing happened, the screen would look the
+  // same, so it's left alone and the main loop waits for something to happen.
+  const bool isIdle = !isFrameNew && !isFrameLate && !pipeline.isBusy()
+                      && !isStatusBarVisible && isZoomManual
+                      && inputEventCount == presentedEventCount;
+  if (isIdle) {
+#ifndef __EMSCRIPTEN__
+    SDL_WaitEventTimeout(nullptr, IDLE_WAIT_MS);
 #endif
-    Vec4 pixelColor = raytrace(ray);
-    setPixel(canvas, x, y, pixelColor);
-  });
+    return;
+  }
+  isFrameNew = false;
+  presentedEventCount = inputEventCount;
+  clearScreen();
+  
+  
+  // Showing the previous frame...
+  // (or the current frame, if the frames aren't pipelined)
+  CanvasBuffer& presenting = pipeline.getPresentingBuffer();
+  SDL_Surface* shown = presenting.surface;
+  
+  if (isFrameLate && presenting.viewWidth > 0) {
+    ViewRays newest =
+        calcNewestView(presenting.viewWidth, presenting.viewHeight);
+    shown = timewarp.warp(presenting, newest);
+  }
   
-  SDL_BlitSurface(canvas, &src, screen, &dest);
+  SDL_Rect src = {0, 0, presenting.viewWidth, presenting.viewHeight};
+  SDL_Rect dest = {
+      (int(windowWidth) - presenting.viewWidth) / 2,
+      (int(windowHeight) - presenting.viewHeight) / 2,
+      0, 0
+  };
+  
+  const bool isFrameSmall = presenting.viewWidth < int(windowWidth)
+                            || presenting.viewHeight < int(windowHeight);
+  
+  if (isResolutionDynamic && isFrameSmall && presenting.viewWidth > 1) {
+    shown = upscaler.upscale(
+        shown, presenting.viewWidth, presenting.viewHeight,
+        int(windowWidth), int(windowHeight)
+    );
+    src = {0, 0, int(windowWidth), int(windowHeight)};
+    dest = {0, 0, 0, 0};
+  }
+  
+  SDL_BlitSurface(shown, &src, screen, &dest);
   
   
   // User interface...
@@ -112,6 +619,278 @@ void MainScreen::render() {
   
   // Finalize...
   SDL_UpdateWindowSurface(window);
+  frameCounter.addFrameTime(deltaTime);
+  
+  if (!presenting.mouse.isEmpty()) {
+    std::chrono::duration<double> latency =
+        MouseLatch::clock::now() - presenting.mouse.since;
+    frameCounter.addInputLatency(latency.count());
+    presenting.mouse = {};
+  }
+}
+
+
+// Finishes the frame that's being traced and starts tracing the next one.
+void MainScreen::startNextFrame(int viewWidth, int viewHeight) {
+  finishTracing();
+  
+  // A frame that would show the same as the previous one isn't traced, if
+  // the previous one can't get any better. With progressive refinement, it
+  // only traces the pixels that the previous one didn't. With temporal
+  // antialiasing, it's added to the average of the frames before it.
+  const CanvasBuffer& previous = pipeline.getPresentingBuffer();
+  bool isViewSame = isSameView(previous, viewWidth, viewHeight);
+  bool isStill =
+      isViewSame && previous.sceneVersion == world.getLatest().version;
+  const bool isAccumulated = (renderFlags & RENDER_TEMPORAL_AA) != 0;
+  int refinement = -1;
+  bool isRefined = false;  // All passes are done
+  
+  if (isStill && previous.isFinal
+      && (!isAccumulated || accumulator.isConverged()))
+    return;
+  
+  if (isProgressive) {
+    const bool isRefining = isStill && previous.refinement >= 0;
+    refinement = isRefining ? previous.refinement + 1 : 0;
+    
+    if (refinement == REFINEMENT_PASS_COUNT) {
+      // Done, but there's more to average (or the last pass missed its
+      // deadline), so whole frames are traced.
+      refinement--;
+      isRefined = true;
+    }
+  }
+  
+  tracedFoveation = calcFoveation(viewWidth, viewHeight);
+  
+  CanvasBuffer& tracing = pipeline.getTracingBuffer();
+  tracing.viewWidth = viewWidth;
+  tracing.viewHeight = viewHeight;
+  tracing.renderFlags = renderFlags;
+  tracing.mouse = updateMouse;
+  updateMouse = {};
+  
+  auto trace = [this, &tracing, &previous, refinement, isRefined, isStill,
+                isViewSame, isAccumulated, isReprojecting = isReprojecting,
+                isSubsampling = isSubsampling, isCheckerboard = isCheckerboard,
+                foveation = tracedFoveation,
+                pose = camera, frameFlags = renderFlags,
+                isLateLatched = renderSettings.isLateLatched]() mutable {
+    // Late latching: The mouse movement is read at the last moment before
+    // the rays are made, and the main camera catches up afterwards.
+    if (isLateLatched) {
+      tracing.mouse = mouse_movement.take();
+      latchedMouse.add(tracing.mouse.x, tracing.mouse.y);
+      pose.rotate(tracing.mouse.x, tracing.mouse.y, 0);
+      
+      if (!tracing.mouse.isEmpty()) {
+        // The camera moved after all.
+        isStill = false;
+        isViewSame = false;
+        refinement = std::min(refinement, 0);
+        isRefined = false;
+      }
+    }
+    
+    auto scene = world.read(TRACER_READER);
+    const bool isSameWorld = previous.sceneVersion == scene->version;
+    tracing.sceneVersion = scene->version;
+    
+    // When only some forms changed since a frame that couldn't get better,
+    // the frame is a copy of that one with only the dirty region traced
+    // again. Unless that's the whole screen anyway.
+    Tile region;
+    bool isPatched = false;
+    if (isViewSame && !isStill && previous.isFinal && !isAccumulated
+        && tracedScene.version == previous.sceneVersion) {
+      region = findDirtyRegion(tracedScene.forms, scene->forms, previous.view);
+      isPatched = region.width < tracing.viewWidth
+                  || region.height < tracing.viewHeight;
+    }
+    tracedScene = *scene;
+    tracing.isPatched = isPatched;
+    
+    // A refining frame starts out as a copy of the previous one too.
+    RefinementPass pass;
+    if (isPatched)
+      refinement = previous.refinement;
+    else if (refinement >= 0 && !isRefined)
+      pass = REFINEMENT_PASSES[refinement];
+    if (isPatched || (refinement > 0 && !isRefined))
+      copyViewport(previous, tracing);
+    tracing.refinement = refinement;
+    
+    if (isAccumulated && isStill)
+      accumulator.nextFrame();
+    else if (isAccumulated)
+      accumulator.reset(tracing.surface->w, tracing.viewHeight);
+    
+    // Reprojection reuses the hits of the previous frame, if that frame is
+    // of the same size. A still frame has to be traced again, so that it's
+    // exact (or can be averaged), and so does the heatmap.
+    const bool isFull = pass.isComplete();
+    const bool isAveraged = isAccumulated && isStill;
+    const bool isSameSize = previous.viewWidth == tracing.viewWidth
+                            && previous.viewHeight == tracing.viewHeight;
+    const bool isReprojected =
+        isReprojecting && isFull && !isStill && !isPatched
+        && (frameFlags & RENDER_HEATMAP) == 0 && isSameSize;
+    
+    // The same goes for checkerboard rendering (unless the grid is sparse
+    // already), but not for adaptive subsampling, which can't get better.
+    const bool isAdaptive = isSubsampling && isFull && !isAveraged;
+    const bool isCheckered =
+        isCheckerboard && isFull && !isStill && !isPatched && !isAdaptive;
+    if (isCheckered)
+      pass.parity = int(checkerboardFrame++ % 2);
+    
+    auto start = std::chrono::steady_clock::now();
+#ifdef ENABLE_THREADS
+    // Past the deadline, the quality drops instead of the framerate.
+    tiles.deadline = start + std::chrono::duration_cast<
+        TileScheduler::clock::duration
+    >(std::chrono::duration<double>(
+        DEADLINE_FACTOR * resolution.targetSeconds
+    ));
+    tiles.foveation = foveation;
+#else
+    (void) foveation;
+#endif
+    
+    TraceOptions options;
+    options.pass = pass;
+    options.isAdaptive = isAdaptive;
+    options.region = region;
+    if ((isReprojected || isCheckered) && isSameSize && isSameWorld) {
+      options.previous = &previous;
+      options.isReusingHits = isReprojected;
+    }
+    
+    // Nothing to trace if the forms changed off the screen.
+    tracing.missedSeconds = 0;
+    if (!isPatched || !region.isEmpty()) {
+      dispatchRenderFlags(frameFlags, [&](auto flags) {
+        traceViewport<decltype(flags)::value>(
+            tracing, pose, *scene, tracing.viewWidth, tracing.viewHeight,
+            options
+        );
+      });
+    }
+    
+    std::chrono::duration<double> duration =
+        std::chrono::steady_clock::now() - start;
+    tracing.traceSeconds = duration.count();
+    tracing.isFinal = !options.isReusingHits && tracing.missedSeconds == 0
+                      && (pass.isComplete()
+                          || refinement == REFINEMENT_PASS_COUNT - 1);
+  };
+  pipeline.startTracing(trace);
+  
+  if (!pipeline.isPipelined())
+    finishTracing();
+}
+
+
+// Whether the next frame would show the same as the previous one, as long
+// as the scene stays the same.
+bool MainScreen::isSameView(
+    const CanvasBuffer& previous, int width, int height
+) {
+  return previous.viewWidth == width
+         && previous.viewHeight == height
+         && previous.renderFlags == renderFlags
+         && previous.view == calcNewestView(width, height)
+         && tracedFoveation == calcFoveation(width, height);
+}
+
+
+// Copies the traced part of one canvas to the other.
+void MainScreen::copyViewport(const CanvasBuffer& from, CanvasBuffer& to) {
+  const int stride = from.surface->w;
+  for (int y = 0; y < from.viewHeight; y++) {
+    std::copy_n(&from.pixels[y * stride], from.viewWidth,
+                &to.pixels[y * stride]);
+    std::copy_n(&from.distances[y * stride], from.viewWidth,
+                &to.distances[y * stride]);
+    std::copy_n(&from.primitives[y * stride], from.viewWidth,
+                &to.primitives[y * stride]);
+  }
+}
+
+
+// Waits for the frame that's being traced. With late latching the mouse
+// keeps being read in the meantime, so the next frame can show the newest
+// mouse movement.
+void MainScreen::finishTracing() {
+  if (renderSettings.isLateLatched)
+    while (!pipeline.waitForTracing(0.001))
+      handleMouseMovement();
+  
+  if (!pipeline.finishTracing())
+    return;
+  isFrameNew = true;
+  
+  // The resolution of the next frame depends on how long this one took, or
+  // would have taken if it hadn't missed its deadline. Frames of which only
+  // a part was traced say nothing about that.
+  const CanvasBuffer& traced = pipeline.getPresentingBuffer();
+  if (isResolutionDynamic && !traced.isPatched)
+    resolution.update(traced.traceSeconds + traced.missedSeconds);
+  
+  // Turn the camera the way the trace already did.
+  if (renderSettings.isLateLatched) {
+    const MouseLatch::Delta mouse = latchedMouse.take();
+    camera.rotate(mouse.x, mouse.y, 0);
+  }
+}
+
+
+// The view of the camera, including the mouse movement that it hasn't
+// caught up with yet.
+ViewRays MainScreen::calcNewestView(int width, int height) {
+  FlyingCameraController pose = camera;
+  
+  if (renderSettings.isLateLatched) {
+    for (MouseLatch* mouse : {&latchedMouse, &mouse_movement}) {
+      MouseLatch::Delta delta = mouse->peek();
+      pose.rotate(delta.x, delta.y, 0);
+    }
+  }
+  
+  return pose.calcViewRays(width, height);
+}
+
+
+// Where the viewer is looking, in the pixels of a view of the given size:
+// The center while the mouse turns the camera, and the cursor otherwise.
+Foveation MainScreen::calcFoveation(int viewWidth, int viewHeight) {
+  Foveation foveation;
+  if (!isFoveated)
+    return foveation;
+  
+  foveation.falloff = renderSettings.foveationFalloff > 0
+                      ? renderSettings.foveationFalloff
+                      : DEFAULT_FOVEATION_FALLOFF;
+  foveation.focusX = (viewWidth - 1) / 2.0;
+  foveation.focusY = (viewHeight - 1) / 2.0;
+  
+  if (!isControllingCamera) {
+    int x, y;
+    SDL_GetMouseState(&x, &y);
+    
+    // The view is either scaled up to the window or centered in it (see
+    // render).
+    if (isResolutionDynamic) {
+      foveation.focusX = (x + 0.5) * viewWidth / windowWidth - 0.5;
+      foveation.focusY = (y + 0.5) * viewHeight / windowHeight - 0.5;
+    } else {
+      foveation.focusX = x - (int(windowWidth) - viewWidth) / 2;
+      foveation.focusY = y - (int(windowHeight) - viewHeight) / 2;
+    }
+  }
+  
+  return foveation;
 }
 
 
@@ -119,7 +898,9 @@ void MainScreen::update() {
   // Handle zooming...
   using std::min;
   
-  if (!isZoomManual)
+  if (isResolutionDynamic)
+    isZoomManual = true;  // The viewport stays as big as the window
+  else if (!isZoomManual)
     adjustZoomLevelToFramerate();
   else if (abs(zoomFactor - targetZoomFactor) < 0.001)
     zoomFactor = targetZoomFactor;  // Prevent slight jiggling
@@ -128,8 +909,10 @@ void MainScreen::update() {
   
   
   // Rotate the camera...
-  if (turn_horizontally != 0 || turn_vertically != 0)
-    camera.rotate(turn_horizontally, turn_vertically, 0);
+  if (!renderSettings.isLateLatched) {
+    updateMouse = mouse_movement.take();
+    camera.rotate(updateMouse.x, updateMouse.y, 0);
+  }
   
   if (turn_4D > 0)
     camera.rotateWY_clockwise();
@@ -159,109 +942,36 @@ void MainScreen::update() {
 
 
 
-static void addCuboid(
-    Vec4 start, Vec4 end,
-    Vec4 lightColor, Vec4 darkColor
-) {
-  auto newCuboid = make_unique<AlignedHypercuboid>();
-  newCuboid->min = start;
-  newCuboid->max = end;
-  newCuboid->lightColor = lightColor;
-  newCuboid->darkColor = darkColor;
-  world.push_back(std::move(newCuboid));
-}
-
-
-static void addSphere(
+// Adds a sphere to a new version of the world and returns its index.
+static uint addSphere(
     Vec4 center, double radius,
     Vec4 lightColor, Vec4 darkColor
 ) {
-  auto newSphere = make_unique<Hypersphere>();
+  auto newSphere = std::make_shared<Hypersphere>();
   newSphere->center = center;
   newSphere->radius = radius;
   newSphere->lightColor = lightColor;
   newSphere->darkColor = darkColor;
-  world.push_back(std::move(newSphere));
+  
+  auto next = make_unique<DynamicScene>(world.getLatest());
+  next->version++;
+  next->forms.push_back(std::move(newSphere));
+  uint index = next->forms.size() - 1;
+  world.publish(std::move(next));
+  return index;
 }
 
 
 void MainScreen::initAssets() {
+  // The white hypersphere is the only form that changes while the program
+  // runs, so it's the only one that's created here. The rest of the world is
+  // compiled into the program from scenes/demo.scene.
   Vec4 white = {1,1,1,1};
-  Vec4 grey = {0.2,0.2,0.2,1};
-  Vec4 grey2 = {.7,.7,.7,1};
-  Vec4 red = {1,.2,.2,1};
-  Vec4 dark_red = {.4,.1,.1,1};
-  Vec4 green = {.2,1,.2,1};
-  Vec4 green2 = {.4,1,.2,1};
-  Vec4 greenish_blue = {.3,.5,.4,.3};
-  Vec4 greenish_blue2 = {.3,.53,.38,.3};
-  Vec4 blue = {.1,.1,.8,1};
-  Vec4 dark_blue = {.1,.1,.4,1};
-  Vec4 black = {0,0,0,1};
-  
   Vec4 darker = {-0.1, -0.1, -0.1, 0};
-  Vec4 lighter = {0.1, 0.1, 0.1, 0};
-  
-  addCuboid({-1, -10, -1, -1}, {1, -8, 1, 1}, white, grey);
-  addCuboid({-1.5, -10.5, -0.5, -2}, {0.5, -8.5, 1.5, -1}, red, dark_red);
-  
-  addCuboid({-6, -5, -1, -2}, {-1, -3, 1, 3}, red, dark_red);
-  addSphere({8, 3, 3, 1}, 4, blue, dark_blue);
-  
-  // Clouds
-  addCuboid({-10, -10, 50, -10}, {1, 80, 51, 30}, white, white + darker);
-  addCuboid({-50, -30, 51, -1}, {-13, 7, 53, 1}, white, white + darker);
-  
-  // Ground
-  addCuboid({-100, -100, -100, -100}, {100, 100, -4, 100}, green, greenish_blue);
-  addCuboid({-100, -50, -100, -100}, {100, 5, -3, 100}, green2, greenish_blue2);
-  
-  // A big sphere towards W
-  addSphere({0,0,10,40}, 20, red, dark_red);
-  
-  // Corner spheres
-  addSphere({90, -90, 0, 90}, 10, white, grey);
-  addSphere({-90, 90, 0, 90}, 10, white, dark_blue);
-  addSphere({90, -90, 0, -90}, 10, white, dark_red);
-  addSphere({-90, 90, 0, -90}, 10, white, greenish_blue);
-  
-  // Border fences
-  addCuboid({-99, -99, -6, -99}, {99, -98, 0, 99}, red, dark_red + lighter);
-  addCuboid({-99, 98, -6, -99}, {99, 99, 0, 99}, red, dark_red + lighter);
-  addCuboid({98, -99, -6, -99}, {99, 99, 0, 99}, red, dark_red);
-  addCuboid({-99, -99, -6, -99}, {-98, 99, 0, 99}, red, dark_red);
-  addCuboid({-99, -99, -6, -99}, {99, 99, 0, -98}, red, dark_red + darker);
-  addCuboid({-99, -99, -6, 98}, {99, 99, 0, 99}, red, dark_red + darker);
-  
-  // Black sphere
-  addSphere({-35, 11, 10, -8}, 2, white, black);
-  
-  // Fenced area
-  addCuboid({-30, -30, -3, 10}, {-20, -29.5, 0, 20}, red, dark_red + lighter);
-  addCuboid({-30, -20.5, -3, 10}, {-20, -20, 0, 20}, red, dark_red + lighter);
-  addCuboid({-20.5, -30, -3, 10}, {-20, -20, 0, 20}, red, dark_red);
-  addCuboid({-30, -30, -3, 10}, {-29.5, -20, 0, 20}, red, dark_red);
-  addCuboid({-30, -30, -3, 10}, {-20, -20, 0, 10.5}, red, dark_red + darker);
-  addCuboid({-30, -30, -3, 19.5}, {-20, -20, 0, 20}, red, dark_red + darker);
-  
-  // House
-  addCuboid({30, -30, -3, 30}, {40, -29.5, 0, 40}, red, dark_red + lighter);
-  addCuboid({30, -20.5, -3, 30}, {40, -20, 0, 40}, red, dark_red + lighter);
-  addCuboid({39.5, -30, -3, 30}, {40, -20, 0, 40}, red, dark_red);
-  addCuboid({30, -30, -3, 30}, {40, -20, 0, 30.5}, red, dark_red + darker);
-  addCuboid({30, -30, -3, 39.5}, {40, -20, 0, 40}, red, dark_red + darker);
-  // wall with door hole
-  addCuboid({30, -30, -3, 30}, {30.5, -20, 0, 34}, red, dark_red);
-  addCuboid({30, -30, -3, 36}, {30.5, -20, 0, 40}, red, dark_red);
-  addCuboid({30, -30, -3, 30}, {30.5, -25, 0, 40}, red, dark_red + darker);
-  addCuboid({30, -23, -3, 30}, {30.5, -20, 0, 40}, red, dark_red + darker);
-  // roof
-  addCuboid({30, -30, 0, 30}, {40, -20, 0.5, 40}, red, red + darker);
-  // floor
-  addCuboid({30, -30, -3, 30}, {40, -20, -2.99, 40}, white, grey2);
-  
-  addSphere({38, -21.3, -1.5, 35}, WHITE_SPHERE_RADIUS, white, white + darker);
-  whiteHypersphere = dynamic_cast<Hypersphere*>(world.back().get());
+  
+  whiteSphereIndex = addSphere(
+      {38, -21.3, -1.5, 35}, WHITE_SPHERE_RADIUS, white, white + darker
+  );
 }
 
 
@@ -285,9 +995,15 @@ void MainScreen::drawStatusBar() {
       +"   YAW "+as_degrees(camera.yaw)+"°"
       +"   PITCH "+as_degrees(camera.pitch)+"°"
       +"   WY "+as_degrees(camera.wy_rotation)+"°"
-      +"   Running at "+as_str(frameCounter.framerate)+" Hz";
+      +"   Running at "+as_str(frameCounter.framerate)+" Hz"
+      +" (p99 "+as_str(frameCounter.p99FrameTime * 1000)+" ms)";
+  
+  if (frameCounter.inputLatency > 0)
+    text += "   Input latency "+as_str(frameCounter.inputLatency * 1000)+" ms";
   
-  if (zoomFactor < 1)
+  if (isResolutionDynamic)
+    text += "  RESOLUTION "+as_str(resolution.getScale() * 100)+"%";
+  else if (zoomFactor < 1)
     // Weird way to turn a double into a string with significance but it works
     text += "  ZOOM x0."+as_str(zoomFactor * 10);
   
@@ -359,10 +1075,22 @@ void MainScreen::drawControls() {
        "Shift & control: Move up and down\n"
        "R & F: Move on the W axis (or the Y axis, depending on rotation)\n"
        "Scroll: Rotate on the WY plane (alternative keys: O & P)\n"
+       "F2: Toggle tracing fewer rays away from the center (or the cursor)\n"
        "F3: Show your coordinates\n"
        "F4: With coordinates visible, F4 switches between different viewport "
        "sizes\n"
        "    (smaller viewport gives you a higher framerate)\n"
+       "F5: Show how much work each pixel takes (heatmap)\n"
+       "F6: Switch antialiasing between off, four rays per pixel,\n"
+       "    averaging the frames while you stand still and more rays only\n"
+       "    on the edges\n"
+       "F7: Find the fastest render settings for your computer again\n"
+       "F8: Switch between dynamic resolution and a smaller viewport\n"
+       "F9: Toggle progressive refinement (sharper when standing still)\n"
+       "F10: Toggle reusing the previous frame (faster when moving slowly)\n"
+       "F11: Toggle tracing only the edges between things closely\n"
+       "F12: Toggle tracing half of the pixels per frame, like a "
+       "checkerboard\n"
        "\n"
        "Controls may vary if you aren't using a QWERTY keyboard, but you can\n"
        "always figure out the keybindings through experimentation.\n"
@@ -444,28 +1172,30 @@ void MainScreen::adjustZoomLevelToFramerate() {
 }
 
 
-void MainScreen::moveWhiteSphereRandomly() {
+void MainScreen::moveWhiteSphereRandomly(Hypersphere& sphere) {
   const double p = sphereTouchedPoints * 4;
   const Vec4 minima = {-p, -p, -3, -p};
   const Vec4 maxima = {p, p, p/2, p};
   const Vec4 range_sizes = maxima - minima;
   
-  if (whiteHypersphere == nullptr) {
-    printf("White hypersphere not found.");
-    return;
-  }
-  
   // rand() isn't getting seeded but I think the RNG is fine as is
   Vec4 random = Vec4(rand(),rand(),rand(),rand());
   Vec4 newPos = minima + random.elemMult(range_sizes) / RAND_MAX;
-  whiteHypersphere->center = newPos;
+  sphere.center = newPos;
 }
 
 
 void MainScreen::updateWhiteSphere() {
   Vec4 white = {1,1,1,1};
   Vec4 yellow = {1,1,0,1};
-  auto& sphere = *whiteHypersphere;
+  
+  // The published sphere may be getting traced right now, so the changes
+  // go into a copy, which ends up in the next version of the world.
+  const DynamicScene& latest = world.getLatest();
+  auto copy = std::make_shared<Hypersphere>(
+      dynamic_cast<const Hypersphere&>(*latest.forms[whiteSphereIndex])
+  );
+  auto& sphere = *copy;
   
   // Animate the radius...
   double goalRadius = (isSphereDisappearing ? 0 : WHITE_SPHERE_RADIUS);
@@ -478,9 +1208,9 @@ void MainScreen::updateWhiteSphere() {
   // Move the sphere after you touched it...
   if (isSphereDisappearing && sphere.radius < 0.001) {
     if (sphereTouchedPoints == 1)
-      whiteHypersphere->center = {-25, -25, -1.5, 15};
+      sphere.center = {-25, -25, -1.5, 15};
     else
-      moveWhiteSphereRandomly();
+      moveWhiteSphereRandomly(sphere);
     isSphereDisappearing = false;
   }
   
@@ -491,4 +1221,18 @@ void MainScreen::updateWhiteSphere() {
     sphereTouchedPoints++;
     garbageText = "";
   }
+  
+  // Publish the new version, if anything changed (a new version also starts
+  // the progressive refinement over)...
+  const auto& published =
+      dynamic_cast<const Hypersphere&>(*latest.forms[whiteSphereIndex]);
+  if (sphere.radius == published.radius
+      && sphere.center == published.center
+      && sphere.lightColor == published.lightColor)
+    return;
+  
+  auto next = make_unique<DynamicScene>(latest);
+  next->version++;
+  next->forms[whiteSphereIndex] = std::move(copy);
+  world.publish(std::move(next));
 }
@@ -5,6 +5,40 @@
 #include "FlyingCameraController.hpp"
 #include "FrameCounter.hpp"
 #include "geometry/Hypersphere.hpp"
+#include "raytrace.hpp"
+#include "render/DirtyRegion.hpp"
+#include "render/EdgeAntialiaser.hpp"
+#include "render/FramePipeline.hpp"
+#include "render/RenderFlags.hpp"
+#include "render/Reprojector.hpp"
+#include "render/ResolutionController.hpp"
+#include "render/TemporalAccumulator.hpp"
+#include "render/Timewarp.hpp"
+#include "render/quantize.hpp"
+#include "render/upscale.hpp"
+#include "util/RenderSettings.hpp"
+#include "util/ThreadSettings.hpp"
+
+
+#ifdef ENABLE_THREADS
+inline Unique<ThreadPool> createThreadPool(uint threadCount) {
+  return make_unique<ThreadPool>(threadCount, [](std::size_t i) {
+    pinWorkerThread(threadSettings, i);
+  });
+}
+#endif
+
+
+// How traceViewport traces a frame, besides the render flags.
+struct TraceOptions {
+  RefinementPass pass;  // Which pixels are traced (all of them by default)
+  // The previous frame, if it's of the same size and shows the same scene.
+  // Its hits are reprojected onto the new view (see Reprojector).
+  const CanvasBuffer* previous = nullptr;
+  bool isReusingHits = false;  // Pixels reuse the hits of `previous`
+  bool isAdaptive = false;  // See MainScreen::isSubsampling
+  Tile region;  // Only this part is traced, unless it's empty
+};
 
 
 class MainScreen : public iScreen {
@@ -25,19 +59,72 @@ public:
   void drawWyIndicator();
   void adjustZoomLevelToFramerate();
   void updateWhiteSphere();
-  void moveWhiteSphereRandomly();
+  void moveWhiteSphereRandomly(Hypersphere& sphere);
+  template<uint flags>
+  void traceViewport(
+      CanvasBuffer& target, const FlyingCameraController& pose,
+      const DynamicScene& scene, int width, int height,
+      const TraceOptions& options = {}
+  );
+  void reprojectHits(
+      const CanvasBuffer& previous, const ViewRays& view, int stride
+  );
+  template<uint flags>
+  void antialiasEdges(
+      CanvasBuffer& target, const DynamicScene& scene, const Tile& area
+  );
+  template<class Function>
+  void forEachRowBlock(int first, int end, Function doSomething);
+  void firstTouchCanvas();
+  void startNextFrame(int viewWidth, int viewHeight);
+  bool isSameView(const CanvasBuffer& previous, int width, int height);
+  void copyViewport(const CanvasBuffer& from, CanvasBuffer& to);
+  void finishTracing();
+  ViewRays calcNewestView(int width, int height);
+  Foveation calcFoveation(int viewWidth, int viewHeight);
+  void autotune(bool isForced);
   
   FlyingCameraController camera;
   FrameCounter frameCounter;
 #ifdef ENABLE_THREADS
-  ThreadPool threads;
+  // See util/ThreadSettings.hpp for the options. The autotuner may replace
+  // the pool with one that has a different amount of threads.
+  Unique<ThreadPool> threads =
+      createThreadPool(threadSettings.calcThreadCount());
+  TileScheduler tiles;
 #endif
+  FramePipeline pipeline;  // The canvases (destroyed before the threads)
+  
+  // The scene is read by the tracer thread (see SnapshotStore).
+  static constexpr uint TRACER_READER = 0;
+  
+  // The mouse movement that update() turned the camera with, but that isn't
+  // being traced yet. (Unused with late latching, see MouseLatch)
+  MouseLatch::Delta updateMouse;
+  // With late latching: The mouse movement that the tracer turned its camera
+  // with, but that the main camera hasn't caught up with yet.
+  MouseLatch latchedMouse;
+  
+  // Change-driven rendering: A frame that would look the same as the last
+  // one isn't traced, and if only some forms changed, only where they are is
+  // traced (see DirtyRegion). When there's nothing new to show at all, the
+  // screen isn't updated and the main loop waits for events.
+  DynamicScene tracedScene;  // Of the last traced frame, only for the tracer
+  Foveation tracedFoveation;
+  bool isFrameNew = false;  // Traced but not shown yet
+  uint presentedEventCount = 0;  // See inputEventCount
+  static constexpr int IDLE_WAIT_MS = 20;
+  
+  // Covers up frames that are late (see util/RenderSettings.hpp).
+  Timewarp timewarp;
+  static constexpr double TIMEWARP_WAIT = 0.004;  // In seconds
   
   // Inputs & screens
   bool isStartScreenVisible = true;
   bool isStatusBarVisible = false;
   bool isControlsVisible = false;
   int queuedWyRotations = 0;
+  uint renderFlags = RENDER_DEFAULT;  // See render/RenderFlags.hpp
   
   // Zooming
   #ifdef ENABLE_THREADS
@@ -47,6 +134,10 @@ public:
   #endif
   
   static constexpr double TARGET_SAMPLES = 3;
+  
+  // Tiles that would be traced later than this many target frame times
+  // after the start of a frame are traced sparsely (see TileScheduler).
+  static constexpr double DEADLINE_FACTOR = 1.25;
   double time = 0;
   int frames = 0;
   bool isZoomManual = false;
@@ -54,11 +145,57 @@ public:
   double targetZoomFactor = 1.0;
   double previousZoomFactor = 0.2;
   
+  // Dynamic resolution: Instead of making the viewport smaller, the frames
+  // are traced at a lower resolution and scaled up to the whole window.
+  bool isResolutionDynamic = true;
+  ResolutionController resolution;
+  Upscaler upscaler;
+  
+  // Progressive refinement: The first frame after the camera or the scene
+  // changes traces one pixel per 4x4 block. The frames after that trace the
+  // pixels in between, until the frame is whole (see startNextFrame).
+  bool isProgressive = false;
+  static constexpr RefinementPass REFINEMENT_PASSES[] = {
+      {4, 0}, {2, 4}, {1, 2}
+  };
+  static constexpr int REFINEMENT_PASS_COUNT = 3;
+  
+  // Averages the frames while nothing changes (see RENDER_TEMPORAL_AA).
+  // Only used by the tracer.
+  TemporalAccumulator accumulator;
+  
+  // Gives the pixels on edges more rays (see RENDER_EDGE_AA). The most rays
+  // per pixel can be set with --aa-samples. Only used by the tracer.
+  EdgeAntialiaser edges;
+  
+  // Reprojection: Pixels that showed the same thing in the previous frame
+  // reuse its hits instead of being traced (see Reprojector).
+  bool isReprojecting = false;
+  Reprojector reprojector;  // Only used by the tracer
+  
+  // Adaptive subsampling: Only every ADAPTIVE_STEPth row and column is
+  // traced, plus the pixels between them where the primitive changes (see
+  // traceViewport).
+  bool isSubsampling = false;
+  static constexpr int ADAPTIVE_STEP = 4;
+  
+  // Checkerboard rendering: Every frame traces half of the pixels, the other
+  // half of what the frame before traced. The rest is made up from the hits
+  // of the previous frame and the neighbouring pixels (see traceViewport).
+  bool isCheckerboard = false;
+  uint checkerboardFrame = 0;  // Only used by the tracer
+  
+  // Foveated rendering: The further from the center of the view (or the
+  // cursor, if the mouse is free), the sparser the tiles are traced (see
+  // Foveation). The falloff can be set with --foveation. Needs threads.
+  bool isFoveated = false;
+  static constexpr double DEFAULT_FOVEATION_FALLOFF = 4;
+  
   // White hypersphere
   static constexpr double WHITE_SPHERE_RADIUS = 1;
   static constexpr double WHITE_SPHERE_TOUCH_RADIUS = 1.5;
   String garbageText = "";
-  Hypersphere* whiteHypersphere = nullptr;
+  uint whiteSphereIndex = 0;  // In world.getLatest().forms
   bool isSphereDisappearing = false;
   uint sphereTouchedPoints = 0;
 };
@@ -4,6 +4,7 @@
 
 #include "io/InputBool.hpp"
 #include "io/InputScalar.hpp"
+#include "io/MouseLatch.hpp"
 
 
 // I liked this better before I had to turn all the InputBools into pointers :(
@@ -17,13 +18,21 @@ inline InputBool* go_down = createInputBoolFromKeycode("go down", SDLK_LCTRL);
 inline InputBool* go_W_plus = createInputBoolFromKeycode("go W plus", SDLK_r);
 inline InputBool* go_W_minus = createInputBoolFromKeycode("go W minus", SDLK_f);
 inline InputBool* toggle_controls_display = createInputBoolFromKeycode("toggle controls display", SDLK_F1);
+inline InputBool* toggle_foveation = createInputBoolFromKeycode("toggle foveated rendering", SDLK_F2);
 inline InputBool* toggle_status_display = createInputBoolFromKeycode("toggle status display", SDLK_F3);
 inline InputBool* toggle_smaller_view = createInputBoolFromKeycode("toggle smaller view", SDLK_F4);
+inline InputBool* toggle_heatmap = createInputBoolFromKeycode("toggle heatmap", SDLK_F5);
+inline InputBool* toggle_antialiasing = createInputBoolFromKeycode("toggle antialiasing", SDLK_F6);
+inline InputBool* start_autotuning = createInputBoolFromKeycode("start autotuning", SDLK_F7);
+inline InputBool* toggle_dynamic_resolution = createInputBoolFromKeycode("toggle dynamic resolution", SDLK_F8);
+inline InputBool* toggle_progressive = createInputBoolFromKeycode("toggle progressive refinement", SDLK_F9);
+inline InputBool* toggle_reprojection = createInputBoolFromKeycode("toggle reprojection", SDLK_F10);
+inline InputBool* toggle_subsampling = createInputBoolFromKeycode("toggle adaptive subsampling", SDLK_F11);
+inline InputBool* toggle_checkerboard = createInputBoolFromKeycode("toggle checkerboard rendering", SDLK_F12);
 inline InputBool* turn_4D_up = createInputBoolFromKeycode("turn 4D up", SDLK_o);
 inline InputBool* turn_4D_down = createInputBoolFromKeycode("turn 4D down", SDLK_p);
 
-inline InputScalar turn_horizontally;
-inline InputScalar turn_vertically;
+inline MouseLatch mouse_movement;
 inline InputScalar turn_4D;
 
 
@@ -9,4 +9,5 @@
 #include "math/Vec2.hpp"
 #include "math/Vec3.hpp"
 #include "math/Vec4.hpp"
+#include "math/transforms.hpp"
 #include "math/vec_extra.hpp"
\ No newline at end of file
@@ -4,10 +4,22 @@
 #include <util.hpp>
 #include <iomanip>
 #include <array>
+#include <type_traits>
+
+#include "matrix_kernels.hpp"
 
 
 /** Matrix<h,w> represents a two-dimensional matrix.
- * Following matrix conventions, this class uses (y,x) instead of (x,y) */
+ * Following matrix conventions, this class uses (y,x) instead of (x,y)
+ *
+ * Matrix is an aggregate, so you can write `Matrix<2,2> m = {1,2, 3,4};`.
+ * Everything is constexpr, so matrices can be built at compile time.
+ *
+ * The arithmetic operators (further below) don't return matrices but
+ * lightweight expression objects. A chain like `a + b * 2 - c` is only
+ * evaluated when it's assigned to a Matrix, in a single loop without any
+ * temporary matrices in between. Because the expressions keep references to
+ * their operands, don't store them with `auto`: assign them to a Matrix. */
 template<uint _height, uint _width, typename Scalar_ = double>
 class Matrix {
 private:
@@ -27,152 +39,350 @@ public:
   
   //### OPERATORS ###
   
-  Scalar& operator () (uint y, uint x) {
+  constexpr Scalar& operator () (uint y, uint x) {
     return get(y, x);
   }
   
-  Scalar operator () (uint y, uint x) const {
+  constexpr Scalar operator () (uint y, uint x) const {
     return get(y, x);
   }
   
-  Scalar& get(uint y, uint x) {
+  constexpr Scalar& get(uint y, uint x) {
     return data[y*width + x];
   }
   
-  Scalar get(uint y, uint x) const {
+  constexpr Scalar get(uint y, uint x) const {
     return data[y*width + x];
   }
   
   
-  //# logical operators #
+  //# assignment operators #
+  // The other operators are defined further below, because they work on any
+  // combination of matrices and matrix expressions.
   
-  bool operator == (const Matrix<h,w,S>& other) const {
-    return data == other.data;
+  template<class Expression>
+  constexpr Matrix<h,w,S>& operator += (const Expression& other) {
+    // Evaluate first, the expression might contain this matrix.
+    *this = evaluate(*this + other);
+    return *this;
   }
   
-  bool operator != (const Matrix<h,w,S>& other) const {
-    return data != other.data;
+  template<class Expression>
+  constexpr Matrix<h,w,S>& operator -= (const Expression& other) {
+    *this = evaluate(*this - other);
+    return *this;
   }
   
-  
-  //# matrix operators #
-  
-  Matrix<h,w,S>& operator += (const Matrix<h,w,S>& other) {
+  constexpr Matrix<h,w,S>& operator *= (Scalar factor) {
     for (uint i = 0; i < data.size(); i++)
-      data[i] += other.data[i];
+      data[i] *= factor;
     return *this;
   }
   
-  
-  Matrix<h,w,S>& operator -= (const Matrix<h,w,S>& other) {
+  constexpr Matrix<h,w,S>& operator /= (Scalar factor) {
     for (uint i = 0; i < data.size(); i++)
-      data[i] -= other.data[i];
+      data[i] /= factor;
     return *this;
   }
   
   
-  Matrix<h,w,S> operator + (const Matrix<h,w,S>& other) const {
-    Matrix<h,w,S> result;
-    
-    for (uint i = 0; i < data.size(); i++)
-      result[i] = data[i] + other.data[i];
-    
-    return result;
-  }
-  
+  //### FUNCTIONS ###
   
-  Matrix<h,w,S> operator - (const Matrix<h,w,S>& other) const {
-    Matrix<h,w,S> result;
+  constexpr Matrix<w,h,S> transposed() const {
+    Matrix<w,h,S> result{};
     
-    for (uint i = 0; i < data.size(); i++)
-      result[i] = data[i] - other.data[i];
+    for (uint y = 0; y < h; y++)
+      for (uint x = 0; x < w; x++)
+        result(x,y) = get(y,x);
     
     return result;
   }
-  
-  
-  template<uint h2, uint w2>
-  Matrix<h,w2,S> operator * (const Matrix<h2,w2,S>& other) {
-    static_assert(w == h2,
-        "These matrices cannot be multiplied. "
-        "The width of the first matrix must be the same as the height of the "
-        "second matrix. Currently these sizes don't match.");
-    
-    Matrix<h,w2,S> result;
-    
-    // For each row of the first operand...
-    for (uint y = 0; y < h; y++) {
-      
-      // For each column of the second operand...
-      for (uint x2 = 0; x2 < w2; x2++) {
-        
-        // The usual matrix multiplication stuff
-        Scalar& target = result(y, x2);
-        target = 0;
-        
-        for (int i = 0; i < w; i++)
-          target += get(y, i) * other(i, x2);
-      }
-    }
-    
-    return result;
+};
+
+
+
+
+//### EXPRESSION TEMPLATES ###
+
+// Every expression class derives from this tag. An expression has the same
+// interface as a const Matrix: `height`, `width`, `Scalar` and `(y, x)`.
+struct MatrixExpressionTag {};
+
+template<class T>
+struct is_matrix : std::false_type {};
+
+template<uint h, uint w, typename S>
+struct is_matrix<Matrix<h,w,S>> : std::true_type {};
+
+template<class T>
+constexpr bool is_matrix_v = is_matrix<std::decay_t<T>>::value;
+
+// True for both matrices and matrix expressions.
+template<class T>
+constexpr bool is_matrix_like_v =
+    is_matrix_v<T> || std::is_base_of_v<MatrixExpressionTag, std::decay_t<T>>;
+
+template<class E>
+using MatrixOf = Matrix<E::height, E::width, typename E::Scalar>;
+
+
+// Evaluate any expression into a new matrix.
+template<class Expression>
+constexpr MatrixOf<Expression> evaluate(const Expression& expression) {
+  MatrixOf<Expression> result{};
+  expression.evaluateInto(result);
+  return result;
+}
+
+
+// How an expression stores one of its operands:
+// - Matrices are stored by reference, so they're never copied.
+// - Element-wise expressions are stored by value. They're tiny and evaluating
+//   one element of them is cheap.
+// - Products are evaluated into a matrix right away, because every element of
+//   a product would otherwise be recalculated over and over again.
+template<class E, class = void>
+struct MatrixNested { using type = E; };
+
+template<uint h, uint w, typename S>
+struct MatrixNested<Matrix<h,w,S>> { using type = const Matrix<h,w,S>&; };
+
+template<class E>
+struct MatrixNested<E, std::enable_if_t<E::is_product>> {
+  using type = MatrixOf<E>;
+};
+
+template<class E>
+using nested_t = typename MatrixNested<std::decay_t<E>>::type;
+
+
+// A binary operation applied to each pair of elements, e.g. a sum.
+template<class A, class B, class Operation>
+struct MatrixElementwise : MatrixExpressionTag {
+  using Scalar = typename std::decay_t<A>::Scalar;
+  static constexpr uint height = std::decay_t<A>::height;
+  static constexpr uint width = std::decay_t<A>::width;
+  static constexpr bool is_product = false;
+  
+  static_assert(height == std::decay_t<B>::height
+                && width == std::decay_t<B>::width,
+                "These matrices don't have the same size.");
+  static_assert(std::is_same_v<Scalar, typename std::decay_t<B>::Scalar>,
+                "These matrices don't have the same scalar type.");
+  
+  nested_t<A> a;
+  nested_t<B> b;
+  
+  constexpr MatrixElementwise(const A& a, const B& b) : a(a), b(b) {}
+  
+  constexpr Scalar operator () (uint y, uint x) const {
+    return Operation::apply(a(y, x), b(y, x));
   }
   
-  
-  //# scalar operators #
-  
-  Matrix<h,w,S> operator * (Scalar factor) const {
-    Matrix<h,w,S> result;
-    
-    for (uint i = 0; i < data.size(); i++)
-      result[i] = data[i] * factor;
-    
-    return result;
+  template<class Target>
+  constexpr void evaluateInto(Target& target) const {
+    for (uint y = 0; y < height; y++)
+      for (uint x = 0; x < width; x++)
+        target(y, x) = (*this)(y, x);
   }
   
-  Matrix<h,w,S> operator / (Scalar factor) const {
-    Matrix<h,w,S> result;
-    
-    for (uint i = 0; i < data.size(); i++)
-      result[i] = data[i] / factor;
-    
-    return result;
+  constexpr operator MatrixOf<MatrixElementwise>() const {
+    return evaluate(*this);
   }
-  
-  Matrix<h,w,S>& operator *= (Scalar factor) const {
-    for (uint i = 0; i < data.size(); i++)
-      data[i] *= factor;
-    return *this;
+};
+
+
+// A matrix and a scalar, e.g. `matrix * 2`.
+template<class A, class Operation>
+struct MatrixScalarOperation : MatrixExpressionTag {
+  using Scalar = typename std::decay_t<A>::Scalar;
+  static constexpr uint height = std::decay_t<A>::height;
+  static constexpr uint width = std::decay_t<A>::width;
+  static constexpr bool is_product = false;
+  
+  nested_t<A> a;
+  Scalar factor;
+  
+  constexpr MatrixScalarOperation(const A& a, Scalar factor)
+      : a(a), factor(factor) {}
+  
+  constexpr Scalar operator () (uint y, uint x) const {
+    return Operation::apply(a(y, x), factor);
   }
   
-  Matrix<h,w,S>& operator /= (Scalar factor) const {
-    for (uint i = 0; i < data.size(); i++)
-      data[i] /= factor;
-    return *this;
+  template<class Target>
+  constexpr void evaluateInto(Target& target) const {
+    for (uint y = 0; y < height; y++)
+      for (uint x = 0; x < width; x++)
+        target(y, x) = (*this)(y, x);
   }
   
-  
-  //### FUNCTIONS ###
-  
-  Matrix<w,h> transposed() const {
-    Matrix<w,h> result;
-    
-    for (uint y = 0; y < h; y++)
-      for (uint x = 0; x < w; x++)
-        result(x,y) = get(y,x);
+  constexpr operator MatrixOf<MatrixScalarOperation>() const {
+    return evaluate(*this);
+  }
+};
+
+
+// The usual matrix multiplication stuff, for any size. The specializations
+// for 4x4 and 5x5 matrices of doubles are below.
+template<uint h, uint n, uint w, typename S>
+constexpr void multiplyInto(const Matrix<h,n,S>& a, const Matrix<n,w,S>& b,
+                            Matrix<h,w,S>& result) {
+  // For each row of the first operand...
+  for (uint y = 0; y < h; y++) {
     
-    return result;
+    // For each column of the second operand...
+    for (uint x2 = 0; x2 < w; x2++) {
+      S sum = 0;
+      for (uint i = 0; i < n; i++)
+        sum += a(y, i) * b(i, x2);
+      result(y, x2) = sum;
+    }
+  }
+}
+
+constexpr void multiplyInto(const Matrix<4,4,double>& a,
+                            const Matrix<4,4,double>& b,
+                            Matrix<4,4,double>& result) {
+  if (FRUIT_IS_CONSTANT_EVALUATED())
+    multiplyInto<4,4,4,double>(a, b, result);
+  else
+    matrix_kernels::multiply4x4(a.data.data(), b.data.data(),
+                                result.data.data());
+}
+
+constexpr void multiplyInto(const Matrix<5,5,double>& a,
+                            const Matrix<5,5,double>& b,
+                            Matrix<5,5,double>& result) {
+  if (FRUIT_IS_CONSTANT_EVALUATED())
+    multiplyInto<5,5,5,double>(a, b, result);
+  else
+    matrix_kernels::multiply5x5(a.data.data(), b.data.data(),
+                                result.data.data());
+}
+
+
+// Matrix multiplication. Both operands are evaluated to matrices first (which
+// is free when they already are matrices), so that the multiplication itself
+// can use the fast kernels.
+template<class A, class B>
+struct MatrixProduct : MatrixExpressionTag {
+  using Scalar = typename std::decay_t<A>::Scalar;
+  static constexpr uint height = std::decay_t<A>::height;
+  static constexpr uint width = std::decay_t<B>::width;
+  static constexpr bool is_product = true;
+  
+  static_assert(std::decay_t<A>::width == std::decay_t<B>::height,
+      "These matrices cannot be multiplied. "
+      "The width of the first matrix must be the same as the height of the "
+      "second matrix. Currently these sizes don't match.");
+  static_assert(std::is_same_v<Scalar, typename std::decay_t<B>::Scalar>,
+                "These matrices don't have the same scalar type.");
+  
+  nested_t<A> a;
+  nested_t<B> b;
+  
+  constexpr MatrixProduct(const A& a, const B& b) : a(a), b(b) {}
+  
+  constexpr void evaluateInto(MatrixOf<MatrixProduct>& target) const {
+    if constexpr (is_matrix_v<nested_t<A>> && is_matrix_v<nested_t<B>>)
+      multiplyInto(a, b, target);
+    else if constexpr (is_matrix_v<nested_t<A>>)
+      multiplyInto(a, evaluate(b), target);
+    else if constexpr (is_matrix_v<nested_t<B>>)
+      multiplyInto(evaluate(a), b, target);
+    else
+      multiplyInto(evaluate(a), evaluate(b), target);
+  }
+  
+  constexpr operator MatrixOf<MatrixProduct>() const {
+    return evaluate(*this);
   }
 };
 
 
 
-// More operators
-template<uint h, uint w, typename S>
-Matrix<h,w,S> operator * (S scalar, Matrix<h,w,S> matrix) {
-  return matrix * scalar;
+
+//### OPERATORS ###
+
+namespace matrix_ops {
+  struct Add {
+    template<class S> static constexpr S apply(S a, S b) { return a + b; }
+  };
+  struct Subtract {
+    template<class S> static constexpr S apply(S a, S b) { return a - b; }
+  };
+  struct Multiply {
+    template<class S> static constexpr S apply(S a, S b) { return a * b; }
+  };
+  struct Divide {
+    template<class S> static constexpr S apply(S a, S b) { return a / b; }
+  };
 }
 
+// Only enable an operator when its operands are matrices or expressions.
+template<class A, class B = A>
+using if_matrices_t =
+    std::enable_if_t<is_matrix_like_v<A> && is_matrix_like_v<B>, bool>;
+
+
+//# matrix operators #
+
+template<class A, class B, if_matrices_t<A,B> = true>
+constexpr auto operator + (const A& a, const B& b) {
+  return MatrixElementwise<A, B, matrix_ops::Add>(a, b);
+}
+
+template<class A, class B, if_matrices_t<A,B> = true>
+constexpr auto operator - (const A& a, const B& b) {
+  return MatrixElementwise<A, B, matrix_ops::Subtract>(a, b);
+}
+
+template<class A, class B, if_matrices_t<A,B> = true>
+constexpr auto operator * (const A& a, const B& b) {
+  return MatrixProduct<A, B>(a, b);
+}
+
+
+//# scalar operators #
+
+template<class A, if_matrices_t<A> = true>
+constexpr auto operator * (const A& a, no_deduce_<typename A::Scalar> factor) {
+  return MatrixScalarOperation<A, matrix_ops::Multiply>(a, factor);
+}
+
+template<class A, if_matrices_t<A> = true>
+constexpr auto operator * (no_deduce_<typename A::Scalar> factor, const A& a) {
+  return MatrixScalarOperation<A, matrix_ops::Multiply>(a, factor);
+}
+
+template<class A, if_matrices_t<A> = true>
+constexpr auto operator / (const A& a, no_deduce_<typename A::Scalar> factor) {
+  return MatrixScalarOperation<A, matrix_ops::Divide>(a, factor);
+}
+
+
+//# logical operators #
+
+template<class A, class B, if_matrices_t<A,B> = true>
+constexpr bool operator == (const A& a, const B& b) {
+  static_assert(A::height == B::height && A::width == B::width,
+                "These matrices don't have the same size.");
+  nested_t<A> a2 = a;
+  nested_t<B> b2 = b;
+  
+  for (uint y = 0; y < A::height; y++)
+    for (uint x = 0; x < A::width; x++)
+      if (a2(y, x) != b2(y, x))
+        return false;
+  
+  return true;
+}
+
+template<class A, class B, if_matrices_t<A,B> = true>
+constexpr bool operator != (const A& a, const B& b) {
+  return !(a == b);
+}
 
 
 // Shorthands for alternative types
@@ -186,14 +396,12 @@ template<uint w, uint h> using MatrixU = Matrix<w,h,uint>;
 // Constant matrices
 
 template<uint h, uint w, typename S>
-Matrix<h,w,S> createZeroMatrix() {
-  Matrix<h,w,S> result;
-  result.data.fill(0);
-  return result;
+constexpr Matrix<h,w,S> createZeroMatrix() {
+  return Matrix<h,w,S>{};  // Value-initialization sets everything to zero.
 }
 
 template<uint w, typename S>
-Matrix<w,w,S> createUnitMatrix() {
+constexpr Matrix<w,w,S> createUnitMatrix() {
   Matrix<w,w,S> result = createZeroMatrix<w,w,S>();
   for (uint i = 0; i < w; i++)
     result(i,i) = 1;
@@ -202,10 +410,10 @@ Matrix<w,w,S> createUnitMatrix() {
 
 
 template<uint h, uint w, typename S = double>
-inline Matrix<h,w,S> zeroMatrix = createZeroMatrix<h,w,S>();
+inline constexpr Matrix<h,w,S> zeroMatrix = createZeroMatrix<h,w,S>();
 
 template<uint w, typename S = double>
-inline Matrix<w,w,S> unitMatrix = createUnitMatrix<w,S>();
+inline constexpr Matrix<w,w,S> unitMatrix = createUnitMatrix<w,S>();
 
 
 
@@ -290,6 +498,60 @@ TEST_CASE("zero matrix") {
 TEST_CASE("unit matrix") {
   CHECK(unitMatrix<3> == Matrix<3,3>{1,0,0, 0,1,0, 0,0,1});
 }
+
+
+TEST_CASE("chained matrix expressions") {
+  Matrix<2,2> a = {1, 2, 3, 4};
+  Matrix<2,2> b = {5, 6, 7, 8};
+  
+  Matrix<2,2> sum = a + b * 2.0 - a / 2.0;
+  CHECK(sum == Matrix<2,2>{10.5, 13, 15.5, 18});
+  
+  // Products inside sums, and sums inside products.
+  Matrix<2,2> mixed = (a + b) * a - a * b;
+  CHECK(mixed == Matrix<2,2>{11, 22, 3, 18});
+  
+  // Assignment operators may refer to the same matrix.
+  Matrix<2,2> c = a;
+  c += c * unitMatrix<2>;
+  CHECK(c == a * 2.0);
+}
+
+
+TEST_CASE("constexpr matrices") {
+  constexpr Matrix<2,2> a = {1, 2, 3, 4};
+  constexpr Matrix<2,2> product = a * a + unitMatrix<2>;
+  static_assert(product == Matrix<2,2>{8, 10, 15, 23});
+  
+  constexpr Matrix<4,4> product_4x4 = unitMatrix<4> * unitMatrix<4> * 3.0;
+  static_assert(product_4x4(3,3) == 3 && product_4x4(0,1) == 0);
+  CHECK(product == Matrix<2,2>{8, 10, 15, 23});
+}
+
+
+TEST_CASE("4x4 and 5x5 kernels match the generic multiplication") {
+  Matrix<4,4> a{};
+  Matrix<4,4> b{};
+  Matrix<5,5> c{};
+  Matrix<5,5> d{};
+  
+  for (uint i = 0; i < 16; i++) {
+    a.data[i] = i * 0.5 - 3;
+    b.data[i] = 7 - i * 1.25;
+  }
+  for (uint i = 0; i < 25; i++) {
+    c.data[i] = i * 0.75 - 9;
+    d.data[i] = (i % 7) - 2.5;
+  }
+  
+  Matrix<4,4> generic_4x4{};
+  Matrix<5,5> generic_5x5{};
+  multiplyInto<4,4,4,double>(a, b, generic_4x4);
+  multiplyInto<5,5,5,double>(c, d, generic_5x5);
+  
+  CHECK(Matrix<4,4>(a * b) == generic_4x4);
+  CHECK(Matrix<5,5>(c * d) == generic_5x5);
+}
 #endif
 
 #endif //FRUIT_MATRIX_HPP
@@ -0,0 +1,178 @@
+#ifndef FRUIT_MATRIX_KERNELS_HPP
+#define FRUIT_MATRIX_KERNELS_HPP
+
+// Hand-vectorized kernels for the matrix sizes that matter for 4D math:
+// 4x4 (rotations and other linear maps) and 5x5 (homogeneous transforms).
+//
+// All matrices are row-major arrays of doubles, exactly like Matrix::data.
+// The output may not alias any of the inputs.
+//
+// The SSE2 path is used on every x86-64 compiler. When compiling with -mavx
+// a whole row of a 4x4 matrix fits into a single register, so there's an AVX
+// path too. Everything else (e.g. Emscripten) gets plain loops, which the
+// compiler is free to vectorize on its own.
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define FRUIT_MATRIX_AVX 1
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define FRUIT_MATRIX_SSE2 1
+#endif
+
+
+/** FRUIT_IS_CONSTANT_EVALUATED() is true when the surrounding constexpr
+ * function is being evaluated at compile time. Intrinsics aren't constexpr,
+ * so compile-time evaluation has to skip the kernels in this file. */
+#if defined(__GNUC__) || defined(__clang__)
+#define FRUIT_IS_CONSTANT_EVALUATED() __builtin_is_constant_evaluated()
+#else
+#define FRUIT_IS_CONSTANT_EVALUATED() true  // Always use the plain loops.
+#endif
+
+
+namespace matrix_kernels {
+
+#if FRUIT_MATRIX_SSE2 || FRUIT_MATRIX_AVX
+// Adds the two doubles in a register together.
+inline double horizontalSum(__m128d v) {
+  return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+#endif
+
+
+/** out = a * b for 4x4 matrices. */
+inline void multiply4x4(const double* a, const double* b, double* out) {
+#if FRUIT_MATRIX_AVX
+  // Each row of the result is a linear combination of the rows of b.
+  const __m256d b0 = _mm256_loadu_pd(b);
+  const __m256d b1 = _mm256_loadu_pd(b + 4);
+  const __m256d b2 = _mm256_loadu_pd(b + 8);
+  const __m256d b3 = _mm256_loadu_pd(b + 12);
+  
+  for (int y = 0; y < 4; y++) {
+    const double* row = a + 4*y;
+    __m256d r = _mm256_mul_pd(_mm256_set1_pd(row[0]), b0);
+    r = _mm256_add_pd(r, _mm256_mul_pd(_mm256_set1_pd(row[1]), b1));
+    r = _mm256_add_pd(r, _mm256_mul_pd(_mm256_set1_pd(row[2]), b2));
+    r = _mm256_add_pd(r, _mm256_mul_pd(_mm256_set1_pd(row[3]), b3));
+    _mm256_storeu_pd(out + 4*y, r);
+  }
+#elif FRUIT_MATRIX_SSE2
+  // Same idea as the AVX version, but a row takes two registers.
+  for (int y = 0; y < 4; y++) {
+    const double* row = a + 4*y;
+    __m128d left = _mm_setzero_pd();
+    __m128d right = _mm_setzero_pd();
+    
+    for (int k = 0; k < 4; k++) {
+      const __m128d factor = _mm_set1_pd(row[k]);
+      left = _mm_add_pd(left, _mm_mul_pd(factor, _mm_loadu_pd(b + 4*k)));
+      right = _mm_add_pd(right, _mm_mul_pd(factor, _mm_loadu_pd(b + 4*k + 2)));
+    }
+    
+    _mm_storeu_pd(out + 4*y, left);
+    _mm_storeu_pd(out + 4*y + 2, right);
+  }
+#else
+  for (int y = 0; y < 4; y++)
+    for (int x = 0; x < 4; x++)
+      out[4*y + x] = a[4*y] * b[x] + a[4*y + 1] * b[4 + x]
+                     + a[4*y + 2] * b[8 + x] + a[4*y + 3] * b[12 + x];
+#endif
+}
+
+
+/** out = a * b for 5x5 matrices. */
+inline void multiply5x5(const double* a, const double* b, double* out) {
+#if FRUIT_MATRIX_AVX
+  // The first four columns go through a vector register, the fifth column is
+  // done with scalars.
+  for (int y = 0; y < 5; y++) {
+    const double* row = a + 5*y;
+    __m256d r = _mm256_setzero_pd();
+    double last = 0;
+    
+    for (int k = 0; k < 5; k++) {
+      r = _mm256_add_pd(r, _mm256_mul_pd(_mm256_set1_pd(row[k]),
+                                         _mm256_loadu_pd(b + 5*k)));
+      last += row[k] * b[5*k + 4];
+    }
+    
+    _mm256_storeu_pd(out + 5*y, r);
+    out[5*y + 4] = last;
+  }
+#elif FRUIT_MATRIX_SSE2
+  for (int y = 0; y < 5; y++) {
+    const double* row = a + 5*y;
+    __m128d left = _mm_setzero_pd();
+    __m128d middle = _mm_setzero_pd();
+    double last = 0;
+    
+    for (int k = 0; k < 5; k++) {
+      const __m128d factor = _mm_set1_pd(row[k]);
+      left = _mm_add_pd(left, _mm_mul_pd(factor, _mm_loadu_pd(b + 5*k)));
+      middle = _mm_add_pd(middle, _mm_mul_pd(factor, _mm_loadu_pd(b + 5*k + 2)));
+      last += row[k] * b[5*k + 4];
+    }
+    
+    _mm_storeu_pd(out + 5*y, left);
+    _mm_storeu_pd(out + 5*y + 2, middle);
+    out[5*y + 4] = last;
+  }
+#else
+  for (int y = 0; y < 5; y++) {
+    for (int x = 0; x < 5; x++) {
+      double sum = 0;
+      for (int k = 0; k < 5; k++)
+        sum += a[5*y + k] * b[5*k + x];
+      out[5*y + x] = sum;
+    }
+  }
+#endif
+}
+
+
+/** out = m * v for a 4x4 matrix and a 4-element column vector. */
+inline void transform4(const double* m, const double* v, double* out) {
+#if FRUIT_MATRIX_SSE2 || FRUIT_MATRIX_AVX
+  const __m128d v01 = _mm_loadu_pd(v);
+  const __m128d v23 = _mm_loadu_pd(v + 2);
+  
+  for (int y = 0; y < 4; y++) {
+    __m128d products = _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(m + 4*y), v01),
+                                  _mm_mul_pd(_mm_loadu_pd(m + 4*y + 2), v23));
+    out[y] = horizontalSum(products);
+  }
+#else
+  for (int y = 0; y < 4; y++)
+    out[y] = m[4*y] * v[0] + m[4*y + 1] * v[1]
+             + m[4*y + 2] * v[2] + m[4*y + 3] * v[3];
+#endif
+}
+
+
+/** out = m * (v, last) for a 5x5 matrix, where `last` is the homogeneous
+ * coordinate (1 for points and 0 for directions). Out has 5 elements. */
+inline void transform5(const double* m, const double* v, double last,
+                       double* out) {
+#if FRUIT_MATRIX_SSE2 || FRUIT_MATRIX_AVX
+  const __m128d v01 = _mm_loadu_pd(v);
+  const __m128d v23 = _mm_loadu_pd(v + 2);
+  
+  for (int y = 0; y < 5; y++) {
+    __m128d products = _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(m + 5*y), v01),
+                                  _mm_mul_pd(_mm_loadu_pd(m + 5*y + 2), v23));
+    out[y] = horizontalSum(products) + m[5*y + 4] * last;
+  }
+#else
+  for (int y = 0; y < 5; y++)
+    out[y] = m[5*y] * v[0] + m[5*y + 1] * v[1] + m[5*y + 2] * v[2]
+             + m[5*y + 3] * v[3] + m[5*y + 4] * last;
+#endif
+}
+
+}  // namespace matrix_kernels
+
+
+#endif //FRUIT_MATRIX_KERNELS_HPP
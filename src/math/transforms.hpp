@@ -0,0 +1,122 @@
+#pragma once
+
+
+#include "Matrix.hpp"
+#include "Vec4.hpp"
+#include "constants.hpp"
+#include "vec_extra.hpp"
+
+
+// Linear and homogeneous transformations of 4D space.
+//
+// 4D rotations don't happen around an axis but on a plane, which is spanned by
+// two axes. The axes are numbered like the elements of a Vec4: X=0, Y=1, Z=2
+// and W=3.
+
+
+/** Creates a rotation on the plane spanned by `from` and `to`. A positive
+ * angle rotates the `from` axis towards the `to` axis. */
+inline Matrix<4,4> rotationMatrix(uint from, uint to, double angle) {
+  Matrix<4,4> result = unitMatrix<4>;
+  const double c = cos(angle);
+  const double s = sin(angle);
+  result(from, from) = c;
+  result(to, to) = c;
+  result(to, from) = s;
+  result(from, to) = -s;
+  return result;
+}
+
+
+/** Turns a linear transformation into a homogeneous one, optionally with a
+ * translation. */
+inline Matrix<5,5> homogeneousMatrix(const Matrix<4,4>& linear,
+                                     Vec4 translation = {0,0,0,0}) {
+  Matrix<5,5> result = unitMatrix<5>;
+  
+  for (uint y = 0; y < 4; y++) {
+    for (uint x = 0; x < 4; x++)
+      result(y, x) = linear(y, x);
+    result(y, 4) = translation[y];
+  }
+  
+  return result;
+}
+
+
+inline Matrix<5,5> translationMatrix(Vec4 translation) {
+  return homogeneousMatrix(unitMatrix<4>, translation);
+}
+
+
+inline Vec4 operator * (const Matrix<4,4>& matrix, const Vec4& vector) {
+  Vec4 result;
+  matrix_kernels::transform4(matrix.data.data(), vector.a, result.a);
+  return result;
+}
+
+
+/** Applies a homogeneous transformation to a point (so the translation part
+ * of the transformation matters). */
+inline Vec4 transformPoint(const Matrix<5,5>& matrix, const Vec4& point) {
+  double result[5];
+  matrix_kernels::transform5(matrix.data.data(), point.a, 1, result);
+  return Vec4(result[0], result[1], result[2], result[3]) / result[4];
+}
+
+
+/** Applies a homogeneous transformation to a direction (so the translation
+ * part of the transformation is ignored). */
+inline Vec4 transformDirection(const Matrix<5,5>& matrix, const Vec4& dir) {
+  double result[5];
+  matrix_kernels::transform5(matrix.data.data(), dir.a, 0, result);
+  return Vec4(result[0], result[1], result[2], result[3]);
+}
+
+
+/** Returns one of the columns of the matrix as a vector. */
+inline Vec4 column(const Matrix<4,4>& matrix, uint x) {
+  return {matrix(0, x), matrix(1, x), matrix(2, x), matrix(3, x)};
+}
+
+
+
+#ifdef ENABLE_DOCTEST
+#include <doctest/doctest.h>
+TEST_CASE("4D rotation matrices") {
+  auto approxEquals = [](Vec4 a, Vec4 b) -> bool {
+    Vec4 diff = a - b;
+    return diff.calcLength() < 0.000001;
+  };
+  
+  const double hpi = pi / 2.0;
+  const Vec4 x_axis = {1,0,0,0};
+  
+  CHECK(approxEquals(rotationMatrix(0, 1, hpi) * x_axis, Vec4(0,1,0,0)));
+  CHECK(approxEquals(rotationMatrix(0, 3, hpi) * x_axis, Vec4(0,0,0,1)));
+  CHECK(approxEquals(rotationMatrix(0, 3, -hpi) * x_axis, Vec4(0,0,0,-1)));
+  
+  // The camera's orientation is a chain of three rotations. The forward
+  // direction of the camera should be the same as dir_vec.
+  const double yaw = 0.7, pitch = -0.3, wy = 1.1;
+  Matrix<4,4> orientation = rotationMatrix(3, 1, wy)
+                            * rotationMatrix(0, 1, yaw)
+                            * rotationMatrix(0, 2, pitch);
+
+  CHECK(approxEquals(orientation * x_axis, dir_vec(yaw, pitch, wy)));
+}
+
+
+TEST_CASE("homogeneous transforms") {
+  Matrix<5,5> move = translationMatrix({1, 2, 3, 4});
+  Matrix<5,5> turn = homogeneousMatrix(rotationMatrix(0, 1, pi / 2));
+  Matrix<5,5> both = move * turn;
+  
+  Vec4 p = transformPoint(both, {1, 0, 0, 0});
+  CHECK((p - Vec4(1, 3, 3, 4)).calcLength() < 0.000001);
+  
+  // Directions ignore the translation.
+  Vec4 d = transformDirection(both, {1, 0, 0, 0});
+  CHECK((d - Vec4(0, 1, 0, 0)).calcLength() < 0.000001);
+}
+#endif
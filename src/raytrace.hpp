@@ -1,26 +1,67 @@
 #pragma once
 
 #include "geometry.hpp"
+#include "geometry/StaticScene.hpp"
+#include "util/SnapshotStore.hpp"
 
-inline List<Unique<iIntersectable>> world;
+// The forms that can change while the program is running. Everything else is
+// in the static scene (see geometry/StaticScene.hpp).
+// A published version of the scene never changes, so that it can be traced
+// while the next version is being made (see util/SnapshotStore.hpp). Versions
+// share the forms that didn't change.
+struct DynamicScene {
+  uint version = 0;
+  List<Shared<const iIntersectable>> forms;
+};
+
+inline SnapshotStore<DynamicScene> world;
 
 inline Vec4 background_color = {.25,0,.05,1};  // purple
 inline Vec4 background_color_2 = {0,0,.3,1};  // dark blue
 inline Vec4 fallback_light_color = {1,1,1,1};  // white
 inline Vec4 fallback_dark_color = {.5,.5,.5,1};  // grey
 
+// The primitive "ID" of rays that don't hit anything.
+inline constexpr uint NO_PRIMITIVE = maxOf<uint>;
+
+
+
+// Everything there is to know about the nearest thing a ray hits.
+struct RayHit {
+  double distance = Limits<double>::infinity();
+  
+  // Primitives of the static scene are numbered in the order of the scene
+  // file, and the dynamic forms come after them.
+  uint primitive = NO_PRIMITIVE;
+  
+  Vec4 lightColor = fallback_light_color;
+  Vec4 darkColor = fallback_dark_color;
+  
+  // How much work it took to find the hit. Only counted if you ask for it.
+  uint work = 0;
+  
+  bool isHit() const {
+    return primitive != NO_PRIMITIVE;
+  }
+};
+
 
 
 // Note: Drawing the whole screen is done in MainScreen::render
 
-// Trace a single ray.
-inline Vec4 raytrace(const Ray& ray) {
-  // Go through all the forms to find the nearest form the ray hits...
-  double smallestDistance = Limits<double>::max();
+// Find the nearest form a ray hits.
+template<bool countWork = false>
+RayHit findNearestHit(const DynamicScene& scene, const Ray& ray) {
+  // Find the nearest form of the static scene...
+  const StaticSceneHit staticHit = findNearestStaticHit<countWork>(ray);
+  
+  // Go through all the dynamic forms to see if any of them are even nearer...
+  double smallestDistance = staticHit.distance;
   const iIntersectable* nearestForm = nullptr;
+  uint nearestIndex = 0;
   
-  for (const auto& form : world) {
-    Vec4 intersection = form->findIntersection(ray);
+  for (uint i = 0; i < scene.forms.size(); i++) {
+    Vec4 intersection = scene.forms[i]->findIntersection(ray);
     
     if (intersection != nowhere) {
       // Hit!
@@ -28,31 +69,48 @@ inline Vec4 raytrace(const Ray& ray) {
       
       if (distance < smallestDistance) {
         smallestDistance = distance;
-        nearestForm = form.get();
+        nearestForm = scene.forms[i].get();
+        nearestIndex = i;
       }
     }
   }
   
+  RayHit hit;
   
-  if (nearestForm == nullptr) {
-    // We didn't hit anything...
-    return cos(ray.d.w) * background_color + sin(ray.d.w) * background_color_2;
-  }
-  
-  
-  // Send back the color of the nearest form...
+  if constexpr (countWork)
+    hit.work = staticHit.work + scene.forms.size();
   
-  // See if the nearest form implements iColored, and take those colors if yes
-  Vec4 lightColor = fallback_light_color;
-  Vec4 darkColor = fallback_dark_color;
+  if (nearestForm != nullptr) {
+    hit.distance = smallestDistance;
+    hit.primitive = static_scene::primitive_count + nearestIndex;
+    
+    // See if the nearest form implements iColored, and take those colors if yes
+    if (auto colors = dynamic_cast<const iColored*>(nearestForm)) {
+      hit.lightColor = colors->getLightColor();
+      hit.darkColor = colors->getDarkColor();
+    }
+  } else if (staticHit.isHit()) {
+    const double* light = staticHit.lightColor;
+    const double* dark = staticHit.darkColor;
+    hit.distance = staticHit.distance;
+    hit.primitive = staticHit.sceneIndex;
+    hit.lightColor = {light[0], light[1], light[2], light[3]};
+    hit.darkColor = {dark[0], dark[1], dark[2], dark[3]};
+  }
   
-  if (auto colors = dynamic_cast<const iColored*>(nearestForm)) {
-    lightColor = colors->getLightColor();
-    darkColor = colors->getDarkColor();
+  return hit;
+}
+
+
+// The color of a ray, given what it hit.
+inline Vec4 shade(const Ray& ray, const RayHit& hit) {
+  if (!hit.isHit()) {
+    // We didn't hit anything...
+    return cos(ray.d.w) * background_color + sin(ray.d.w) * background_color_2;
   }
   
   // Blend dark & light colors based upon distance...
-  double distance = smallestDistance;
+  double distance = hit.distance;
   
   double brightness = 1;
   if (distance != 0)
@@ -61,7 +119,40 @@ inline Vec4 raytrace(const Ray& ray) {
   brightness = clamp(brightness, 0, 1);
   double darkness = 1-brightness;
   
-  Vec4 color = lightColor * brightness + darkColor * darkness;
+  Vec4 color = hit.lightColor * brightness + hit.darkColor * darkness;
   color.w = 1;
   return color;
 }
+
+
+// What a ray that hits `primitive` after `distance` looks like, without
+// tracing it (see Reprojector).
+inline Vec4 shadePrimitive(
+    const DynamicScene& scene, const Ray& ray, uint primitive, double distance
+) {
+  RayHit hit;
+  hit.distance = distance;
+  hit.primitive = primitive;
+  
+  if (primitive >= static_scene::primitive_count) {
+    const iIntersectable* form =
+        scene.forms[primitive - static_scene::primitive_count].get();
+    if (auto colors = dynamic_cast<const iColored*>(form)) {
+      hit.lightColor = colors->getLightColor();
+      hit.darkColor = colors->getDarkColor();
+    }
+  } else {
+    const double* light = static_scene::primitive_light_color[primitive];
+    const double* dark = static_scene::primitive_dark_color[primitive];
+    hit.lightColor = {light[0], light[1], light[2], light[3]};
+    hit.darkColor = {dark[0], dark[1], dark[2], dark[3]};
+  }
+  
+  return shade(ray, hit);
+}
+
+
+// Trace a single ray.
+inline Vec4 raytrace(const DynamicScene& scene, const Ray& ray) {
+  return shade(ray, findNearestHit(scene, ray));
+}
@@ -7,6 +7,7 @@
 #include "raytrace.hpp"
 #include "io/handleInput.hpp"
 #include "main/MainScreen.hpp"
+#include "render/quantize.hpp"
 #include "util/debug.hpp"
 
 
@@ -20,12 +21,21 @@ static void moreInterestingMain();
 
 
 // realMain is just an exception catcher
-void realMain() {
+void realMain(int argument_count, char* arguments[]) {
+  // Invalid options throw, so the settings are read inside of the catcher.
+  auto readSettingsAndRun = [&]() {
+    renderSettings = readRenderSettings(argument_count, arguments);
+#ifdef ENABLE_THREADS
+    threadSettings = readThreadSettings(argument_count, arguments);
+#endif
+    moreInterestingMain();
+  };
+
 #ifdef PLEASE_JUST_CRASH
   // If an exception is thrown, just crash. Useful for debugging in an IDE.
-  moreInterestingMain();
+  readSettingsAndRun();
 #else
-  runAndPrintExceptions(moreInterestingMain);
+  runAndPrintExceptions(readSettingsAndRun);
 #endif
 }
 
@@ -48,7 +58,8 @@ static void moreInterestingMain() {
 }
 
 
-// Color values should be between 0.0 and 1.0 for each channel
+// Color values should be between 0.0 and 1.0 for each channel. For many
+// pixels in a row, PixelRowWriter is faster (see render/quantize.hpp).
 void setPixel(SDL_Surface* surface, int x, int y, Vec4 color) {
   assert(surface->format->format & SDL_PIXELFORMAT_RGBA8888);
   assert(x >= 0 && x < surface->w);
@@ -60,30 +71,27 @@ void setPixel(SDL_Surface* surface, int x, int y, Vec4 color) {
   // Get a pointer to the first byte of the pixel.
   u8* pixel = reinterpret_cast<u8*>(surface->pixels)
               + row_size * y + pixel_size * x;
-  
-  // Set each of the color channels separately.
-  for (int i = 0; i < 4; i++) {
-    double value = color[i] * 255.0;
-    pixel[i] = (u8) clamp(value, 0.0, 255.0);
-  }
+  *reinterpret_cast<u32*>(pixel) = quantizeColor(color);
 }
 
 
 void setPixel(SDL_Surface* surface, int x, int y, u32 rgba) {
-  assert_(surface->format->format == SDL_PIXELFORMAT_RGBA8888);
+  // Like the canvases, with red in the lowest byte (see quantizeColor).
+  assert(surface->format->format == SDL_PIXELFORMAT_RGBA32);
+  assert(x >= 0 && x < surface->w);
+  assert(y >= 0 && y < surface->h);
   
   const int row_size = surface->pitch;
   const int pixel_size = 4;
   
-  u32* pixel = reinterpret_cast<u32*>(surface->pixels)
+  u8* pixel = reinterpret_cast<u8*>(surface->pixels)
               + row_size * y + pixel_size * x;
-  *pixel = rgba;
+  *reinterpret_cast<u32*>(pixel) = rgba;
 }
 
 
 void clearScreen() {
-  const u32 black = SDL_MapRGB(canvas->format, 0, 0, 0);
-  SDL_FillRect(canvas, nullptr, black);
+  const u32 black = SDL_MapRGB(screen->format, 0, 0, 0);
   SDL_FillRect(screen, nullptr, black);
 }
 
@@ -173,12 +181,8 @@ void initSDL() {
     THROW("Failed to create a window: " + getSdlError());
   
   screen = SDL_GetWindowSurface(window);
-  canvas = SDL_CreateRGBSurfaceWithFormat(
-      0, windowWidth, windowHeight, 32, SDL_PIXELFORMAT_RGBA32
-  );
   
-  if (canvas == nullptr)
-    THROW("Failed to create a canvas: " + getSdlError());
+  // Note: The canvases are created by MainScreen (see FramePipeline)
   
   if (TTF_Init() == -1)
     THROW("Failed to initialize SDL TTF: " + String(TTF_GetError()));
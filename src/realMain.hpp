@@ -15,8 +15,9 @@ inline double deltaTime = .001;
 
 inline SDL_Window* window = nullptr;
 // This Surface is the render target. We're doing good old software rendering.
+// The raytracer draws on canvases, which are then copied onto the screen
+// (see FramePipeline).
 inline SDL_Surface* screen = nullptr;
-inline SDL_Surface* canvas = nullptr;
 
 inline TTF_Font* font = nullptr;
 inline SDL_Color white = {255, 255, 255};
@@ -28,7 +29,6 @@ inline uint windowHeight = 600;
 inline bool isControllingCamera = false;
 
 
-Vec4 raytrace(const Ray& ray);
 void setPixel(SDL_Surface* surface, int x, int y, Vec4 color);
 void setPixel(SDL_Surface* surface, int x, int y, u32 rgba);
 void clearScreen();
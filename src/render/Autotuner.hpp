@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include "util.hpp"
+
+
+// Finds the fastest tile size and thread count for this machine by rendering
+// a few frames with each combination. The results are remembered in a small
+// text file, so that the next run with the same resolution and CPU doesn't
+// have to measure again.
+
+
+struct RenderConfig {
+  int tileSize = 16;
+  uint threadCount = 1;
+};
+
+
+inline bool operator == (const RenderConfig& a, const RenderConfig& b) {
+  return a.tileSize == b.tileSize && a.threadCount == b.threadCount;
+}
+
+
+
+//### Tuning ###
+
+/** All combinations of the given tile sizes and thread counts. */
+inline List<RenderConfig> combineConfigs(
+    const List<int>& tileSizes, const List<uint>& threadCounts
+) {
+  List<RenderConfig> configs;
+  for (uint threadCount : threadCounts)
+    for (int tileSize : tileSizes)
+      configs.push_back({tileSize, threadCount});
+  return configs;
+}
+
+
+/** The thread counts worth trying: 1, 2, 4, ... and the maximum itself. */
+inline List<uint> candidateThreadCounts(uint maxThreads) {
+  List<uint> counts;
+  for (uint count = 1; count < maxThreads; count *= 2)
+    counts.push_back(count);
+  counts.push_back(std::max(maxThreads, 1u));
+  return counts;
+}
+
+
+/** Returns the config for which `measureFrame(config)` returns the smallest
+ * amount of seconds. */
+template<class MeasureFrame>
+RenderConfig findFastestConfig(
+    const List<RenderConfig>& configs, MeasureFrame measureFrame
+) {
+  if (configs.empty())
+    THROW("There's nothing to autotune.");
+  
+  RenderConfig fastest = configs[0];
+  double fastestSeconds = Limits<double>::infinity();
+  
+  for (const RenderConfig& config : configs) {
+    double seconds = measureFrame(config);
+    if (seconds < fastestSeconds) {
+      fastest = config;
+      fastestSeconds = seconds;
+    }
+  }
+  
+  return fastest;
+}
+
+
+
+//### Cache ###
+
+// One line per machine and resolution:
+//   <key> <tile size> <thread count>
+// where the key is something like "800x600-cpus8-pincores".
+
+inline Map<String, RenderConfig> loadTuningCache(String$& path) {
+  Map<String, RenderConfig> cache;
+  std::ifstream file(path);
+  String line;
+  
+  while (std::getline(file, line)) {
+    std::istringstream words(line);
+    String key;
+    RenderConfig config;
+    if (words >> key >> config.tileSize >> config.threadCount
+        && config.tileSize > 0 && config.threadCount > 0)
+      cache[key] = config;
+  }
+  
+  return cache;
+}
+
+
+inline void saveTuningCache(
+    String$& path, const Map<String, RenderConfig>& cache
+) {
+  std::ofstream file(path);
+  for (const auto& [key, config] : cache)
+    file << key << " " << config.tileSize << " " << config.threadCount << "\n";
+}
+
+
+
+#ifdef ENABLE_DOCTEST
+#include <doctest/doctest.h>
+TEST_CASE("autotuner") {
+  CHECK(candidateThreadCounts(6) == List<uint>{1, 2, 4, 6});
+  CHECK(candidateThreadCounts(1) == List<uint>{1});
+  
+  // A fake machine that likes 32 pixel tiles and 4 threads.
+  auto configs = combineConfigs({8, 16, 32, 64}, candidateThreadCounts(8));
+  CHECK(configs.size() == 16);
+  
+  RenderConfig fastest = findFastestConfig(configs, [](RenderConfig config) {
+    return std::abs(config.tileSize - 32.0)
+           + std::abs(config.threadCount - 4.0);
+  });
+  CHECK(fastest == RenderConfig{32, 4});
+  
+  // The cache survives a round trip through a file.
+  String path = "autotune_test_cache.txt";
+  saveTuningCache(path, {{"800x600-cpus8-pinnone", {32, 4}}});
+  auto cache = loadTuningCache(path);
+  std::remove(path.c_str());
+  
+  REQUIRE(cache.count("800x600-cpus8-pinnone") == 1);
+  CHECK(cache["800x600-cpus8-pinnone"] == RenderConfig{32, 4});
+}
+#endif
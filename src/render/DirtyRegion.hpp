@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cmath>
+
+#include "geometry/iIntersectable.hpp"
+#include "TileScheduler.hpp"
+#include "ViewRays.hpp"
+#include "util.hpp"
+
+
+// Change-driven rendering: While the camera stands still, a frame only has
+// to trace the part of the screen where the forms that changed were before
+// and are now. The rest of the screen looks the same as in the previous
+// frame, because a pixel only depends on what its ray hits first.
+//
+// A form that changes is replaced by a copy (see DynamicScene), so the forms
+// that changed are the ones that aren't the same object anymore.
+
+
+/** The pixels that the form may cover in `view`, with a margin of a pixel
+ * (for antialiasing). The whole screen if that isn't known. */
+inline Tile findScreenBounds(const iIntersectable& form, const ViewRays& view) {
+  const Tile screen = {0, 0, view.width, view.height};
+  
+  Vec4 center;
+  double radius;
+  double left, top, right, bottom;
+  if (!form.findBoundingBall(center, radius)
+      || !view.projectBall(center, radius, left, top, right, bottom))
+    return screen;
+  
+  // Clamped first, so that far off the screen doesn't overflow an int.
+  auto toPixel = [](double coordinate, int size) {
+    return int(std::clamp(coordinate, -2.0, size + 2.0));
+  };
+  Tile bounds;
+  bounds.x = toPixel(std::floor(left), view.width) - 1;
+  bounds.y = toPixel(std::floor(top), view.height) - 1;
+  bounds.width = toPixel(std::ceil(right), view.width) + 2 - bounds.x;
+  bounds.height = toPixel(std::ceil(bottom), view.height) + 2 - bounds.y;
+  return intersect(bounds, screen);
+}
+
+
+/** The part of the screen that has to be traced again when the forms
+ * `before` are replaced by the forms `after`, seen from `view`. Empty if
+ * nothing changed. */
+inline Tile findDirtyRegion(
+    const List<Shared<const iIntersectable>>& before,
+    const List<Shared<const iIntersectable>>& after,
+    const ViewRays& view
+) {
+  if (before.size() != after.size())
+    return {0, 0, view.width, view.height};
+  
+  Tile region;
+  for (uint i = 0; i < after.size(); i++) {
+    if (before[i] == after[i])
+      continue;
+    region = unite(region, findScreenBounds(*before[i], view));
+    region = unite(region, findScreenBounds(*after[i], view));
+  }
+  return region;
+}
+
+
+
+#ifdef ENABLE_DOCTEST
+#include <doctest/doctest.h>
+#include "geometry/Hypersphere.hpp"
+TEST_CASE("dirty regions") {
+  Matrix<4,4> viewrect = {
+      1, 0, 0, 0,
+      0, 1, 0, 0,
+      0, 0, 1, 0,
+      0, 0, 0, 0
+  };
+  const ViewRays view = {{0, 0, 0, 0}, viewrect, 100, 100};
+  
+  auto makeSphere = [](Vec4 center) {
+    auto sphere = std::make_shared<Hypersphere>();
+    sphere->center = center;
+    sphere->radius = 1;
+    return Shared<const iIntersectable>(sphere);
+  };
+  List<Shared<const iIntersectable>> before = {
+      makeSphere({0, 0, 10, 0}), makeSphere({3, 0, 10, 0})
+  };
+  
+  // Nothing changed, so nothing has to be traced.
+  CHECK(findDirtyRegion(before, before, view).isEmpty());
+  
+  // A sphere in the middle of the screen moves to the right. Both where it
+  // was and where it is now are traced, and the rest isn't.
+  List<Shared<const iIntersectable>> after = before;
+  after[0] = makeSphere({1, 0, 10, 0});
+  const Tile region = findDirtyRegion(before, after, view);
+  auto contains = [&](int x, int y) {
+    return !intersect(region, {x, y, 1, 1}).isEmpty();
+  };
+  CHECK(contains(41, 49));
+  CHECK(contains(49, 49));
+  CHECK(contains(67, 49));
+  CHECK(!contains(10, 49));
+  CHECK(!contains(49, 10));
+  CHECK(!contains(90, 49));
+  
+  // Behind the camera or around it, the whole screen is traced.
+  after[0] = makeSphere({0, 0, 0.5, 0});
+  CHECK(findDirtyRegion(before, after, view).width == 100);
+}
+#endif
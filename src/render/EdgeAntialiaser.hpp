@@ -0,0 +1,252 @@
+#pragma once
+
+#include <algorithm>
+
+#include "math.hpp"
+#include "util.hpp"
+
+
+/** The brightness of an RGBA color with 8 bits per channel (0 to 255). */
+constexpr int calcLuminance(u32 rgba) {
+  const int r = int(rgba & 0xff);
+  const int g = int((rgba >> 8) & 0xff);
+  const int b = int((rgba >> 16) & 0xff);
+  return (54 * r + 183 * g + 19 * b) >> 8;
+}
+
+
+// Antialiasing that only spends extra rays on the pixels that need them.
+//
+// After a frame is traced with one ray per pixel, the pixels on an edge get
+// more: the ones whose neighbours hit another primitive, or are a lot
+// brighter or darker (by more than `contrastThreshold`). The rest are left
+// alone, so on most screens only a small part of the pixels costs more.
+//
+// The extra rays are stratified: First every quarter of the pixel gets one,
+// then every sixteenth, and so on, until there are `maxSamples`. A level that
+// doesn't fit into the budget anymore gets as many rays as are left, spread
+// evenly over the pixel. In between the levels, a pixel whose rays all hit
+// the same primitive, with about the same brightness, is done early.
+//
+// Call `prepare`, then `findEdges` for all rows, and then `supersample` for
+// the pixels that `isEdge`. Different threads may work on different rows.
+class EdgeAntialiaser {
+public:
+  uint maxSamples = 16;  // From 4 to 64
+  int contrastThreshold = 24;
+  
+  
+  /** Makes room for the edges of a canvas with rows of `stride` pixels. */
+  void prepare(int stride, int height) {
+    this->stride = stride;
+    edges.resize(stride * height);
+  }
+  
+  
+  /** Finds the edges in the rows from `first` up to `end`, between the
+   * columns from `left` up to `right`, of an image that's `width` by
+   * `height` pixels. */
+  void findEdges(
+      const u32* pixels, const u32* primitives, int width, int height,
+      int left, int right, int first, int end
+  ) {
+    for (int y = first; y < end; y++) {
+      for (int x = left; x < right; x++) {
+        const int i = y * stride + x;
+        const int luminance = calcLuminance(pixels[i]);
+        
+        auto isDifferent = [&](int j) {
+          return primitives[j] != primitives[i]
+                 || std::abs(calcLuminance(pixels[j]) - luminance)
+                    > contrastThreshold;
+        };
+        edges[i] = (x > 0 && isDifferent(i - 1))
+                   || (x + 1 < width && isDifferent(i + 1))
+                   || (y > 0 && isDifferent(i - stride))
+                   || (y + 1 < height && isDifferent(i + stride));
+      }
+    }
+  }
+  
+  
+  bool isEdge(int x, int y) const {
+    return edges[y * stride + x] != 0;
+  }
+  
+  
+  /** The average color of the pixel (x, y), from stratified rays through
+   * it. `trace(dx, dy)` traces the ray through the given offset from the
+   * center of the pixel (from -0.5 to 0.5) and returns its PixelSample. */
+  template<class Trace>
+  Vec4 supersample(int x, int y, Trace trace) const {
+    constexpr int MAX_GRID = 8;
+    bool isTaken[MAX_GRID][MAX_GRID] = {};
+    int grid = 2;
+    while (grid * grid < int(maxSamples) && grid < MAX_GRID)
+      grid *= 2;
+    
+    Vec4 sum = {0, 0, 0, 0};
+    int count = 0;
+    uint firstPrimitive = 0;
+    bool isUniform = true;
+    double minLuminance = Limits<double>::infinity();
+    double maxLuminance = -minLuminance;
+    
+    // Every level gives every cell one ray, unless the cell has one from
+    // the level before. The cells of a level are the quarters of the cells
+    // of the level before, and they're taken one quarter of every bigger
+    // cell at a time, so that a level that runs out of rays still covers
+    // the whole pixel. The rays are at random spots of the finest cells.
+    constexpr int QUARTERS[4][2] = {{0, 0}, {1, 1}, {1, 0}, {0, 1}};
+    for (int level = 2; level <= grid; level *= 2) {
+      const int cellSize = grid / level;  // In the finest cells
+      const int parents = level / 2;  // Per row
+      
+      for (int round = 0; round < 4; round++) {
+        for (int parent = 0; parent < parents * parents; parent++) {
+          if (count == int(maxSamples))
+            break;
+          
+          // The first quarter of the bigger cell that doesn't have a ray.
+          int cellX = -1, cellY = -1;
+          for (const auto& quarter : QUARTERS) {
+            const int quarterX = parent % parents * 2 + quarter[0];
+            const int quarterY = parent / parents * 2 + quarter[1];
+            if (!isCellTaken(isTaken, quarterX * cellSize,
+                             quarterY * cellSize, cellSize)) {
+              cellX = quarterX;
+              cellY = quarterY;
+              break;
+            }
+          }
+          if (cellX < 0)
+            continue;
+          
+          u32 random = hash(x, y, level * MAX_GRID * MAX_GRID
+                                  + cellY * MAX_GRID + cellX);
+          const int i = cellX * cellSize + int(random % cellSize);
+          const int j = cellY * cellSize + int(random / 8 % cellSize);
+          isTaken[j][i] = true;
+          
+          const double dx = (i + (random >> 8 & 0xff) / 256.0) / grid - 0.5;
+          const double dy = (j + (random >> 16 & 0xff) / 256.0) / grid - 0.5;
+          const auto sample = trace(dx, dy);
+          
+          sum += sample.color;
+          if (count++ == 0)
+            firstPrimitive = sample.primitive;
+          isUniform = isUniform && sample.primitive == firstPrimitive;
+          const double luminance = 0.2126 * sample.color.x
+                                   + 0.7152 * sample.color.y
+                                   + 0.0722 * sample.color.z;
+          minLuminance = std::min(minLuminance, luminance);
+          maxLuminance = std::max(maxLuminance, luminance);
+        }
+      }
+      
+      const bool isSmooth =
+          (maxLuminance - minLuminance) * 255 <= contrastThreshold;
+      if (isUniform && isSmooth)
+        break;
+    }
+    
+    return sum / count;
+  }
+
+
+private:
+  int stride = 0;
+  List<u8> edges;  // 1 for the pixels that get more rays
+  
+  
+  template<int size>
+  static bool isCellTaken(
+      const bool (&isTaken)[size][size], int left, int top, int cellSize
+  ) {
+    for (int j = top; j < top + cellSize; j++)
+      for (int i = left; i < left + cellSize; i++)
+        if (isTaken[j][i])
+          return true;
+    return false;
+  }
+  
+  
+  // The same pixel always gets the same rays, so that tracing the same
+  // frame twice gives the same picture.
+  static u32 hash(int x, int y, int i) {
+    u32 h = u32(x) * 0x8da6b343u ^ u32(y) * 0xd8163841u ^ u32(i) * 0xcb1ab31fu;
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+    return h;
+  }
+};
+
+
+
+#ifdef ENABLE_DOCTEST
+#include <doctest/doctest.h>
+TEST_CASE("edge antialiasing") {
+  CHECK(calcLuminance(0xff000000) == 0);
+  CHECK(calcLuminance(0xffffffff) == 255);
+  
+  // A 4x3 image with primitive 1 on the left and 2 on the right, of the
+  // same color. Only the two columns where they meet are edges.
+  const int width = 4, height = 3;
+  const u32 pixels[width * height] = {};
+  const u32 primitives[width * height] = {1, 1, 2, 2, 1, 1, 2, 2, 1, 1, 2, 2};
+  EdgeAntialiaser antialiaser;
+  antialiaser.prepare(width, height);
+  antialiaser.findEdges(pixels, primitives, width, height, 0, width, 0,
+                        height);
+  CHECK(!antialiaser.isEdge(0, 1));
+  CHECK(antialiaser.isEdge(1, 1));
+  CHECK(antialiaser.isEdge(2, 1));
+  CHECK(!antialiaser.isEdge(3, 1));
+  
+  struct Sample {
+    Vec4 color;
+    uint primitive;
+  };
+  
+  // Half of the pixel is white and half is black, so it's grey, and it
+  // takes every ray there is. The rays are spread out over the pixel.
+  List<double> offsets;
+  Vec4 grey = antialiaser.supersample(1, 1, [&](double dx, double dy) {
+    CHECK(std::abs(dx) <= 0.5);
+    CHECK(std::abs(dy) <= 0.5);
+    offsets.push_back(dx);
+    return dx < 0 ? Sample{{0, 0, 0, 1}, 1} : Sample{{1, 1, 1, 1}, 2};
+  });
+  CHECK(offsets.size() == 16);
+  CHECK(std::abs(grey.x - 0.5) < 0.0001);
+  
+  // A pixel of one primitive is done after the first level.
+  int rays = 0;
+  antialiaser.supersample(2, 1, [&](double, double) {
+    rays++;
+    return Sample{{0.5, 0.5, 0.5, 1}, 2};
+  });
+  CHECK(rays == 4);
+  
+  // With a budget that isn't a power of four, the last level only gets the
+  // rays that are left, one for every cell of the level before. With 64,
+  // every one of the 8x8 cells gets one.
+  for (uint maxSamples : {32u, 64u}) {
+    antialiaser.maxSamples = maxSamples;
+    const int cells = maxSamples == 32 ? 4 : 8;
+    List<int> raysPerCell(cells * cells);
+    Vec4 color = antialiaser.supersample(1, 1, [&](double dx, double dy) {
+      const int cellX = std::min(int((dx + 0.5) * cells), cells - 1);
+      const int cellY = std::min(int((dy + 0.5) * cells), cells - 1);
+      raysPerCell[cellY * cells + cellX]++;
+      return dx < 0 ? Sample{{0, 0, 0, 1}, 1} : Sample{{1, 1, 1, 1}, 2};
+    });
+    
+    const int raysPerCellExpected = int(maxSamples) / (cells * cells);
+    for (int count : raysPerCell)
+      CHECK(count == raysPerCellExpected);
+    CHECK(std::abs(color.x - 0.5) < 0.0001);
+  }
+}
+#endif
@@ -0,0 +1,342 @@
+#pragma once
+
+#include <SDL2/SDL.h>
+
+#ifdef ENABLE_THREADS
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
+#include "io/MouseLatch.hpp"
+#include "render/ViewRays.hpp"
+#include "util.hpp"
+
+
+// A canvas, plus what's needed to put it on the screen later.
+struct CanvasBuffer {
+  SDL_Surface* surface = nullptr;
+  Unique<u32[]> pixels;
+  
+  // The distance to the nearest hit of every pixel and the primitive it hit,
+  // in the same layout as the pixels (one row is surface->w long).
+  Unique<float[]> distances;
+  Unique<u32[]> primitives;
+  
+  // The part of the canvas that was traced (starting at the top left).
+  int viewWidth = 0;
+  int viewHeight = 0;
+  
+  // What the frame was traced with.
+  ViewRays view;
+  uint renderFlags = 0;
+  uint sceneVersion = 0;
+  
+  // The pass of progressive refinement that the frame is (an index into
+  // MainScreen::REFINEMENT_PASSES), or -1 if it was traced normally.
+  int refinement = -1;
+  
+  // Whether tracing the same frame again would give the same picture, and
+  // whether only the part that changed was traced (see DirtyRegion).
+  bool isFinal = false;
+  bool isPatched = false;
+  
+  // How long it took to trace the frame, and roughly how much longer it
+  // would have taken without the tiles that were traced sparsely.
+  double traceSeconds = 0;
+  double missedSeconds = 0;
+  
+  // The mouse movement that this frame is the first to show.
+  MouseLatch::Delta mouse;
+};
+
+
+// Double buffering for the canvas. While the render threads trace the next
+// frame into one canvas, the main thread can put the previous canvas on the
+// screen, draw the user interface over it and present it. Without this, the
+// render threads would be idle while the main thread does all that.
+//
+// With a queue depth of 1 the frame on the screen is always one frame behind
+// the frame that's being traced, which is better for the framerate. With a
+// queue depth of 0 every frame is traced and then shown right away, which is
+// better for the latency.
+//
+// Usage, once per frame:
+//   pipeline.finishTracing();    // Waits for the previous frame, swaps
+//   pipeline.startTracing(...);  // Traces into getTracingBuffer()
+//   ...                          // Show getPresentingBuffer()
+// With a queue depth of 0, the frame that's shown is the one that was just
+// traced, so call finishTracing again before showing it.
+//
+// The tracing keeps going after the frame has been shown, while the main
+// thread is busy with the next update. So the trace must not read anything
+// that update changes: It gets its own copy of the camera and a snapshot of
+// the scene (see DynamicScene).
+class FramePipeline {
+public:
+  uint queueDepth = 1;  // 0 or 1
+  
+  
+  ~FramePipeline() {
+#ifdef ENABLE_THREADS
+    if (tracer.joinable()) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        isStopping = true;
+      }
+      hasChanged.notify_all();
+      tracer.join();
+    }
+#endif
+    for (CanvasBuffer& buffer : buffers)
+      SDL_FreeSurface(buffer.surface);
+  }
+  
+  
+  void init(int width, int height) {
+    // The pixels aren't touched here. The first thread that writes to a page
+    // of memory decides on which NUMA node the page ends up, so the pages
+    // are spread over the worker threads (see MainScreen::firstTouchCanvas).
+    for (CanvasBuffer& buffer : buffers) {
+      buffer.pixels.reset(new u32[width * height]);
+      buffer.distances.reset(new float[width * height]);
+      buffer.primitives.reset(new u32[width * height]);
+      buffer.surface = SDL_CreateRGBSurfaceWithFormatFrom(
+          buffer.pixels.get(), width, height, 32, width * 4,
+          SDL_PIXELFORMAT_RGBA32
+      );
+      
+      if (buffer.surface == nullptr)
+        THROW("Failed to create a canvas: " + String(SDL_GetError()));
+    }
+
+#ifdef ENABLE_THREADS
+    tracer = std::thread([this]() { runTracer(); });
+#endif
+  }
+  
+  
+  CanvasBuffer& getTracingBuffer() {
+    return buffers[tracingIndex];
+  }
+  
+  
+  CanvasBuffer& getPresentingBuffer() {
+    return buffers[1 - tracingIndex];
+  }
+  
+  
+  CanvasBuffer* getBuffers() {
+    return buffers;
+  }
+  
+  
+  bool isBusy() const {
+    return isTracing;
+  }
+  
+  
+  /** Whether the presented frame lags one frame behind the traced frame.
+   * Without threads there's nothing to overlap, so it never does. */
+  bool isPipelined() const {
+#ifdef ENABLE_THREADS
+    return queueDepth > 0;
+#else
+    return false;
+#endif
+  }
+  
+  
+  /** Starts tracing on a separate thread. `trace` should draw into
+   * getTracingBuffer(). */
+  void startTracing(Function<void()> trace) {
+    isTracing = true;
+#ifdef ENABLE_THREADS
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      job = std::move(trace);
+      hasJob = true;
+    }
+    hasChanged.notify_all();
+#else
+    trace();
+#endif
+  }
+  
+  
+  /** Waits until tracing is done and swaps the buffers, so that the frame
+   * that was just traced is the one that's presented. Returns false (and
+   * does nothing) if nothing was being traced. */
+  bool finishTracing() {
+    if (!isTracing)
+      return false;
+    waitForTracing();
+    tracingIndex = 1 - tracingIndex;
+    isTracing = false;
+    return true;
+  }
+  
+  
+  /** Waits until tracing is done, without swapping the buffers. */
+  void waitForTracing() {
+#ifdef ENABLE_THREADS
+    std::unique_lock<std::mutex> lock(mutex);
+    hasChanged.wait(lock, [this]() { return !hasJob; });
+#endif
+  }
+  
+  
+  /** Like waitForTracing, but gives up after a while. Returns whether the
+   * tracing is done. */
+  bool waitForTracing(double maxSeconds) {
+#ifdef ENABLE_THREADS
+    std::unique_lock<std::mutex> lock(mutex);
+    return hasChanged.wait_for(
+        lock, std::chrono::duration<double>(maxSeconds),
+        [this]() { return !hasJob; }
+    );
+#else
+    (void) maxSeconds;
+    return true;
+#endif
+  }
+
+
+private:
+  CanvasBuffer buffers[2];
+  uint tracingIndex = 0;
+  bool isTracing = false;  // Started, but not finished yet
+
+#ifdef ENABLE_THREADS
+  // The tracer isn't one of the render threads: It gives the work to the
+  // render threads and helps them out (see ThreadPool::ParallelFor).
+  std::thread tracer;
+  std::mutex mutex;
+  std::condition_variable hasChanged;
+  Function<void()> job;
+  bool hasJob = false;
+  bool isStopping = false;
+  
+  
+  void runTracer() {
+    std::unique_lock<std::mutex> lock(mutex);
+    
+    while (true) {
+      hasChanged.wait(lock, [this]() { return hasJob || isStopping; });
+      if (isStopping)
+        return;
+      
+      lock.unlock();
+      job();
+      lock.lock();
+      
+      job = nullptr;
+      hasJob = false;
+      hasChanged.notify_all();
+    }
+  }
+#endif
+};
+
+
+
+#ifdef ENABLE_DOCTEST
+#include <doctest/doctest.h>
+#include <atomic>
+#include "realMain.hpp"
+
+// Every frame writes its number into the middle of the canvas it traces.
+inline void traceTestFrame(FramePipeline& pipeline, u32 frame) {
+  CanvasBuffer& buffer = pipeline.getTracingBuffer();
+  pipeline.startTracing([&buffer, frame]() {
+    setPixel(buffer.surface, 1, 1, frame);
+  });
+}
+
+
+inline u32 getPresentedTestFrame(FramePipeline& pipeline) {
+  CanvasBuffer& buffer = pipeline.getPresentingBuffer();
+  return buffer.pixels[1 * buffer.surface->w + 1];
+}
+
+
+TEST_CASE("frame pipeline handover") {
+  FramePipeline pipeline;
+  pipeline.init(4, 3);
+#ifdef ENABLE_THREADS
+  CHECK(pipeline.isPipelined());
+#endif
+  CHECK(!pipeline.finishTracing());  // Nothing was traced yet
+  
+  traceTestFrame(pipeline, 1);
+  CHECK(pipeline.isBusy());
+  CHECK(pipeline.finishTracing());
+  CHECK(!pipeline.isBusy());
+  CHECK(getPresentedTestFrame(pipeline) == 1);
+  
+  // Frame 1 stays on the screen while frame 2 is traced into the other
+  // canvas, and then they swap.
+  traceTestFrame(pipeline, 2);
+  CHECK(getPresentedTestFrame(pipeline) == 1);
+  CHECK(pipeline.finishTracing());
+  CHECK(getPresentedTestFrame(pipeline) == 2);
+  CHECK(pipeline.getTracingBuffer().pixels[1 * 4 + 1] == 1);
+  CHECK(!pipeline.finishTracing());
+}
+
+
+TEST_CASE("frame pipeline without a queue") {
+  // Every frame is shown right after it was traced.
+  FramePipeline pipeline;
+  pipeline.queueDepth = 0;
+  pipeline.init(4, 3);
+  CHECK(!pipeline.isPipelined());
+  
+  for (u32 frame = 1; frame <= 3; frame++) {
+    pipeline.finishTracing();
+    traceTestFrame(pipeline, frame);
+    CHECK(pipeline.finishTracing());
+    CHECK(getPresentedTestFrame(pipeline) == frame);
+  }
+}
+
+
+#ifdef ENABLE_THREADS
+TEST_CASE("frame pipeline shutdown") {
+  // A pipeline that's destroyed in the middle of a frame waits for the
+  // frame, so that the trace never writes into freed canvases.
+  std::atomic<bool> isStarted = false;
+  std::atomic<bool> isReleased = false;
+  std::atomic<bool> isDone = false;
+  std::thread releaser;
+  {
+    FramePipeline pipeline;
+    pipeline.init(4, 3);
+    pipeline.startTracing([&]() {
+      isStarted = true;
+      while (!isReleased)
+        std::this_thread::yield();
+      isDone = true;
+    });
+    while (!isStarted)
+      std::this_thread::yield();
+    
+    CHECK(!pipeline.waitForTracing(0.01));
+    releaser = std::thread([&]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      isReleased = true;
+    });
+  }
+  CHECK(isDone);
+  releaser.join();
+  
+  // Waiting with a time limit works when the frame gets done in time.
+  FramePipeline pipeline;
+  pipeline.init(4, 3);
+  traceTestFrame(pipeline, 1);
+  CHECK(pipeline.waitForTracing(10.0));
+  CHECK(pipeline.finishTracing());
+  CHECK(getPresentedTestFrame(pipeline) == 1);
+}
+#endif
+#endif
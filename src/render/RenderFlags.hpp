@@ -0,0 +1,75 @@
+#pragma once
+
+#include <type_traits>
+
+#include "util/typedefs.hpp"
+
+
+// Render options that change what happens for every pixel. Instead of
+// checking them for every pixel, the pixel loop takes them as a template
+// parameter, so every combination gets its own loop without any branches.
+enum RenderFlags : uint {
+  RENDER_DEFAULT = 0,
+  RENDER_HEATMAP = 1 << 0,  // Show how much work each pixel takes.
+  RENDER_ANTIALIASING = 1 << 1,  // Four rays per pixel instead of one.
+  RENDER_TEMPORAL_AA = 1 << 2,  // Average the pixels over the frames.
+  RENDER_EDGE_AA = 1 << 3,  // More rays only on edges (see EdgeAntialiaser).
+};
+
+
+template<uint... flags>
+struct RenderFlagList {};
+
+// The combinations of flags that get their own pixel loop. Other combinations
+// fall back to the default loop, so add them here when you need them.
+using UsedRenderFlags = RenderFlagList<
+    RENDER_DEFAULT,
+    RENDER_HEATMAP,
+    RENDER_ANTIALIASING,
+    RENDER_HEATMAP | RENDER_ANTIALIASING,
+    RENDER_TEMPORAL_AA,
+    RENDER_HEATMAP | RENDER_TEMPORAL_AA,
+    RENDER_EDGE_AA,
+    RENDER_HEATMAP | RENDER_EDGE_AA
+>;
+
+
+/** Calls `function` with the active flags as a compile-time constant, i.e.
+ * `function(std::integral_constant<uint, flags>{})`. */
+template<class Function, uint... flags>
+void dispatchRenderFlags(
+    uint activeFlags, RenderFlagList<flags...>, Function function
+) {
+  bool isDispatched =
+      ((activeFlags == flags
+        && (function(std::integral_constant<uint, flags>{}), true)) || ...);
+  
+  if (!isDispatched)
+    function(std::integral_constant<uint, RENDER_DEFAULT>{});
+}
+
+
+template<class Function>
+void dispatchRenderFlags(uint activeFlags, Function function) {
+  dispatchRenderFlags(activeFlags, UsedRenderFlags{}, function);
+}
+
+
+
+#ifdef ENABLE_DOCTEST
+#include <doctest/doctest.h>
+TEST_CASE("dispatchRenderFlags") {
+  uint dispatched = maxOf<uint>;
+  auto remember = [&](auto flags) { dispatched = decltype(flags)::value; };
+  
+  dispatchRenderFlags(RENDER_HEATMAP, remember);
+  CHECK(dispatched == RENDER_HEATMAP);
+  
+  dispatchRenderFlags(RENDER_HEATMAP | RENDER_ANTIALIASING, remember);
+  CHECK(dispatched == (RENDER_HEATMAP | RENDER_ANTIALIASING));
+  
+  // Unknown combinations use the default loop.
+  dispatchRenderFlags(1 << 20, remember);
+  CHECK(dispatched == RENDER_DEFAULT);
+}
+#endif
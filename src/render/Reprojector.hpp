@@ -0,0 +1,190 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstring>
+
+#include "FramePipeline.hpp"
+#include "ViewRays.hpp"
+#include "util.hpp"
+
+
+// Reuses the hits of the previous frame, so that only the pixels that show
+// something new have to be traced.
+//
+// The hit of every pixel of the previous frame is moved to where it's seen
+// from the new camera (like in Timewarp). A pixel of the new frame reuses the
+// hit that lands on it, and only needs to be shaded again, as long as:
+//  - Some hit landed on it at all. Pixels that nothing lands on were hidden
+//    before (or are sky).
+//  - The hits that landed on the four neighbouring pixels are of the same
+//    primitive. Otherwise the pixel is on an edge, where something may have
+//    come out from behind something else.
+//  - It isn't the pixel's turn to be traced anyway. Every pixel is traced at
+//    least once every `refreshInterval` frames, so that the small errors of
+//    rounding to whole pixels don't add up.
+//
+// Several threads can move the hits at the same time (splatRows), and then
+// look them up (findHit). Call `prepare` first.
+class Reprojector {
+public:
+  uint refreshInterval = 8;
+  
+  // A hit of the previous frame, as seen from the new camera.
+  struct Hit {
+    float distance;
+    uint primitive;
+  };
+  
+  
+  /** Makes room for a frame with rows of `stride` pixels, and forgets the
+   * hits of the last frame. */
+  void prepare(int stride, int height) {
+    if (stride * height != slotCount) {
+      slotCount = stride * height;
+      slots.reset(new std::atomic<u64>[slotCount]);
+    }
+    this->stride = stride;
+    frame++;
+  }
+  
+  
+  /** Clears the rows from `first` up to `end` of the new frame. */
+  void clearRows(int first, int end) {
+    for (int i = first * stride; i < end * stride; i++)
+      slots[i].store(EMPTY, std::memory_order_relaxed);
+  }
+  
+  
+  /** Moves the hits of the rows from `first` up to `end` of the previous
+   * frame to where `to` sees them. */
+  void splatRows(const CanvasBuffer& from, const ViewRays& to,
+                 int first, int end) {
+    const ViewRays& view = from.view;
+    
+    for (int y = first; y < end; y++) {
+      for (int x = 0; x < from.viewWidth; x++) {
+        int i, j;
+        float newDistance;
+        if (!moveHit(view, to, x, y, from.distances[y * stride + x], i, j,
+                     newDistance))
+          continue;
+        
+        // The nearest hit wins. Positive floats sort the same way as their
+        // bits, so the distance goes in front of the index of the source.
+        u32 distanceBits;
+        std::memcpy(&distanceBits, &newDistance, sizeof(distanceBits));
+        const u64 packed = (u64(distanceBits) << 32) | u32(y * stride + x);
+        
+        std::atomic<u64>& slot = slots[j * stride + i];
+        u64 current = slot.load(std::memory_order_relaxed);
+        while (packed < current
+               && !slot.compare_exchange_weak(current, packed,
+                                              std::memory_order_relaxed)) {}
+      }
+    }
+  }
+  
+  
+  /** The hit that the pixel (x, y) of the new frame can reuse. Returns
+   * false if the pixel should be traced. */
+  bool findHit(const CanvasBuffer& from, int x, int y, Hit& hit) const {
+    if ((x + 3 * y + frame) % refreshInterval == 0)
+      return false;
+    
+    if (!findLanding(from, x, y, hit))
+      return false;
+    
+    const uint primitive = hit.primitive;
+    const int width = from.viewWidth;
+    const int height = from.viewHeight;
+    
+    static constexpr int neighbours[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+    for (const auto& offset : neighbours) {
+      const int i = x + offset[0];
+      const int j = y + offset[1];
+      if (i < 0 || j < 0 || i >= width || j >= height)
+        continue;
+      
+      const u64 neighbour =
+          slots[j * stride + i].load(std::memory_order_relaxed);
+      if (neighbour == EMPTY || from.primitives[u32(neighbour)] != primitive)
+        return false;
+    }
+    
+    return true;
+  }
+  
+  
+  /** The nearest hit that landed on the pixel (x, y) of the new frame, if
+   * any, without checking whether it can be reused. */
+  bool findLanding(const CanvasBuffer& from, int x, int y, Hit& hit) const {
+    const u64 packed = slots[y * stride + x].load(std::memory_order_relaxed);
+    if (packed == EMPTY)
+      return false;
+    
+    const u32 distanceBits = u32(packed >> 32);
+    std::memcpy(&hit.distance, &distanceBits, sizeof(hit.distance));
+    hit.primitive = from.primitives[u32(packed)];
+    return true;
+  }
+
+
+private:
+  static constexpr u64 EMPTY = maxOf<u64>;
+  
+  Unique<std::atomic<u64>[]> slots;  // The nearest hit that lands on a pixel
+  int slotCount = 0;
+  int stride = 0;
+  uint frame = 0;
+};
+
+
+
+#ifdef ENABLE_DOCTEST
+#include <doctest/doctest.h>
+TEST_CASE("reprojection") {
+  // A frame of 8x8 pixels that all hit primitive 1 at a distance of 5,
+  // except for one pixel that hits primitive 2.
+  Matrix<4,4> viewrect = {
+      1, 0, 0, 0,
+      0, 1, 0, 0,
+      0, 0, 1, 0,
+      0, 0, 0, 0
+  };
+  const int size = 8;
+  CanvasBuffer from;
+  from.view = {{0, 0, 0, 0}, viewrect, size, size};
+  from.viewWidth = size;
+  from.viewHeight = size;
+  from.distances.reset(new float[size * size]);
+  from.primitives.reset(new u32[size * size]);
+  std::fill_n(from.distances.get(), size * size, 5.0f);
+  std::fill_n(from.primitives.get(), size * size, 1);
+  from.primitives[5 * size + 5] = 2;
+  
+  // Seen from the same camera, everything lands where it was.
+  Reprojector reprojector;
+  reprojector.prepare(size, size);
+  reprojector.clearRows(0, size);
+  reprojector.splatRows(from, from.view, 0, size);
+  
+  uint reused = 0;
+  for (int y = 0; y < size; y++) {
+    for (int x = 0; x < size; x++) {
+      Reprojector::Hit hit;
+      if (!reprojector.findHit(from, x, y, hit))
+        continue;
+      reused++;
+      CHECK(hit.primitive == 1);
+      CHECK(std::abs(hit.distance - 5) < 0.0001);
+      
+      // The odd pixel and its neighbours are traced.
+      CHECK(std::abs(x - 5) + std::abs(y - 5) > 1);
+    }
+  }
+  
+  // Only the refreshed pixels (one in eight) and the odd ones are traced.
+  CHECK(reused > size * size * 3 / 4);
+}
+#endif
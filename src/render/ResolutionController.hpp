@@ -0,0 +1,125 @@
+#pragma once
+
+#include <algorithm>
+
+#include "util.hpp"
+
+
+// Picks the resolution to trace at, as a fraction of the window size, so
+// that tracing a frame takes about as long as the target.
+//
+// It's a PID controller: The error is how far (relatively) the last frame was
+// off from the target time. The scale is the base scale (where it started)
+// plus three parts: The proportional part reacts to the error right away, the
+// integral part moves the scale to where the error goes away and keeps it
+// there, and the derivative part damps the overshoot.
+class ResolutionController {
+public:
+  double targetSeconds = 1 / 45.0;
+  double minScale = 0.25;
+  double maxScale = 1;
+  
+  double kp = 0.05;
+  double ki = 0.1;
+  double kd = 0.02;
+  
+  
+  /** Feeds the time it took to trace the last frame. Returns the new scale. */
+  double update(double frameSeconds) {
+    // A frame that takes twice as long counts as much as a frame that takes
+    // half as long.
+    double error = (targetSeconds - frameSeconds)
+                   / std::max(targetSeconds, frameSeconds);
+    
+    // The integral part alone can reach every scale, but not more, so the
+    // integral doesn't keep growing while the scale is stuck at the minimum
+    // or maximum.
+    integral = std::clamp(integral + error, (minScale - baseScale) / ki,
+                          (maxScale - baseScale) / ki);
+    double derivative = error - previousError;
+    previousError = error;
+    
+    scale = baseScale + kp * error + ki * integral + kd * derivative;
+    scale = std::clamp(scale, minScale, maxScale);
+    return scale;
+  }
+  
+  
+  double getScale() const {
+    return scale;
+  }
+
+
+  /** Starts over at the given scale, e.g. when it's known roughly. */
+  void reset(double newScale) {
+    scale = std::clamp(newScale, minScale, maxScale);
+    baseScale = scale;
+    integral = 0;
+    previousError = 0;
+  }
+
+
+private:
+  double scale = 1;
+  double baseScale = 1;
+  double integral = 0;
+  double previousError = 0;
+};
+
+
+
+#ifdef ENABLE_DOCTEST
+#include <doctest/doctest.h>
+TEST_CASE("resolution controller") {
+  ResolutionController controller;
+  controller.targetSeconds = 0.02;
+  
+  // A fake renderer that takes 60 ms at the full resolution. The time grows
+  // with the amount of pixels, so the right scale is sqrt(1/3).
+  double seconds = 0;
+  for (int frame = 0; frame < 200; frame++) {
+    double scale = controller.getScale();
+    seconds = 0.06 * scale * scale;
+    controller.update(seconds);
+  }
+  
+  CHECK(std::abs(seconds - 0.02) < 0.001);
+  
+  // A fast renderer ends up at the full resolution.
+  for (int frame = 0; frame < 200; frame++)
+    controller.update(0.005);
+  CHECK(controller.getScale() == 1);
+}
+
+
+TEST_CASE("resolution controller with noise") {
+  ResolutionController controller;
+  controller.targetSeconds = 0.02;
+  
+  // The same renderer, but every frame takes up to 20% more or less time.
+  // The scale settles around sqrt(1/3) and stays close to it, instead of
+  // swinging back and forth.
+  u32 random = 1;
+  double sum = 0, least = 1, most = 0;
+  for (int frame = 0; frame < 400; frame++) {
+    random = random * 1664525u + 1013904223u;
+    double noise = 0.4 * (random >> 8) / double(1 << 24) - 0.2;
+    double scale = controller.getScale();
+    controller.update(0.06 * scale * scale * (1 + noise));
+    
+    if (frame >= 200) {
+      sum += scale;
+      least = std::min(least, scale);
+      most = std::max(most, scale);
+    }
+  }
+  CHECK(std::abs(sum / 200 - std::sqrt(1 / 3.0)) < 0.01);
+  CHECK(most - least < 0.1);
+  
+  // After a reset, it starts over from the new scale.
+  controller.reset(0.5);
+  CHECK(controller.getScale() == 0.5);
+  controller.update(0.06 * 0.25);
+  CHECK(std::abs(controller.getScale() - 0.5) < 0.05);
+}
+#endif
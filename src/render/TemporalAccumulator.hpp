@@ -0,0 +1,131 @@
+#pragma once
+
+#include <algorithm>
+
+#include "math.hpp"
+#include "util.hpp"
+
+
+/** The radical inverse of `i` in `base`: The digits of i mirrored around the
+ * decimal point, e.g. 6 = 110 in base 2 gives 0.011 = 0.375. Going through
+ * i = 1, 2, 3... fills the range from 0 to 1 evenly (a Halton sequence). */
+constexpr double radicalInverse(uint i, uint base) {
+  double result = 0;
+  double digitValue = 1.0 / base;
+  while (i > 0) {
+    result += (i % base) * digitValue;
+    i /= base;
+    digitValue /= base;
+  }
+  return result;
+}
+
+
+// Antialiasing by averaging frames, while nothing on the screen changes.
+//
+// Every frame traces one ray per pixel, through a different spot of the
+// pixel each time (the jitter), and adds it to the average of that pixel.
+// The more frames stand still, the smoother the edges get, while every frame
+// costs about as much as a frame without antialiasing. When anything changes,
+// the averages are reset.
+//
+// Every pixel has its own count, because not every frame traces every pixel
+// (see RefinementPass). After `maxSamples` samples, the older samples slowly
+// fade out.
+class TemporalAccumulator {
+public:
+  uint maxSamples = 64;  // At most 255
+  
+  
+  /** Forgets the averages, for a canvas of which `height` rows of `stride`
+   * pixels are used. The next frame isn't jittered. */
+  void reset(int stride, int height) {
+    this->stride = stride;
+    counts.resize(stride * height);
+    colors.resize(stride * height * 4);
+    std::fill(counts.begin(), counts.end(), 0);
+    frame = 0;
+  }
+  
+  
+  /** Starts another frame that's added to the same averages. */
+  void nextFrame() {
+    frame++;
+  }
+  
+  
+  /** Whether more frames make any difference. */
+  bool isConverged() const {
+    return frame + 1 >= maxSamples;
+  }
+  
+  
+  /** Where in the pixel to trace the ray of this frame, as an offset from
+   * the center of the pixel (from -0.5 to 0.5). */
+  Vec2 getJitter() const {
+    if (frame == 0)
+      return {0, 0};
+    return {radicalInverse(frame, 2) - 0.5, radicalInverse(frame, 3) - 0.5};
+  }
+  
+  
+  /** Adds a sample to the pixel (x, y). Returns the new average. Different
+   * threads may add to different pixels at the same time. */
+  Vec4 add(int x, int y, const Vec4& color) {
+    const int i = y * stride + x;
+    const uint count = std::min(uint(counts[i]) + 1, maxSamples);
+    counts[i] = u8(count);
+    
+    float* average = &colors[i * 4];
+    const float weight = 1.0f / count;
+    for (int c = 0; c < 4; c++)
+      average[c] += (float(color[c]) - average[c]) * weight;
+    return {average[0], average[1], average[2], average[3]};
+  }
+
+
+  /** The average of the pixel (x, y), as RGBA. The averages of a row are
+   * next to each other, so they can be quantized together (see
+   * PixelRowWriter). */
+  const float* getAverage(int x, int y) const {
+    return &colors[(y * stride + x) * 4];
+  }
+
+
+private:
+  int stride = 0;
+  uint frame = 0;
+  List<u8> counts;  // Samples per pixel
+  List<float> colors;  // The averages, as RGBA
+};
+
+
+
+#ifdef ENABLE_DOCTEST
+#include <doctest/doctest.h>
+TEST_CASE("temporal accumulation") {
+  CHECK(radicalInverse(6, 2) == 0.375);
+  CHECK(std::abs(radicalInverse(1, 3) - 1/3.0) < 0.000001);
+  
+  TemporalAccumulator accumulator;
+  accumulator.reset(4, 2);
+  CHECK(accumulator.getJitter().x == 0);
+  
+  // The samples of a pixel are averaged.
+  accumulator.add(1, 1, {1, 0, 0, 1});
+  accumulator.nextFrame();
+  Vec4 average = accumulator.add(1, 1, {0, 0, 1, 1});
+  CHECK(average == Vec4(0.5, 0, 0.5, 1));
+  CHECK(accumulator.getAverage(1, 1)[2] == 0.5f);
+  CHECK(accumulator.getAverage(2, 1) == accumulator.getAverage(1, 1) + 4);
+  
+  Vec2 jitter = accumulator.getJitter();
+  CHECK(std::abs(jitter.x) <= 0.5);
+  CHECK(std::abs(jitter.y) <= 0.5);
+  CHECK((jitter.x != 0 || jitter.y != 0));
+  
+  // After a reset, the old samples are gone.
+  accumulator.reset(4, 2);
+  CHECK(accumulator.add(1, 1, {0, 1, 0, 1}) == Vec4(0, 1, 0, 1));
+}
+#endif
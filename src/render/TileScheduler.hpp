@@ -0,0 +1,742 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <type_traits>
+
+#include "util.hpp"
+
+
+// A rectangle of pixels that's rendered as one piece of work.
+struct Tile {
+  int x = 0;
+  int y = 0;
+  int width = 0;
+  int height = 0;
+  
+  bool isEmpty() const {
+    return width <= 0 || height <= 0;
+  }
+};
+
+
+/** The pixels that are in both tiles. */
+inline Tile intersect(const Tile& a, const Tile& b) {
+  Tile result;
+  result.x = std::max(a.x, b.x);
+  result.y = std::max(a.y, b.y);
+  result.width = std::min(a.x + a.width, b.x + b.width) - result.x;
+  result.height = std::min(a.y + a.height, b.y + b.height) - result.y;
+  return result.isEmpty() ? Tile() : result;
+}
+
+
+/** The smallest tile that covers both tiles. */
+inline Tile unite(const Tile& a, const Tile& b) {
+  if (a.isEmpty())
+    return b;
+  if (b.isEmpty())
+    return a;
+  
+  Tile result;
+  result.x = std::min(a.x, b.x);
+  result.y = std::min(a.y, b.y);
+  result.width = std::max(a.x + a.width, b.x + b.width) - result.x;
+  result.height = std::max(a.y + a.height, b.y + b.height) - result.y;
+  return result;
+}
+
+
+/** Calls f(i) for the rows (or columns) of a tile that are traced when only
+ * every `step`th one is: The first one, every step after that, and the last
+ * one (so the rest lies between two traced ones). `i` counts from `start`. */
+template<class Function>
+void forEachSparseLine(int start, int size, int step, Function f) {
+  for (int i = 0; i < size; i += step) {
+    f(start + i);
+    if (i + step >= size && i != size - 1)
+      f(start + size - 1);
+  }
+}
+
+
+/** The amount of lines forEachSparseLine goes over. */
+constexpr int countSparseLines(int size, int step) {
+  return size <= 0 ? 0 : (size + step - 2) / step + 1;
+}
+
+
+// A pixel of a tile that forEachSparseLine skips (in either direction), and
+// the traced rows and columns around it.
+struct GridGap {
+  int x, y;
+  int left, right;
+  int top, bottom;
+  double across;  // From the left (0) to the right (1)
+  double down;  // From the top (0) to the bottom (1)
+};
+
+
+/** Calls f(gap) for every pixel of the tile that isn't on a traced row and
+ * column of the sparse lines with `step`. */
+template<class Function>
+void forEachGridGap(const Tile& tile, int step, Function f) {
+  // Finds the lines around i and says whether i is a line itself.
+  auto findLines = [step](int i, int size, int& before, int& after,
+                          double& fraction) {
+    before = i / step * step;
+    after = std::min(before + step, size - 1);
+    fraction = after == before ? 0 : (i - before) / double(after - before);
+    return i == before || i == size - 1;
+  };
+  
+  GridGap gap;
+  for (int y = 0; y < tile.height; y++) {
+    const bool isRowTraced =
+        findLines(y, tile.height, gap.top, gap.bottom, gap.down);
+    gap.y = tile.y + y;
+    gap.top += tile.y;
+    gap.bottom += tile.y;
+    
+    for (int x = 0; x < tile.width; x++) {
+      const bool isColumnTraced =
+          findLines(x, tile.width, gap.left, gap.right, gap.across);
+      if (isRowTraced && isColumnTraced)
+        continue;
+      
+      gap.x = tile.x + x;
+      gap.left += tile.x;
+      gap.right += tile.x;
+      f(gap);
+    }
+  }
+}
+
+
+// One pass of progressive refinement: The pixels of a tile that are on the
+// lines of `step` (see forEachSparseLine), but that an earlier pass with
+// `previousStep` didn't trace yet. A previous step of 0 means there was no
+// earlier pass, and a step of 1 finishes the tile.
+//
+// A pass with a parity of 0 or 1 only traces the pixels where x + y is even
+// or odd respectively, like the squares of one color on a checkerboard.
+struct RefinementPass {
+  int step = 1;
+  int previousStep = 0;
+  int parity = -1;
+  
+  /** Whether the pass traces every pixel. */
+  constexpr bool isComplete() const {
+    return step == 1 && previousStep == 0 && parity < 0;
+  }
+};
+
+
+/** Calls f(x, y) for the pixels of the tile that the pass traces. */
+template<class Function>
+void forEachRefinedPixel(const Tile& tile, RefinementPass pass, Function f) {
+  auto isTraced = [&](int i, int size) {
+    return pass.previousStep > 0
+           && (i % pass.previousStep == 0 || i == size - 1);
+  };
+  
+  forEachSparseLine(0, tile.height, pass.step, [&](int y) {
+    const bool isRowTraced = isTraced(y, tile.height);
+    forEachSparseLine(0, tile.width, pass.step, [&](int x) {
+      const bool isOtherColor = pass.parity >= 0
+          && ((tile.x + x + tile.y + y) & 1) != pass.parity;
+      if ((!isRowTraced || !isTraced(x, tile.width)) && !isOtherColor)
+        f(tile.x + x, tile.y + y);
+    });
+  });
+}
+
+
+/** Interleaves the bits of x and y (x in the even bits), which gives the
+ * position of (x, y) along a Z-order curve. Both must be less than 2^16. */
+constexpr uint mortonCode(uint x, uint y) {
+  auto spread = [](uint a) {
+    a = (a | (a << 8)) & 0x00FF00FF;
+    a = (a | (a << 4)) & 0x0F0F0F0F;
+    a = (a | (a << 2)) & 0x33333333;
+    a = (a | (a << 1)) & 0x55555555;
+    return a;
+  };
+  return spread(x) | (spread(y) << 1);
+}
+
+
+// Foveated rendering: The further a tile is from where the viewer looks (the
+// focus), the more sparsely it's traced. Tiles within `radius` of the focus
+// are traced fully, and beyond that the step doubles every 1 / `falloff`
+// screen heights, up to `maxStep`. The renderer fills in the rest of the
+// tile, like with the deadline.
+struct Foveation {
+  double falloff = 0;  // 0 turns it off
+  double radius = 0.15;  // In screen heights
+  int maxStep = 8;
+  double focusX = 0;  // In pixels
+  double focusY = 0;
+  
+  
+  /** How sparsely to trace the tile, on a screen that's `screenHeight`
+   * pixels high. */
+  int calcStep(const Tile& tile, int screenHeight) const {
+    if (falloff <= 0 || screenHeight <= 0)
+      return 1;
+    
+    // The distance to the nearest pixel of the tile.
+    const double dx = std::max({tile.x - focusX,
+                                focusX - (tile.x + tile.width - 1), 0.0});
+    const double dy = std::max({tile.y - focusY,
+                                focusY - (tile.y + tile.height - 1), 0.0});
+    const double distance = std::sqrt(dx * dx + dy * dy) / screenHeight;
+    
+    const double doublings = (distance - radius) * falloff;
+    if (doublings < 0)
+      return 1;
+    
+    int step = 2;
+    for (int i = 1; i <= int(doublings) && step < maxStep; i++)
+      step *= 2;
+    return std::min(step, std::max(maxStep, 1));
+  }
+  
+  
+  bool operator == (const Foveation& other) const {
+    return falloff == other.falloff && radius == other.radius
+           && maxStep == other.maxStep
+           && focusX == other.focusX && focusY == other.focusY;
+  }
+};
+
+
+// A group of tiles (or pieces of a tile) that one thread renders in one go.
+struct WorkUnit {
+  uint firstPiece = 0;
+  uint pieceCount = 0;
+  double expectedCost = 0;  // In seconds, based on the previous frame.
+};
+
+
+// Cuts the screen into small square tiles and groups them into work units,
+// which the threads take one by one (in the order of the work units) until
+// they're all gone. A thread that gets a cheap unit (e.g. only sky) just
+// takes the next one, so all threads finish at about the same time.
+//
+// The tiles are in Morton order, so that tiles that are rendered around the
+// same time are close together on the screen. Those tiles tend to hit the
+// same parts of the scene and write to the same parts of the canvas.
+//
+// The scheduler also remembers how long each tile took in the previous frame.
+// Tiles that were expensive are split into smaller pieces, neighbouring tiles
+// that were cheap are merged into one unit, and the most expensive units go
+// first. That way there's no expensive unit left at the end of the frame that
+// keeps one thread busy while the rest are waiting.
+//
+// A frame can also get a deadline. Tiles that start when the deadline is
+// close are traced sparsely (only every 2nd or 4th row and column), and the
+// renderer fills in the rest. The time that this saved is remembered as
+// missed work, so the caller can pick a cheaper next frame.
+//
+// With foveation, the tiles away from the focus are traced sparsely anyway.
+// That's on purpose, so it doesn't count as missed work.
+//
+// Call `prepare` once per frame, then call `runWorkUnit` for every work unit.
+class TileScheduler {
+public:
+  using clock = std::chrono::steady_clock;
+  
+  // No tile is traced sparsely before this time.
+  clock::time_point deadline = clock::time_point::max();
+  
+  // The step of tiles that start after the deadline. Tiles that are
+  // expected to end after the deadline get half of it.
+  int maxSparseStep = 4;
+  
+  Foveation foveation;  // Off by default
+  
+  // If this isn't empty, only the parts of the tiles within it are
+  // rendered, and the costs of the frame aren't learned from.
+  Tile clip;
+  
+  // The width and height of a tile in pixels. Tiles at the right and bottom
+  // edges of the screen may be smaller.
+  int tileSize = 16;
+  
+  // Roughly how many work units each thread gets. More units balance the
+  // load better, fewer units have less overhead.
+  uint unitsPerThread = 8;
+  
+  // The most tiles that are merged into one work unit.
+  uint maxMergedTiles = 16;
+  
+  
+  /** Plans the work units of a frame. `threadCount` is the amount of threads
+   * that are going to render them. */
+  void prepare(int width, int height, uint threadCount = 1) {
+    if (width != preparedWidth || height != preparedHeight
+        || tileSize != preparedTileSize)
+      createTiles(width, height);
+    else
+      learnTileCosts();
+    
+    preparedThreads = std::max(threadCount, 1u);
+    planWorkUnits(preparedThreads);
+  }
+  
+  
+  /** Calls renderTile(tile) for every tile (or piece of a tile) in the work
+   * unit, and remembers how long that took. Different threads may run
+   * different work units at the same time.
+   *
+   * If renderTile also takes a step, as in renderTile(tile, step), it's told
+   * to trace only the lines that forEachSparseLine goes over when the
+   * deadline is close or the tile is away from the focus (and to fill in
+   * the rest). The step is 1 otherwise. */
+  template<class RenderTile>
+  void runWorkUnit(uint unit, RenderTile renderTile) {
+    const WorkUnit& workUnit = units[unit];
+    const double expectedPieceCost =
+        workUnit.expectedCost / std::max(workUnit.pieceCount, 1u);
+    double fullCost = 0;
+    double missedCost = 0;
+    
+    for (uint i = 0; i < workUnit.pieceCount; i++) {
+      Tile tile = pieces[workUnit.firstPiece + i].tile;
+      if (!clip.isEmpty()) {
+        tile = intersect(tile, clip);
+        if (tile.isEmpty())
+          continue;
+      }
+      auto start = clock::now();
+    
+      if constexpr (std::is_invocable_v<RenderTile&, const Tile&, int>) {
+        const int foveatedStep = foveation.calcStep(tile, preparedHeight);
+        const int step =
+            std::max(calcStep(start, expectedPieceCost), foveatedStep);
+        renderTile(tile, step);
+        
+        // A sparse tile would've taken longer at the full quality (which is
+        // the foveated step here).
+        auto countTraced = [&](int lineStep) {
+          return double(countSparseLines(tile.width, lineStep))
+                 * countSparseLines(tile.height, lineStep);
+        };
+        std::chrono::duration<double> duration = clock::now() - start;
+        const double full = duration.count()
+                            * (countTraced(foveatedStep) / countTraced(step));
+        fullCost += full;
+        missedCost += full - duration.count();
+      } else {
+        renderTile(tile);
+        std::chrono::duration<double> duration = clock::now() - start;
+        fullCost += duration.count();
+      }
+    }
+    
+    if (clip.isEmpty())
+      recordCost(unit, fullCost);
+    missedCosts[unit] = missedCost;
+  }
+  
+  
+  /** Remembers how long a work unit took (runWorkUnit does this for you). */
+  void recordCost(uint unit, double seconds) {
+    measuredCosts[unit] = seconds;
+  }
+  
+  
+  /** Roughly how much longer the frame would have taken if no tiles were
+   * traced sparsely. Only valid once all work units have been run. */
+  double getMissedSeconds() const {
+    double missed = 0;
+    for (double cost : missedCosts)
+      missed += cost;
+    // The threads share the missed work.
+    return missed / preparedThreads;
+  }
+  
+  
+  const List<WorkUnit>& getWorkUnits() const {
+    return units;
+  }
+  
+  
+  const List<Tile>& getTiles() const {
+    return tiles;
+  }
+
+
+private:
+  // A tile, or a part of one if the tile was split.
+  struct Piece {
+    Tile tile;
+    uint tileIndex;  // The index of the whole tile in `tiles`
+  };
+  
+  List<Tile> tiles;  // In Morton order
+  List<double> tileCosts;  // Seconds per tile, in the previous frame
+  List<Piece> pieces;
+  List<WorkUnit> units;
+  List<double> measuredCosts;  // Seconds per work unit, or -1 if not run
+  List<double> missedCosts;  // Seconds per work unit, see getMissedSeconds
+  uint preparedThreads = 1;
+  int preparedWidth = -1;
+  int preparedHeight = -1;
+  int preparedTileSize = -1;
+  
+  
+  // How sparsely to trace a tile that starts now and is expected to take
+  // `expectedCost` seconds.
+  int calcStep(clock::time_point now, double expectedCost) const {
+    if (deadline == clock::time_point::max())
+      return 1;
+    if (now >= deadline)
+      return maxSparseStep;
+    
+    std::chrono::duration<double> timeLeft = deadline - now;
+    if (expectedCost > timeLeft.count())
+      return std::max(maxSparseStep / 2, 1);
+    return 1;
+  }
+  
+  
+  void createTiles(int width, int height) {
+    if (tileSize < 1)
+      THROW("The tile size must be at least 1, but it is " + $(tileSize));
+    
+    preparedWidth = width;
+    preparedHeight = height;
+    preparedTileSize = tileSize;
+    
+    const int columns = (width + tileSize - 1) / tileSize;
+    const int rows = (height + tileSize - 1) / tileSize;
+    
+    tiles.clear();
+    
+    for (int row = 0; row < rows; row++) {
+      for (int column = 0; column < columns; column++) {
+        Tile tile;
+        tile.x = column * tileSize;
+        tile.y = row * tileSize;
+        tile.width = std::min(tileSize, width - tile.x);
+        tile.height = std::min(tileSize, height - tile.y);
+        tiles.push_back(tile);
+      }
+    }
+    
+    // Put the tiles in Morton order...
+    auto code = [this](const Tile& tile) {
+      return mortonCode(tile.x / tileSize, tile.y / tileSize);
+    };
+    std::sort(tiles.begin(), tiles.end(), [&](const Tile& a, const Tile& b) {
+      return code(a) < code(b);
+    });
+    
+    // Nothing is known about the costs yet.
+    tileCosts.assign(tiles.size(), 0);
+  }
+  
+  
+  // Turns the measured costs of the work units back into costs per tile. The
+  // cost of a unit is spread over its tiles by the amount of pixels.
+  void learnTileCosts() {
+    for (double cost : measuredCosts)
+      if (cost < 0)
+        return;  // Not all units were rendered, so keep the old costs.
+    
+    std::fill(tileCosts.begin(), tileCosts.end(), 0);
+    
+    for (uint unit = 0; unit < units.size(); unit++) {
+      const WorkUnit& workUnit = units[unit];
+      double pixels = 0;
+      for (uint i = 0; i < workUnit.pieceCount; i++) {
+        const Tile& tile = pieces[workUnit.firstPiece + i].tile;
+        pixels += tile.width * tile.height;
+      }
+      
+      for (uint i = 0; i < workUnit.pieceCount; i++) {
+        const Piece& piece = pieces[workUnit.firstPiece + i];
+        double share = piece.tile.width * piece.tile.height / pixels;
+        tileCosts[piece.tileIndex] += measuredCosts[unit] * share;
+      }
+    }
+  }
+  
+  
+  void planWorkUnits(uint threadCount) {
+    pieces.clear();
+    units.clear();
+    
+    double totalCost = 0;
+    for (double cost : tileCosts)
+      totalCost += cost;
+    
+    // Without costs, every tile is a unit of its own.
+    const double targetCost =
+        totalCost / double(threadCount * std::max(unitsPerThread, 1u));
+    const bool isCostKnown = targetCost > 0;
+    
+    WorkUnit merged;
+    auto finishMergedUnit = [&]() {
+      if (merged.pieceCount > 0)
+        units.push_back(merged);
+      merged = {uint(pieces.size()), 0, 0};
+    };
+    
+    for (uint i = 0; i < tiles.size(); i++) {
+      const Tile& tile = tiles[i];
+      const double cost = tileCosts[i];
+      
+      if (isCostKnown && cost > 2 * targetCost) {
+        // Expensive: Split the tile into parts x parts pieces...
+        finishMergedUnit();
+        int parts = int(std::ceil(std::sqrt(cost / targetCost)));
+        parts = std::min({parts, tile.width, tile.height});
+        
+        for (int py = 0; py < parts; py++) {
+          for (int px = 0; px < parts; px++) {
+            Tile piece;
+            piece.x = tile.x + tile.width * px / parts;
+            piece.y = tile.y + tile.height * py / parts;
+            piece.width = tile.x + tile.width * (px+1) / parts - piece.x;
+            piece.height = tile.y + tile.height * (py+1) / parts - piece.y;
+            
+            double share = piece.width * piece.height
+                           / double(tile.width * tile.height);
+            units.push_back({uint(pieces.size()), 1, cost * share});
+            pieces.push_back({piece, i});
+          }
+        }
+        merged.firstPiece = pieces.size();
+        continue;
+      }
+      
+      // Cheap: Merge the tile with its neighbours (in Morton order)...
+      if (!isCostKnown
+          || merged.expectedCost + cost > targetCost
+          || merged.pieceCount >= maxMergedTiles)
+        finishMergedUnit();
+      
+      pieces.push_back({tile, i});
+      merged.pieceCount++;
+      merged.expectedCost += cost;
+    }
+    finishMergedUnit();
+    
+    // The most expensive units go first.
+    std::stable_sort(units.begin(), units.end(),
+                     [](const WorkUnit& a, const WorkUnit& b) {
+                       return a.expectedCost > b.expectedCost;
+                     });
+    
+    measuredCosts.assign(units.size(), -1);
+    missedCosts.assign(units.size(), 0);
+  }
+};
+
+
+
+#ifdef ENABLE_DOCTEST
+#include <doctest/doctest.h>
+#include <thread>
+TEST_CASE("mortonCode") {
+  CHECK(mortonCode(0, 0) == 0);
+  CHECK(mortonCode(1, 0) == 1);
+  CHECK(mortonCode(0, 1) == 2);
+  CHECK(mortonCode(1, 1) == 3);
+  CHECK(mortonCode(2, 0) == 4);
+  CHECK(mortonCode(3, 3) == 15);
+}
+
+
+TEST_CASE("TileScheduler covers every pixel exactly once") {
+  TileScheduler scheduler;
+  scheduler.tileSize = 16;
+  const int width = 100, height = 37;
+  
+  for (int frame = 0; frame < 3; frame++) {
+    scheduler.prepare(width, height, 4);
+    List<int> coverage(width * height, 0);
+    
+    for (uint unit = 0; unit < scheduler.getWorkUnits().size(); unit++) {
+      scheduler.runWorkUnit(unit, [&](const Tile& tile) {
+        for (int y = tile.y; y < tile.y + tile.height; y++)
+          for (int x = tile.x; x < tile.x + tile.width; x++)
+            coverage[y * width + x]++;
+      });
+    }
+    
+    CHECK(std::all_of(coverage.begin(), coverage.end(),
+                      [](int count) { return count == 1; }));
+  }
+  
+  // The first four tiles are the top left 2x2 block of tiles.
+  const List<Tile>& tiles = scheduler.getTiles();
+  CHECK(tiles[1].x == 16);
+  CHECK(tiles[1].y == 0);
+  CHECK(tiles[2].x == 0);
+  CHECK(tiles[2].y == 16);
+  CHECK(tiles[3].x == 16);
+  CHECK(tiles[3].y == 16);
+  
+  // With a clip, only the pixels within it are covered.
+  const Tile clip = {10, 5, 30, 20};
+  scheduler.clip = clip;
+  scheduler.prepare(width, height, 4);
+  List<int> coverage(width * height, 0);
+  for (uint unit = 0; unit < scheduler.getWorkUnits().size(); unit++) {
+    scheduler.runWorkUnit(unit, [&](const Tile& tile) {
+      for (int y = tile.y; y < tile.y + tile.height; y++)
+        for (int x = tile.x; x < tile.x + tile.width; x++)
+          coverage[y * width + x]++;
+    });
+  }
+  
+  int wrong = 0;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      const bool isInside = !intersect(clip, {x, y, 1, 1}).isEmpty();
+      wrong += coverage[y * width + x] != (isInside ? 1 : 0);
+    }
+  }
+  CHECK(wrong == 0);
+}
+
+
+TEST_CASE("TileScheduler splits expensive tiles and merges cheap ones") {
+  TileScheduler scheduler;
+  scheduler.tileSize = 16;
+  
+  // Without any costs, every tile is a unit.
+  scheduler.prepare(128, 128, 2);
+  const uint tileCount = scheduler.getTiles().size();
+  REQUIRE(scheduler.getWorkUnits().size() == tileCount);
+  
+  // Make the last tile very expensive.
+  for (uint unit = 0; unit < tileCount; unit++)
+    scheduler.recordCost(unit, unit == tileCount - 1 ? 1.0 : 0.001);
+  
+  scheduler.prepare(128, 128, 2);
+  const List<WorkUnit>& units = scheduler.getWorkUnits();
+  
+  // The pieces of the expensive tile come first.
+  Tile first;
+  scheduler.runWorkUnit(0, [&](const Tile& tile) { first = tile; });
+  CHECK(first.x >= 112);
+  CHECK(first.y >= 112);
+  CHECK(first.width < 16);
+  CHECK(units[0].expectedCost > units.back().expectedCost);
+  
+  // The cheap tiles are merged.
+  uint mergedUnits = 0;
+  for (const WorkUnit& unit : units)
+    if (unit.pieceCount > 1)
+      mergedUnits++;
+  CHECK(mergedUnits > 0);
+}
+
+
+TEST_CASE("TileScheduler traces sparsely after the deadline") {
+  List<int> lines;
+  forEachSparseLine(0, 10, 4, [&](int i) { lines.push_back(i); });
+  CHECK(lines == List<int>{0, 4, 8, 9});
+  CHECK(countSparseLines(10, 4) == 4);
+  CHECK(countSparseLines(9, 4) == 3);
+  CHECK(countSparseLines(1, 4) == 1);
+  
+  TileScheduler scheduler;
+  scheduler.prepare(64, 64, 2);
+  List<int> steps;
+  
+  // Without a deadline, everything is traced fully.
+  scheduler.runWorkUnit(0, [&](const Tile&, int step) {
+    steps.push_back(step);
+  });
+  
+  // After the deadline, the tiles are sparse and the missed work counts.
+  scheduler.deadline = TileScheduler::clock::now();
+  scheduler.runWorkUnit(1, [&](const Tile&, int step) {
+    steps.push_back(step);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  });
+  
+  CHECK(steps == List<int>{1, 4});
+  CHECK(scheduler.getMissedSeconds() > 0);
+}
+
+
+TEST_CASE("foveation") {
+  Foveation foveation;
+  foveation.falloff = 4;
+  foveation.focusX = 50;
+  foveation.focusY = 50;
+  
+  // Off by default, and full near the focus.
+  CHECK(Foveation().calcStep({300, 300, 16, 16}, 100) == 1);
+  CHECK(foveation.calcStep({48, 48, 16, 16}, 100) == 1);
+  CHECK(foveation.calcStep({60, 40, 16, 16}, 100) == 1);
+  
+  // Then sparser and sparser, up to the maximum.
+  CHECK(foveation.calcStep({76, 48, 16, 16}, 100) == 2);
+  CHECK(foveation.calcStep({92, 48, 16, 16}, 100) == 4);
+  CHECK(foveation.calcStep({200, 200, 16, 16}, 100) == 8);
+  
+  // Sparse tiles away from the focus aren't missed work.
+  TileScheduler scheduler;
+  scheduler.foveation = foveation;
+  scheduler.prepare(256, 256);
+  List<int> steps;
+  for (uint unit = 0; unit < scheduler.getWorkUnits().size(); unit++)
+    scheduler.runWorkUnit(unit, [&](const Tile&, int step) {
+      steps.push_back(step);
+    });
+  
+  CHECK(std::count(steps.begin(), steps.end(), 1) > 0);
+  CHECK(std::count(steps.begin(), steps.end(), 8) > 0);
+  CHECK(scheduler.getMissedSeconds() == 0);
+}
+
+
+TEST_CASE("grid gaps") {
+  List<GridGap> gaps;
+  forEachGridGap({10, 20, 10, 2}, 4, [&](const GridGap& gap) {
+    gaps.push_back(gap);
+  });
+  
+  // Columns 0, 4, 8 and 9 of both rows are traced, the rest are gaps.
+  REQUIRE(gaps.size() == 12);
+  CHECK(gaps[1].x == 12);
+  CHECK(gaps[1].y == 20);
+  CHECK(gaps[1].left == 10);
+  CHECK(gaps[1].right == 14);
+  CHECK(gaps[1].across == 0.5);
+  CHECK(gaps[6].y == 21);
+}
+
+
+TEST_CASE("progressive refinement traces every pixel once") {
+  const Tile tile = {3, 5, 11, 7};
+  List<int> coverage(tile.width * tile.height, 0);
+  
+  for (RefinementPass pass : {RefinementPass{4, 0}, {2, 4}, {1, 2}})
+    forEachRefinedPixel(tile, pass, [&](int x, int y) {
+      coverage[(y - tile.y) * tile.width + (x - tile.x)]++;
+    });
+  
+  CHECK(std::all_of(coverage.begin(), coverage.end(),
+                    [](int count) { return count == 1; }));
+  
+  // So do the two halves of a checkerboard.
+  for (RefinementPass pass : {RefinementPass{1, 0, 0}, {1, 0, 1}})
+    forEachRefinedPixel(tile, pass, [&](int x, int y) {
+      coverage[(y - tile.y) * tile.width + (x - tile.x)]++;
+    });
+  
+  CHECK(std::all_of(coverage.begin(), coverage.end(),
+                    [](int count) { return count == 2; }));
+  CHECK(!RefinementPass{1, 0, 0}.isComplete());
+}
+#endif
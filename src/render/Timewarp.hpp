@@ -0,0 +1,160 @@
+#pragma once
+
+#include <SDL2/SDL.h>
+#include <algorithm>
+#include <cmath>
+
+#include "FramePipeline.hpp"
+#include "ViewRays.hpp"
+#include "util.hpp"
+
+
+// Shows the last frame as if it were seen from a newer camera, for while the
+// next frame is still being traced. That way turning the camera stays smooth
+// even when the tracing can't keep up.
+//
+// Every pixel of the old frame is moved to where its hit is seen from the
+// new camera, using the distances of the old frame. Nearer hits win when two
+// pixels land on the same spot. The spots that no pixel lands on (because
+// they weren't visible before) look in the same direction in the old frame.
+class Timewarp {
+public:
+  ~Timewarp() {
+    SDL_FreeSurface(surface);
+  }
+  
+  
+  /** Warps the frame in `source` to the view `to`, which should have the same
+   * size as the view of the source. Returns the warped frame. */
+  SDL_Surface* warp(const CanvasBuffer& source, const ViewRays& to) {
+    const ViewRays& from = source.view;
+    const int width = from.width;
+    const int height = from.height;
+    allocate(source.surface->w, source.surface->h);
+    
+    const int stride = surface->w;
+    const u32* sourcePixels = source.pixels.get();
+    const float* sourceDistances = source.distances.get();
+    u32* targetPixels = pixels.get();
+    std::fill_n(depths.begin(), depths.size(), Limits<float>::infinity());
+    
+    // Move every hit to where it's seen now...
+    for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) {
+        int i, j;
+        float newDistance;
+        if (!moveHit(from, to, x, y, sourceDistances[y * stride + x], i, j,
+                     newDistance))
+          continue;
+        
+        if (newDistance < depths[j * stride + i]) {
+          depths[j * stride + i] = newDistance;
+          targetPixels[j * stride + i] = sourcePixels[y * stride + x];
+        }
+      }
+    }
+    
+    // Fill the holes with whatever was in the same direction...
+    for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) {
+        if (!std::isinf(depths[y * stride + x]))
+          continue;
+        
+        const Ray ray = to.rayAt(x, y);
+        double oldX, oldY;
+        u32 color = 0;
+        
+        if (from.project(from.pos + ray.d, oldX, oldY)) {
+          int i = std::clamp(int(std::lround(oldX)), 0, width - 1);
+          int j = std::clamp(int(std::lround(oldY)), 0, height - 1);
+          color = sourcePixels[j * stride + i];
+        }
+        
+        targetPixels[y * stride + x] = color;
+      }
+    }
+    
+    return surface;
+  }
+
+
+private:
+  SDL_Surface* surface = nullptr;
+  Unique<u32[]> pixels;
+  List<float> depths;
+  
+  
+  void allocate(int width, int height) {
+    if (surface != nullptr && surface->w == width && surface->h == height)
+      return;
+    
+    SDL_FreeSurface(surface);
+    pixels.reset(new u32[width * height]);
+    depths.resize(width * height);
+    surface = SDL_CreateRGBSurfaceWithFormatFrom(
+        pixels.get(), width, height, 32, width * 4, SDL_PIXELFORMAT_RGBA32
+    );
+    
+    if (surface == nullptr)
+      THROW("Failed to create a canvas: " + String(SDL_GetError()));
+  }
+};
+
+
+
+#ifdef ENABLE_DOCTEST
+#include <doctest/doctest.h>
+TEST_CASE("timewarp") {
+  // A frame of 8x8 pixels of different colors, which all hit something at a
+  // distance of 5, except for the pixel (4, 4), which is sky.
+  Matrix<4,4> viewrect = {
+      1, 0, 0, 0,
+      0, 1, 0, 0,
+      0, 0, 1, 0,
+      0, 0, 0, 0
+  };
+  const int size = 8;
+  CanvasBuffer from;
+  from.view = {{0, 0, 0, 0}, viewrect, size, size};
+  from.viewWidth = size;
+  from.viewHeight = size;
+  from.pixels.reset(new u32[size * size]);
+  from.distances.reset(new float[size * size]);
+  from.surface = SDL_CreateRGBSurfaceWithFormatFrom(
+      from.pixels.get(), size, size, 32, size * 4, SDL_PIXELFORMAT_RGBA32
+  );
+  for (int i = 0; i < size * size; i++)
+    from.pixels[i] = u32(i + 1);
+  std::fill_n(from.distances.get(), size * size, 5.0f);
+  from.distances[4 * size + 4] = Limits<float>::infinity();
+  
+  // Seen from the same camera, nothing changes. The sky looks in the same
+  // direction, so it stays too.
+  Timewarp timewarp;
+  const u32* warped =
+      static_cast<const u32*>(timewarp.warp(from, from.view)->pixels);
+  CHECK(std::equal(warped, warped + size * size, from.pixels.get()));
+  
+  // Turned sideways by the angle between the two middle columns, every
+  // pixel moves one column to the left.
+  const double angle = 2 * std::atan(0.5 / (size - 1));
+  ViewRays turned = from.view;
+  turned.viewBasis = rotationMatrix(0, 2, -angle) * viewrect;
+  warped = static_cast<const u32*>(timewarp.warp(from, turned)->pixels);
+  for (int y = 0; y < size; y++) {
+    for (int x = 1; x < size; x++) {
+      if (x != 4 || y != 4)
+        CHECK(warped[y * size + x - 1] == from.pixels[y * size + x]);
+    }
+  }
+  
+  // Nothing lands where the sky was, or in the column that wasn't on the
+  // screen before. Those are filled from the old frame in the same
+  // direction (clamped to its edge).
+  CHECK(warped[4 * size + 3] == from.pixels[4 * size + 4]);
+  for (int y = 0; y < size; y++)
+    CHECK(warped[y * size + size - 1] == from.pixels[y * size + size - 1]);
+  
+  SDL_FreeSurface(from.surface);
+}
+#endif
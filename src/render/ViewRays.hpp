@@ -0,0 +1,140 @@
+#pragma once
+
+#include <cmath>
+
+#include "math.hpp"
+
+
+// Everything that's needed to make the ray through any point of the screen.
+// The camera makes one of these per frame (see calcViewRays).
+struct ViewRays {
+  Vec4 pos;
+  Matrix<4,4> viewBasis;
+  int width = 1;
+  int height = 1;
+  
+  
+  // The ray through the pixel coordinate (x, y). The coordinates don't need
+  // to be whole numbers, which is useful for antialiasing.
+  Ray rayAt(double x, double y) const {
+    double xn = x / double(width-1) - 0.5;  // xn: x from -0.5 to 0.5
+    double yn = y / double(height-1) - 0.5;
+    Vec4 rayDir = normalize(viewBasis * Vec4(xn, yn, 1, 0));
+    return {pos, rayDir};
+  }
+  
+  
+  // The opposite of rayAt: Finds the pixel coordinate (x, y) whose ray goes
+  // through `point`. Returns false if the point is behind the camera.
+  // Points outside of the 3D slice of the view are projected onto it.
+  bool project(const Vec4& point, double& x, double& y) const {
+    // The first three columns of the view basis are orthogonal, so the
+    // coordinates are found with dot products.
+    const Vec4 horizontal = column(viewBasis, 0);
+    const Vec4 vertical = column(viewBasis, 1);
+    const Vec4 forward = column(viewBasis, 2);
+    
+    Vec4 dir = point - pos;
+    double depth = dir.dot(forward) / forward.dot(forward);
+    if (depth <= 0)
+      return false;
+    
+    double xn = dir.dot(horizontal) / horizontal.dot(horizontal) / depth;
+    double yn = dir.dot(vertical) / vertical.dot(vertical) / depth;
+    x = (xn + 0.5) * double(width-1);
+    y = (yn + 0.5) * double(height-1);
+    return true;
+  }
+  
+  
+  // The rectangle of pixel coordinates that a ball (like a hypersphere)
+  // covers. Returns false if the ball reaches behind the camera, where the
+  // rectangle would be endless.
+  bool projectBall(
+      const Vec4& center, double radius,
+      double& left, double& top, double& right, double& bottom
+  ) const {
+    const Vec4 forward = column(viewBasis, 2);
+    const double forwardLength = forward.calcLength();
+    const Vec4 dir = center - pos;
+    const double depth = dir.dot(forward) / forwardLength;
+    if (depth <= radius)
+      return false;
+    
+    // Seen along one axis of the screen, the ball is a disk, and its edges
+    // on the screen are where the lines from the camera touch the disk.
+    auto findEdges = [&](uint axis, int size, double& low, double& high) {
+      const Vec4 side = column(viewBasis, axis);
+      const double sideLength = side.calcLength();
+      const double offset = dir.dot(side) / sideLength;
+      const double angle = std::atan2(offset, depth);
+      const double spread = std::asin(radius / std::hypot(offset, depth));
+      const double scale = forwardLength / sideLength;
+      low = (std::tan(angle - spread) * scale + 0.5) * double(size-1);
+      high = (std::tan(angle + spread) * scale + 0.5) * double(size-1);
+    };
+    findEdges(0, width, left, right);
+    findEdges(1, height, top, bottom);
+    return true;
+  }
+  
+  
+  bool operator == (const ViewRays& other) const {
+    return pos == other.pos && viewBasis == other.viewBasis
+           && width == other.width && height == other.height;
+  }
+};
+
+
+/** Moves the hit at `distance` along the ray through the pixel (x, y) of
+ * `from` to the pixel (i, j) of `to` that it's seen at, and finds its
+ * distance from there. Returns false for misses (an infinite distance), and
+ * for hits that `to` doesn't see. Timewarp and Reprojector both use this. */
+inline bool moveHit(
+    const ViewRays& from, const ViewRays& to, int x, int y, float distance,
+    int& i, int& j, float& newDistance
+) {
+  if (std::isinf(distance))
+    return false;
+  
+  const Ray ray = from.rayAt(x, y);
+  const Vec4 hit = ray.p + ray.d * distance;
+  
+  double newX, newY;
+  if (!to.project(hit, newX, newY))
+    return false;
+  
+  i = int(std::lround(newX));
+  j = int(std::lround(newY));
+  if (i < 0 || j < 0 || i >= to.width || j >= to.height)
+    return false;
+  
+  newDistance = float((hit - to.pos).calcLength());
+  return true;
+}
+
+
+
+#ifdef ENABLE_DOCTEST
+#include <doctest/doctest.h>
+TEST_CASE("view rays projection") {
+  Matrix<4,4> rotation = rotationMatrix(0, 1, 0.4) * rotationMatrix(0, 2, 0.2);
+  Matrix<4,4> viewrect = {
+      0, 0,   1, 0,
+      2, 0,   0, 0,
+      0, -1.5, 0, 0,
+      0, 0,   0, 0
+  };
+  ViewRays view = {{1, 2, 3, 4}, rotation * viewrect, 800, 600};
+  
+  // A point on the ray through a pixel projects back onto that pixel.
+  Ray ray = view.rayAt(123, 456);
+  double x, y;
+  REQUIRE(view.project(ray.p + ray.d * 7, x, y));
+  CHECK(std::abs(x - 123) < 0.000001);
+  CHECK(std::abs(y - 456) < 0.000001);
+  
+  // Points behind the camera aren't on the screen.
+  CHECK(!view.project(ray.p - ray.d, x, y));
+}
+#endif
@@ -0,0 +1,295 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "math.hpp"
+#include "util.hpp"
+
+// Turning colors (from 0 to 1 per channel) into RGBA pixels with 8 bits per
+// channel, several pixels at a time.
+//
+// The SSE2 path converts a whole pixel at once and packs four pixels into
+// one 16 byte store. The plain path does the same math one channel at a time.
+// Either way the channels are clamped and then rounded down, like they always
+// were. With gamma correction, the color channels (not alpha) are raised to
+// the power 1/2 first, which is close to sRGB and costs one square root.
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define FRUIT_QUANTIZE_SSE2 1
+#endif
+
+
+// Canvases at least this big don't fit into the cache anyway, so their
+// pixels may be written with streaming stores (see PixelRowWriter).
+inline constexpr std::size_t STREAMED_CANVAS_BYTES = 4 << 20;
+
+
+#if FRUIT_QUANTIZE_SSE2
+// The channels of a pixel as four 32 bit integers (from 0 to 255).
+inline __m128i quantizeSse2(const Vec4& color, bool isGammaCorrected) {
+  const __m128d zero = _mm_setzero_pd();
+  const __m128d one = _mm_set1_pd(1.0);
+  const __m128d scale = _mm_set1_pd(255.0);
+  
+  // _mm_max_pd takes the zero when a channel is NaN.
+  __m128d redGreen = _mm_min_pd(_mm_max_pd(_mm_loadu_pd(color.a), zero), one);
+  __m128d blueAlpha =
+      _mm_min_pd(_mm_max_pd(_mm_loadu_pd(color.a + 2), zero), one);
+  if (isGammaCorrected) {
+    redGreen = _mm_sqrt_pd(redGreen);
+    blueAlpha = _mm_move_sd(blueAlpha, _mm_sqrt_pd(blueAlpha));
+  }
+  
+  return _mm_unpacklo_epi64(
+      _mm_cvttpd_epi32(_mm_mul_pd(redGreen, scale)),
+      _mm_cvttpd_epi32(_mm_mul_pd(blueAlpha, scale))
+  );
+}
+
+
+inline __m128i quantizeSse2(const float* rgba, bool isGammaCorrected) {
+  __m128 color = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(rgba), _mm_setzero_ps()),
+                            _mm_set1_ps(1.0f));
+  if (isGammaCorrected) {
+    const __m128 isColor = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+    color = _mm_or_ps(_mm_and_ps(isColor, _mm_sqrt_ps(color)),
+                      _mm_andnot_ps(isColor, color));
+  }
+  return _mm_cvttps_epi32(_mm_mul_ps(color, _mm_set1_ps(255.0f)));
+}
+
+
+/** Writes four pixels. Streaming stores go around the cache, but need 16
+ * byte alignment. */
+inline void storePixels(
+    u32* out, __m128i a, __m128i b, __m128i c, __m128i d, bool isStreamed
+) {
+  const __m128i pixels = _mm_packus_epi16(_mm_packs_epi32(a, b),
+                                          _mm_packs_epi32(c, d));
+  __m128i* target = reinterpret_cast<__m128i*>(out);
+  if (isStreamed && (reinterpret_cast<std::uintptr_t>(out) & 15) == 0)
+    _mm_stream_si128(target, pixels);
+  else
+    _mm_storeu_si128(target, pixels);
+}
+#endif
+
+
+/** A color as an RGBA pixel (red in the lowest byte). */
+inline u32 quantizeColor(const Vec4& color, bool isGammaCorrected = false) {
+#if FRUIT_QUANTIZE_SSE2
+  const __m128i channels = quantizeSse2(color, isGammaCorrected);
+  const __m128i shorts = _mm_packs_epi32(channels, channels);
+  return u32(_mm_cvtsi128_si32(_mm_packus_epi16(shorts, shorts)));
+#else
+  u8 pixel[4];
+  for (int c = 0; c < 4; c++) {
+    double value = std::isnan(color[c]) ? 0.0 : clamp(color[c], 0.0, 1.0);
+    if (isGammaCorrected && c < 3)
+      value = std::sqrt(value);
+    pixel[c] = u8(value * 255.0);
+  }
+  u32 rgba;
+  std::memcpy(&rgba, pixel, 4);
+  return rgba;
+#endif
+}
+
+
+/** Quantizes `count` colors into `out`. With `isStreamed`, the groups of
+ * four pixels that are aligned are written with streaming stores, so call
+ * _mm_sfence before other threads read them (PixelRowWriter does). */
+inline void quantizeRow(
+    const Vec4* colors, int count, u32* out,
+    bool isGammaCorrected = false, [[maybe_unused]] bool isStreamed = false
+) {
+  int i = 0;
+#if FRUIT_QUANTIZE_SSE2
+  for (; i + 4 <= count; i += 4) {
+    storePixels(out + i, quantizeSse2(colors[i], isGammaCorrected),
+                quantizeSse2(colors[i + 1], isGammaCorrected),
+                quantizeSse2(colors[i + 2], isGammaCorrected),
+                quantizeSse2(colors[i + 3], isGammaCorrected), isStreamed);
+  }
+#endif
+  for (; i < count; i++)
+    out[i] = quantizeColor(colors[i], isGammaCorrected);
+}
+
+
+/** Like the other quantizeRow, for colors stored as four floats (RGBA). */
+inline void quantizeRow(
+    const float* colors, int count, u32* out,
+    bool isGammaCorrected = false, [[maybe_unused]] bool isStreamed = false
+) {
+  int i = 0;
+#if FRUIT_QUANTIZE_SSE2
+  for (; i + 4 <= count; i += 4) {
+    const float* rgba = colors + i * 4;
+    storePixels(out + i, quantizeSse2(rgba, isGammaCorrected),
+                quantizeSse2(rgba + 4, isGammaCorrected),
+                quantizeSse2(rgba + 8, isGammaCorrected),
+                quantizeSse2(rgba + 12, isGammaCorrected), isStreamed);
+  }
+#endif
+  for (; i < count; i++) {
+    const float* rgba = colors + i * 4;
+    out[i] = quantizeColor(Vec4(rgba[0], rgba[1], rgba[2], rgba[3]),
+                           isGammaCorrected);
+  }
+}
+
+
+// Collects the colors of pixels that are written one after the other in the
+// same row, and quantizes them together, up to a cache line (16 pixels) at a
+// time. A whole cache line can be written with streaming stores, so that it
+// doesn't have to be read into the cache first.
+//
+// Every thread needs its own (see getThreadRowWriter). Call `finish` before
+// anything else reads the pixels.
+class PixelRowWriter {
+public:
+  /** Sets the pixel at `pixel` to `color`, now or later. */
+  void write(u32* pixel, const Vec4& color, bool isStreamed) {
+    if (count > 0
+        && (floats != nullptr || pixel != start + count || isLineStart(pixel)))
+      flush();
+    if (count == 0) {
+      start = pixel;
+      this->isStreamed = isStreamed;
+    }
+    colors[count++] = color;
+    if (count == CAPACITY)
+      flush();
+  }
+  
+  
+  /** Like the other `write`, for a color that's stored as four floats
+   * (RGBA), which must stay the same until it's written. Colors that follow
+   * each other in memory, like in a float color buffer, are quantized
+   * straight from there. */
+  void write(u32* pixel, const float* rgba, bool isStreamed) {
+    if (count > 0 && (floats == nullptr || pixel != start + count
+                      || rgba != floats + count * 4 || isLineStart(pixel)))
+      flush();
+    if (count == 0) {
+      start = pixel;
+      floats = rgba;
+      this->isStreamed = isStreamed;
+    }
+    count++;
+    if (count == CAPACITY)
+      flush();
+  }
+  
+  
+  /** Writes the pixels that are still waiting. */
+  void finish() {
+    flush();
+#if FRUIT_QUANTIZE_SSE2
+    if (hasStreamed)
+      _mm_sfence();
+#endif
+    hasStreamed = false;
+  }
+
+
+private:
+  static constexpr int CAPACITY = 16;  // 64 bytes
+  Vec4 colors[CAPACITY];
+  const float* floats = nullptr;  // Instead of `colors`, if it's set
+  u32* start = nullptr;
+  int count = 0;
+  bool isStreamed = false;
+  bool hasStreamed = false;  // Since the last `finish`
+  
+  
+  static bool isLineStart(const u32* pixel) {
+    return (reinterpret_cast<std::uintptr_t>(pixel) & 63) == 0;
+  }
+  
+  
+  void flush() {
+    const bool isWholeLine = count == CAPACITY && isLineStart(start);
+    if (floats != nullptr)
+      quantizeRow(floats, count, start, false, isStreamed && isWholeLine);
+    else
+      quantizeRow(colors, count, start, false, isStreamed && isWholeLine);
+    floats = nullptr;
+    hasStreamed = hasStreamed || (isStreamed && isWholeLine);
+    count = 0;
+  }
+};
+
+
+/** The PixelRowWriter of the calling thread. */
+inline PixelRowWriter& getThreadRowWriter() {
+  thread_local PixelRowWriter writer;
+  return writer;
+}
+
+
+
+#ifdef ENABLE_DOCTEST
+#include <doctest/doctest.h>
+TEST_CASE("color quantization") {
+  // Rounded down and clamped, like setPixel always did.
+  CHECK(quantizeColor({1, 0.5, 0, 1}) == 0xff007fff);
+  CHECK(quantizeColor({2, -1, NAN, 0.2}) == 0x330000ff);
+  CHECK(quantizeColor({0.25, 0.25, 0.25, 0.25}, true) == 0x3f7f7f7f);
+  
+  // Rows of any length give the same pixels as one pixel at a time, also
+  // when they're streamed.
+  alignas(64) u32 pixels[7];
+  Vec4 colors[7];
+  float floats[7 * 4];
+  for (int i = 0; i < 7; i++) {
+    colors[i] = {i / 7.0, 1 - i / 7.0, 0.5, 1};
+    for (int c = 0; c < 4; c++)
+      floats[i * 4 + c] = float(colors[i][c]);
+  }
+  quantizeRow(colors, 7, pixels, false, true);
+  for (int i = 0; i < 7; i++)
+    CHECK(pixels[i] == quantizeColor(colors[i]));
+  quantizeRow(floats, 7, pixels, true);
+  for (int i = 0; i < 7; i++)
+    CHECK(std::abs(int(pixels[i] & 0xff)
+                   - int(quantizeColor(colors[i], true) & 0xff)) <= 1);
+  
+  // The writer writes everything in the order it was given, also the same
+  // pixel twice.
+  alignas(64) u32 row[40] = {};
+  PixelRowWriter writer;
+  for (int x = 0; x < 40; x++)
+    writer.write(&row[x], {1, 0, 0, 1}, true);
+  writer.write(&row[3], {0, 0, 1, 1}, true);
+  writer.write(&row[3], {0, 1, 0, 1}, true);
+  writer.finish();
+  CHECK(row[0] == 0xff0000ff);
+  CHECK(row[39] == 0xff0000ff);
+  CHECK(row[3] == 0xff00ff00);
+  
+  // Float colors are quantized from where they are, also mixed with the
+  // others.
+  float blue[40 * 4];
+  for (int x = 0; x < 40; x++) {
+    const float color[4] = {0, 0, 1, 1};
+    std::copy_n(color, 4, &blue[x * 4]);
+  }
+  for (int x = 0; x < 40; x++) {
+    if (x == 20)
+      writer.write(&row[x], {1, 1, 1, 1}, false);
+    else
+      writer.write(&row[x], &blue[x * 4], true);
+  }
+  writer.finish();
+  CHECK(row[0] == 0xffff0000);
+  CHECK(row[19] == 0xffff0000);
+  CHECK(row[20] == 0xffffffff);
+  CHECK(row[39] == 0xffff0000);
+}
+#endif
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "raytrace.hpp"
+#include "RenderFlags.hpp"
+#include "ViewRays.hpp"
+
+
+// The amount of work (BVH nodes + primitives) that shows up as bright red in
+// the heatmap.
+inline constexpr double HEATMAP_MAX_WORK = 64;
+
+
+// Blue for pixels that take little work, through green and yellow, to red
+// for the pixels that take the most work.
+inline Vec4 heatmapColor(uint work) {
+  double heat = clamp(work / HEATMAP_MAX_WORK, 0, 1);
+  
+  if (heat < 0.5)
+    return lerp(Vec4(0,0,1,1), Vec4(0,1,0,1), heat * 2);
+  return lerp(Vec4(0,1,0,1), Vec4(1,0,0,1), heat * 2 - 1);
+}
+
+
+// Everything that's known about a pixel after it's traced. The distance is
+// used to reproject the pixel into later frames (see Timewarp).
+struct PixelSample {
+  Vec4 color;
+  float distance = Limits<float>::infinity();  // To the nearest hit
+  uint primitive = NO_PRIMITIVE;
+};
+
+
+// A single ray, for one combination of render flags.
+template<uint flags>
+PixelSample traceRay(const DynamicScene& scene, const Ray& ray) {
+  constexpr bool isHeatmap = (flags & RENDER_HEATMAP) != 0;
+  const RayHit hit = findNearestHit<isHeatmap>(scene, ray);
+  
+  PixelSample sample;
+  sample.color = isHeatmap ? heatmapColor(hit.work) : shade(ray, hit);
+  sample.distance = float(hit.distance);
+  sample.primitive = hit.primitive;
+  return sample;
+}
+
+
+// The pixel (x, y), where `ray` is the ray through the pixel's center.
+// Everything in here is decided at compile time.
+template<uint flags>
+PixelSample renderPixel(
+    const DynamicScene& scene, [[maybe_unused]] const ViewRays& view,
+    [[maybe_unused]] int x, [[maybe_unused]] int y,
+    [[maybe_unused]] const Ray& ray
+) {
+  if constexpr ((flags & RENDER_ANTIALIASING) != 0) {
+    // Four rays in a grid inside of the pixel, averaged. The nearest of the
+    // four hits stands in for the whole pixel.
+    PixelSample nearest;
+    Vec4 sum = {0,0,0,0};
+    for (double dy : {-0.25, 0.25}) {
+      for (double dx : {-0.25, 0.25}) {
+        PixelSample sample = traceRay<flags>(scene, view.rayAt(x + dx, y + dy));
+        sum += sample.color;
+        if (sample.distance < nearest.distance)
+          nearest = sample;
+      }
+    }
+    nearest.color = sum / 4;
+    return nearest;
+  } else {
+    return traceRay<flags>(scene, ray);
+  }
+}
@@ -0,0 +1,437 @@
+#pragma once
+
+#include <SDL2/SDL.h>
+#include <algorithm>
+
+#include "TileScheduler.hpp"
+#include "util.hpp"
+
+// Bilinear upscaling of RGBA images with 8 bits per channel, for showing a
+// frame that was traced at a lower resolution on the whole window.
+//
+// The blending is done in fixed point with 7 bits of fraction, so that the
+// differences between pixels (at most 255) times the weights still fit into
+// 16 bits. The SSE2 path blends all four channels of a pixel at once, and the
+// plain path does the same math one channel at a time.
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define FRUIT_UPSCALE_SSE2 1
+#endif
+
+
+// Where a pixel of the target image samples the source image.
+struct UpscaleSample {
+  int index;   // Of the left (or upper) of the two source pixels
+  int weight;  // Of the right (or lower) pixel, from 0 to 128
+};
+
+
+/** Maps `targetSize` pixels onto `sourceSize` pixels, with the pixel centers
+ * lined up. */
+inline List<UpscaleSample> calcUpscaleSamples(int sourceSize, int targetSize) {
+  List<UpscaleSample> samples(targetSize);
+  const double ratio = sourceSize / double(targetSize);
+  
+  for (int i = 0; i < targetSize; i++) {
+    double position = std::max((i + 0.5) * ratio - 0.5, 0.0);
+    int index = std::min(int(position), std::max(sourceSize - 2, 0));
+    int weight = int((position - index) * 128 + 0.5);
+    samples[i] = {index, std::clamp(weight, 0, 128)};
+  }
+  
+  return samples;
+}
+
+
+/** Scales the top left `sourceWidth` by `sourceHeight` pixels of `source` up
+ * to fill `target`. The strides are in pixels. The source must be at least
+ * two pixels wide and high. */
+inline void upscaleBilinear(
+    const u32* source, int sourceWidth, int sourceHeight, int sourceStride,
+    u32* target, int targetWidth, int targetHeight, int targetStride
+) {
+  const List<UpscaleSample> columns =
+      calcUpscaleSamples(sourceWidth, targetWidth);
+  const List<UpscaleSample> rows =
+      calcUpscaleSamples(sourceHeight, targetHeight);
+  
+  for (int y = 0; y < targetHeight; y++) {
+    const u32* upper = source + rows[y].index * sourceStride;
+    const u32* lower = upper + sourceStride;
+    u32* out = target + y * targetStride;
+
+#if FRUIT_UPSCALE_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rowWeight = _mm_set1_epi16(short(rows[y].weight));
+    
+    for (int x = 0; x < targetWidth; x++) {
+      const int i = columns[x].index;
+      
+      // Two neighbouring pixels from both rows, as 16 bits per channel.
+      __m128i top = _mm_unpacklo_epi8(
+          _mm_loadl_epi64(reinterpret_cast<const __m128i*>(upper + i)), zero
+      );
+      __m128i bottom = _mm_unpacklo_epi8(
+          _mm_loadl_epi64(reinterpret_cast<const __m128i*>(lower + i)), zero
+      );
+      
+      // Blend the rows...
+      __m128i difference = _mm_sub_epi16(bottom, top);
+      __m128i column = _mm_add_epi16(top, _mm_srai_epi16(
+          _mm_mullo_epi16(difference, rowWeight), 7
+      ));
+      
+      // ...and then the left and right pixel.
+      __m128i right = _mm_unpackhi_epi64(column, column);
+      __m128i columnWeight = _mm_set1_epi16(short(columns[x].weight));
+      __m128i pixel = _mm_add_epi16(column, _mm_srai_epi16(
+          _mm_mullo_epi16(_mm_sub_epi16(right, column), columnWeight), 7
+      ));
+      
+      out[x] = u32(_mm_cvtsi128_si32(_mm_packus_epi16(pixel, pixel)));
+    }
+#else
+    const int rowWeight = rows[y].weight;
+    
+    for (int x = 0; x < targetWidth; x++) {
+      const int i = columns[x].index;
+      const int columnWeight = columns[x].weight;
+      const u8* topLeft = reinterpret_cast<const u8*>(upper + i);
+      const u8* bottomLeft = reinterpret_cast<const u8*>(lower + i);
+      u8* pixel = reinterpret_cast<u8*>(out + x);
+      
+      for (int c = 0; c < 4; c++) {
+        int left = topLeft[c]
+                   + (((bottomLeft[c] - topLeft[c]) * rowWeight) >> 7);
+        int right = topLeft[c + 4]
+                    + (((bottomLeft[c + 4] - topLeft[c + 4]) * rowWeight) >> 7);
+        pixel[c] = u8(left + (((right - left) * columnWeight) >> 7));
+      }
+    }
+#endif
+  }
+}
+
+
+/** Fills in a tile of which only the lines that forEachSparseLine goes over
+ * were traced (both the rows and the columns). The colors are blended
+ * between the four nearest traced pixels, the distances and primitives are
+ * taken from the nearest one. The stride is in pixels. */
+inline void fillSparseTile(
+    u32* pixels, float* distances, u32* primitives, int stride,
+    const Tile& tile, int step
+) {
+  if (step <= 1)
+    return;
+  
+  // The traced line before (or at) every line, and the weight of the one
+  // after it.
+  auto calcSamples = [step](int size) {
+    List<UpscaleSample> samples(size);
+    for (int i = 0; i < size; i++) {
+      int before = i / step * step;
+      int after = std::min(before + step, size - 1);
+      int weight = after == before ? 0 : (i - before) * 128 / (after - before);
+      samples[i] = {before, weight};
+    }
+    return samples;
+  };
+  const List<UpscaleSample> columns = calcSamples(tile.width);
+  const List<UpscaleSample> rows = calcSamples(tile.height);
+  auto next = [step](int before, int size) {
+    return std::min(before + step, size - 1);
+  };
+  
+  for (int y = 0; y < tile.height; y++) {
+    const UpscaleSample row = rows[y];
+    const int upper = (tile.y + row.index) * stride + tile.x;
+    const int lower = (tile.y + next(row.index, tile.height)) * stride + tile.x;
+    const int out = (tile.y + y) * stride + tile.x;
+    
+    for (int x = 0; x < tile.width; x++) {
+      const UpscaleSample column = columns[x];
+      if (row.weight == 0 && column.weight == 0)
+        continue;  // Traced
+      
+      const int left = column.index;
+      const int right = next(column.index, tile.width);
+      const u8* topLeft = reinterpret_cast<const u8*>(pixels + upper + left);
+      const u8* topRight = reinterpret_cast<const u8*>(pixels + upper + right);
+      const u8* bottomLeft = reinterpret_cast<const u8*>(pixels + lower + left);
+      const u8* bottomRight =
+          reinterpret_cast<const u8*>(pixels + lower + right);
+      u8* pixel = reinterpret_cast<u8*>(pixels + out + x);
+      
+      for (int c = 0; c < 4; c++) {
+        int l = topLeft[c] + (((bottomLeft[c] - topLeft[c]) * row.weight) >> 7);
+        int r = topRight[c]
+                + (((bottomRight[c] - topRight[c]) * row.weight) >> 7);
+        pixel[c] = u8(l + (((r - l) * column.weight) >> 7));
+      }
+      
+      const int nearestRow = row.weight < 64 ? upper : lower;
+      const int nearestColumn = column.weight < 64 ? left : right;
+      distances[out + x] = distances[nearestRow + nearestColumn];
+      primitives[out + x] = primitives[nearestRow + nearestColumn];
+    }
+  }
+}
+
+
+/** Fills in the pixels of a tile that checkerboard rendering didn't trace
+ * (those where (x + y) & 1 isn't `parity`). A pixel is shaded like the hit
+ * of the previous frame that lands on it, if that hit is of the same
+ * primitive as one of the neighbouring pixels. Otherwise it's shaded like its
+ * neighbours if they all hit the same thing (or all missed, at an infinite
+ * distance), and blended from them if they don't. Only the neighbours in the
+ * same tile are used, because the other tiles may not be traced yet.
+ *
+ * `findLanding(x, y, primitive, distance)` looks for the hit that lands on
+ * the pixel (x, y), `shade(x, y, primitive, distance)` sets the color of the
+ * pixel and `trace(x, y)` traces a pixel without any neighbours. The stride
+ * is in pixels. */
+template<class FindLanding, class Shade, class Trace>
+void fillCheckerboardTile(
+    u32* pixels, float* distances, u32* primitives, int stride,
+    const Tile& tile, int parity,
+    FindLanding findLanding, Shade shade, Trace trace
+) {
+  const int right = tile.x + tile.width;
+  const int bottom = tile.y + tile.height;
+  
+  for (int y = tile.y; y < bottom; y++) {
+    for (int x = tile.x; x < right; x++) {
+      if (((x + y) & 1) == parity)
+        continue;  // Traced
+      
+      int neighbours[4];
+      int count = 0;
+      if (x > tile.x)
+        neighbours[count++] = y * stride + x - 1;
+      if (x + 1 < right)
+        neighbours[count++] = y * stride + x + 1;
+      if (y > tile.y)
+        neighbours[count++] = (y - 1) * stride + x;
+      if (y + 1 < bottom)
+        neighbours[count++] = (y + 1) * stride + x;
+      
+      if (count == 0) {
+        trace(x, y);
+        continue;
+      }
+      
+      u32 primitive = primitives[neighbours[0]];
+      bool isUniform = true;
+      double distance = 0;
+      for (int n = 0; n < count; n++) {
+        isUniform = isUniform && primitives[neighbours[n]] == primitive;
+        distance += distances[neighbours[n]];
+      }
+      distance /= count;
+      
+      u32 landedPrimitive = 0;
+      float landedDistance = 0;
+      bool isReused = findLanding(x, y, landedPrimitive, landedDistance);
+      if (isReused) {
+        isReused = false;
+        for (int n = 0; n < count; n++)
+          isReused = isReused || primitives[neighbours[n]] == landedPrimitive;
+      }
+      
+      const int i = y * stride + x;
+      if (isReused) {
+        primitive = landedPrimitive;
+        distances[i] = landedDistance;
+        shade(x, y, primitive, double(landedDistance));
+      } else if (isUniform) {
+        distances[i] = float(distance);
+        shade(x, y, primitive, distance);
+      } else {
+        // An edge: The colors are averaged, the rest is taken from the
+        // nearest neighbour.
+        int sum[4] = {};
+        int nearest = neighbours[0];
+        for (int n = 0; n < count; n++) {
+          const u8* color = reinterpret_cast<const u8*>(&pixels[neighbours[n]]);
+          for (int c = 0; c < 4; c++)
+            sum[c] += color[c];
+          if (distances[neighbours[n]] < distances[nearest])
+            nearest = neighbours[n];
+        }
+        
+        u8* pixel = reinterpret_cast<u8*>(&pixels[i]);
+        for (int c = 0; c < 4; c++)
+          pixel[c] = u8(sum[c] / count);
+        primitive = primitives[nearest];
+        distances[i] = distances[nearest];
+      }
+      primitives[i] = primitive;
+    }
+  }
+}
+
+
+// Keeps a window-sized surface around to upscale frames into.
+class Upscaler {
+public:
+  ~Upscaler() {
+    SDL_FreeSurface(surface);
+  }
+  
+  
+  /** Upscales the top left `width` by `height` pixels of `source` (an RGBA32
+   * surface) to `targetWidth` by `targetHeight` pixels. */
+  SDL_Surface* upscale(
+      SDL_Surface* source, int width, int height,
+      int targetWidth, int targetHeight
+  ) {
+    allocate(targetWidth, targetHeight);
+    upscaleBilinear(
+        reinterpret_cast<const u32*>(source->pixels), width, height,
+        source->pitch / 4, pixels.get(), targetWidth, targetHeight, targetWidth
+    );
+    return surface;
+  }
+
+
+private:
+  SDL_Surface* surface = nullptr;
+  Unique<u32[]> pixels;
+  
+  
+  void allocate(int width, int height) {
+    if (surface != nullptr && surface->w == width && surface->h == height)
+      return;
+    
+    SDL_FreeSurface(surface);
+    pixels.reset(new u32[width * height]);
+    surface = SDL_CreateRGBSurfaceWithFormatFrom(
+        pixels.get(), width, height, 32, width * 4, SDL_PIXELFORMAT_RGBA32
+    );
+    
+    if (surface == nullptr)
+      THROW("Failed to create a canvas: " + String(SDL_GetError()));
+  }
+};
+
+
+
+#ifdef ENABLE_DOCTEST
+#include <doctest/doctest.h>
+TEST_CASE("bilinear upscaling") {
+  // Black on the left and white on the right, with a bit of red.
+  const u32 black = 0xff000010;
+  const u32 white = 0xffffffff;
+  u32 source[] = {black, white, black, white};
+  u32 target[4 * 2];
+  
+  upscaleBilinear(source, 2, 2, 2, target, 4, 2, 4);
+  
+  // The outer pixels keep their color, the ones in between are mixed.
+  CHECK(target[0] == black);
+  CHECK(target[3] == white);
+  CHECK(target[4] == black);
+  
+  const u8* mixed = reinterpret_cast<const u8*>(&target[1]);
+  CHECK(mixed[0] == 0x10 + (0xef * 32 >> 7));
+  CHECK(mixed[1] == (0xff * 32 >> 7));
+  CHECK(mixed[3] == 0xff);
+}
+
+
+TEST_CASE("filling sparse tiles") {
+  // A 6x1 tile in a row of 8, of which 1, 5 and 6 were traced (step 4).
+  u32 pixels[8] = {7, 0, 7, 7, 7, 128, 50, 7};
+  float distances[8] = {0, 1, 0, 0, 0, 5, 6, 0};
+  u32 primitives[8] = {0, 1, 0, 0, 0, 5, 6, 0};
+  fillSparseTile(pixels, distances, primitives, 8, {1, 0, 6, 1}, 4);
+  
+  // The pixels in between are blended, the rest stays the same.
+  CHECK(pixels[2] == 32);
+  CHECK(pixels[3] == 64);
+  CHECK(pixels[4] == 96);
+  CHECK(pixels[5] == 128);
+  CHECK(pixels[6] == 50);
+  CHECK(pixels[0] == 7);
+  CHECK(pixels[7] == 7);
+  CHECK(distances[2] == 1);
+  CHECK(distances[4] == 5);
+  CHECK(primitives[4] == 5);
+}
+
+
+TEST_CASE("filling checkerboard tiles") {
+  struct Shaded {
+    int x, y;
+    u32 primitive;
+    double distance;
+  };
+  List<Shaded> shaded;
+  int traced = 0;
+  auto shade = [&](int x, int y, u32 primitive, double distance) {
+    shaded.push_back({x, y, primitive, distance});
+  };
+  auto trace = [&](int, int) { traced++; };
+  
+  // A 3x3 tile where the corners and the middle were traced. The previous
+  // frame has hits that land on (0, 1), of a neighbouring primitive, and on
+  // (2, 1), of a primitive that isn't around.
+  const u32 X = 0;
+  u32 pixels[9] = {0x10, X, 0x40, X, 0x70, X, 0x20, X, 0x20};
+  float distances[9] = {4, 0, 2, 0, 3, 0, 3, 0, 4};
+  u32 primitives[9] = {1, X, 2, X, 2, X, 2, X, 2};
+  auto findLanding = [](int x, int y, u32& primitive, float& distance) {
+    if (y != 1 || x == 1)
+      return false;
+    primitive = x == 0 ? 1 : 9;
+    distance = 5;
+    return true;
+  };
+  fillCheckerboardTile(pixels, distances, primitives, 3, {0, 0, 3, 3}, 0,
+                       findLanding, shade, trace);
+  
+  // (1, 0) is on an edge between primitive 1 and 2, so it's blended and
+  // gets the distance and primitive of the nearest neighbour.
+  CHECK(pixels[1] == (0x10 + 0x40 + 0x70) / 3);
+  CHECK(primitives[1] == 2);
+  CHECK(distances[1] == 2);
+  
+  // (0, 1) reuses the hit that landed on it, and (2, 1) and (1, 2) are
+  // shaded like their neighbours.
+  REQUIRE(shaded.size() == 3);
+  CHECK(shaded[0].x == 0);
+  CHECK(shaded[0].primitive == 1);
+  CHECK(shaded[0].distance == 5);
+  CHECK(distances[3] == 5);
+  CHECK(shaded[1].x == 2);
+  CHECK(shaded[1].primitive == 2);
+  CHECK(shaded[1].distance == 3);
+  CHECK(primitives[5] == 2);
+  CHECK(shaded[2].y == 2);
+  CHECK(std::abs(shaded[2].distance - 10 / 3.0) < 0.0001);
+  CHECK(traced == 0);
+  
+  // A tile that's one pixel wide, where the pixels above and below missed.
+  // The one in between misses too.
+  shaded.clear();
+  const u32 sky = maxOf<uint>;
+  const float far = Limits<float>::infinity();
+  float column[3] = {far, 0, far};
+  u32 columnPrimitives[3] = {sky, X, sky};
+  auto findNothing = [](int, int, u32&, float&) { return false; };
+  fillCheckerboardTile(pixels, column, columnPrimitives, 1, {0, 0, 1, 3}, 0,
+                       findNothing, shade, trace);
+  REQUIRE(shaded.size() == 1);
+  CHECK(shaded[0].y == 1);
+  CHECK(shaded[0].primitive == sky);
+  CHECK(column[1] == far);
+  CHECK(columnPrimitives[1] == sky);
+  
+  // A pixel without any neighbours is traced.
+  fillCheckerboardTile(pixels, column, columnPrimitives, 1, {0, 1, 1, 1}, 0,
+                       findNothing, shade, trace);
+  CHECK(traced == 1);
+  CHECK(shaded.size() == 1);
+}
+#endif
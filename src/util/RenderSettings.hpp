@@ -0,0 +1,130 @@
+#pragma once
+
+#include <cstdlib>
+
+#include "typedefs.hpp"
+#include "Exception.hpp"
+
+
+// Options for how frames are traced and shown. They work with and without
+// threads.
+//
+// Like the ThreadSettings, they come from environment variables, which can be
+// overridden by command line flags:
+//   RAYTRACER_FRAME_QUEUE=0  or  --frame-queue=0  (0 or 1, see FramePipeline)
+//   RAYTRACER_LATE_LATCH=1   or  --late-latch=1   (0 or 1, see MouseLatch)
+//   RAYTRACER_TIMEWARP=1     or  --timewarp=1     (0 or 1, see Timewarp)
+//   RAYTRACER_FOVEATION=4    or  --foveation=4    (0 is off, see Foveation)
+//   RAYTRACER_AA_SAMPLES=16  or  --aa-samples=16  (4 to 64, see EdgeAntialiaser)
+
+
+struct RenderSettings {
+  uint frameQueueDepth = 1;  // Frames traced ahead of the screen
+  bool isLateLatched = false;  // The tracer reads the mouse, not update()
+  bool isTimewarped = false;  // Late frames are covered up by warping
+  double foveationFalloff = 0;  // 0: no foveated rendering at the start
+  uint edgeAaSamples = 16;  // The most rays per pixel on edges
+};
+
+
+inline RenderSettings renderSettings;
+
+
+
+//### Parsing ###
+
+inline uint parseFrameQueueDepth(String$& text) {
+  if (text == "0" || text == "1")
+    return text[0] - '0';
+  THROW("Invalid frame queue depth \"" + text + "\". Use 0 or 1.");
+  return 1;
+}
+
+
+inline double parseFoveationFalloff(String$& text) {
+  char* end = nullptr;
+  double falloff = std::strtod(text.c_str(), &end);
+  if (text.empty() || *end != '\0' || !(falloff >= 0 && falloff <= 100))
+    THROW("Invalid foveation falloff \"" + text + "\". Use 0 to 100.");
+  return falloff;
+}
+
+
+inline uint parseEdgeAaSamples(String$& text) {
+  char* end = nullptr;
+  long samples = std::strtol(text.c_str(), &end, 10);
+  if (text.empty() || *end != '\0' || samples < 4 || samples > 64)
+    THROW("Invalid number of antialiasing samples \"" + text
+          + "\". Use 4 to 64.");
+  return uint(samples);
+}
+
+
+inline bool parseSwitch(String$& text) {
+  if (text == "0" || text == "off")
+    return false;
+  if (text == "1" || text == "on")
+    return true;
+  THROW("Invalid switch \"" + text + "\". Use 0 or 1.");
+  return false;
+}
+
+
+/** Reads the render settings from the environment and the command line.
+ * Arguments that aren't about rendering are ignored. */
+inline RenderSettings readRenderSettings(int argumentCount, char** arguments) {
+  RenderSettings settings;
+  
+  if (const char* depth = std::getenv("RAYTRACER_FRAME_QUEUE"))
+    settings.frameQueueDepth = parseFrameQueueDepth(depth);
+  if (const char* latch = std::getenv("RAYTRACER_LATE_LATCH"))
+    settings.isLateLatched = parseSwitch(latch);
+  if (const char* timewarp = std::getenv("RAYTRACER_TIMEWARP"))
+    settings.isTimewarped = parseSwitch(timewarp);
+  if (const char* foveation = std::getenv("RAYTRACER_FOVEATION"))
+    settings.foveationFalloff = parseFoveationFalloff(foveation);
+  if (const char* samples = std::getenv("RAYTRACER_AA_SAMPLES"))
+    settings.edgeAaSamples = parseEdgeAaSamples(samples);
+  
+  for (int i = 1; i < argumentCount; i++) {
+    String argument = arguments[i];
+    
+    if (argument.rfind("--frame-queue=", 0) == 0)
+      settings.frameQueueDepth = parseFrameQueueDepth(argument.substr(14));
+    else if (argument.rfind("--late-latch=", 0) == 0)
+      settings.isLateLatched = parseSwitch(argument.substr(13));
+    else if (argument.rfind("--timewarp=", 0) == 0)
+      settings.isTimewarped = parseSwitch(argument.substr(11));
+    else if (argument.rfind("--foveation=", 0) == 0)
+      settings.foveationFalloff = parseFoveationFalloff(argument.substr(12));
+    else if (argument.rfind("--aa-samples=", 0) == 0)
+      settings.edgeAaSamples = parseEdgeAaSamples(argument.substr(13));
+  }
+  
+  return settings;
+}
+
+
+
+#ifdef ENABLE_DOCTEST
+#include <doctest/doctest.h>
+TEST_CASE("render settings") {
+  char program[] = "raytracer_4d";
+  char threads[] = "--threads=3";
+  char queue[] = "--frame-queue=0";
+  char latch[] = "--late-latch=1";
+  char* arguments[] = {program, threads, queue, latch};
+  
+  RenderSettings settings = readRenderSettings(4, arguments);
+  CHECK(settings.frameQueueDepth == 0);
+  CHECK(settings.isLateLatched);
+  CHECK(!settings.isTimewarped);
+  
+  CHECK_THROWS(parseFrameQueueDepth("2"));
+  CHECK_THROWS(parseSwitch("maybe"));
+  CHECK(parseFoveationFalloff("2.5") == 2.5);
+  CHECK_THROWS(parseFoveationFalloff("-1"));
+  CHECK(parseEdgeAaSamples("32") == 32);
+  CHECK_THROWS(parseEdgeAaSamples("2"));
+}
+#endif
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+
+#include "typedefs.hpp"
+
+
+// Versioned, read-only snapshots of some data, for one writer and a few
+// readers on other threads.
+//
+// The writer never changes a snapshot that was published. Instead it copies
+// the latest snapshot, changes the copy and publishes that (copy-on-write).
+// Readers hold on to a snapshot while they use it, without any locks, so they
+// can keep reading an old version while the writer makes the next one.
+//
+// Old snapshots are reclaimed the way RCU does it: Every published version
+// bumps an epoch counter, and every reader announces the epoch in which it
+// started reading. An old snapshot is deleted once all readers that might
+// still have it are done.
+//
+// Every thread that reads needs its own reader slot (0 to maxReaders - 1).
+template<class T, uint maxReaders = 4>
+class SnapshotStore {
+public:
+  // A snapshot that can't be reclaimed until this is destroyed.
+  class Reader {
+  public:
+    Reader(const T* snapshot, std::atomic<u64>* slot)
+        : snapshot(snapshot), slot(slot) {}
+    
+    Reader(Reader&& other) noexcept
+        : snapshot(other.snapshot), slot(other.slot) {
+      other.slot = nullptr;
+    }
+    
+    Reader(const Reader&) = delete;
+    Reader& operator = (const Reader&) = delete;
+    
+    ~Reader() {
+      if (slot != nullptr)
+        slot->store(IDLE, std::memory_order_release);
+    }
+    
+    const T& operator * () const { return *snapshot; }
+    const T* operator -> () const { return snapshot; }
+  
+  private:
+    const T* snapshot;
+    std::atomic<u64>* slot;
+  };
+  
+  
+  explicit SnapshotStore(Unique<const T> first = make_unique<const T>())
+      : current(first.release()) {
+    for (std::atomic<u64>& slot : readerEpochs)
+      slot.store(IDLE);
+  }
+  
+  
+  ~SnapshotStore() {
+    delete current.load();
+  }
+  
+  
+  /** Starts reading the latest snapshot. Only one Reader per slot can exist
+   * at a time. */
+  Reader read(uint readerSlot) {
+    std::atomic<u64>& slot = readerEpochs[readerSlot];
+    // The epoch must be announced before the snapshot is loaded, so that
+    // the writer can't miss this reader (hence seq_cst).
+    slot.store(epoch.load());
+    return Reader(current.load(), &slot);
+  }
+  
+  
+  /** The latest snapshot. Only for the writer, which is the only one that
+   * can make it old. */
+  const T& getLatest() const {
+    return *current.load(std::memory_order_relaxed);
+  }
+  
+  
+  /** Makes `next` the latest snapshot. Only for the writer. */
+  void publish(Unique<const T> next) {
+    const T* previous = current.exchange(next.release());
+    // Readers that announced this epoch (or an older one) may be holding
+    // the previous snapshot.
+    u64 retiredAt = epoch.fetch_add(1);
+    retired.push_back({retiredAt, Unique<const T>(previous)});
+    reclaim();
+  }
+  
+  
+  /** Deletes the old snapshots that no reader can be holding anymore. */
+  void reclaim() {
+    u64 oldestReader = IDLE;
+    for (std::atomic<u64>& slot : readerEpochs)
+      oldestReader = std::min(oldestReader, slot.load());
+    
+    List<Retired> stillUsed;
+    for (Retired& old : retired)
+      if (old.epoch >= oldestReader)
+        stillUsed.push_back(std::move(old));
+    retired = std::move(stillUsed);
+  }
+  
+  
+  uint getRetiredCount() const {
+    return retired.size();
+  }
+
+
+private:
+  static constexpr u64 IDLE = maxOf<u64>;
+  
+  struct Retired {
+    u64 epoch;
+    Unique<const T> snapshot;
+  };
+  
+  std::atomic<const T*> current;
+  std::atomic<u64> epoch = 0;
+  std::atomic<u64> readerEpochs[maxReaders];
+  List<Retired> retired;  // Only touched by the writer
+};
+
+
+
+#ifdef ENABLE_DOCTEST
+#include <doctest/doctest.h>
+TEST_CASE("snapshot store") {
+  SnapshotStore<int> store(make_unique<const int>(1));
+  
+  {
+    // A reader keeps its version while newer ones are published.
+    auto reader = store.read(0);
+    store.publish(make_unique<const int>(2));
+    store.publish(make_unique<const int>(3));
+    CHECK(*reader == 1);
+    CHECK(store.getLatest() == 3);
+    CHECK(store.getRetiredCount() == 2);
+    
+    // A reader that starts later sees the latest version.
+    auto laterReader = store.read(1);
+    CHECK(*laterReader == 3);
+  }
+  
+  // Once nobody reads them anymore, the old versions are reclaimed.
+  store.reclaim();
+  CHECK(store.getRetiredCount() == 0);
+  CHECK(*store.read(0) == 3);
+}
+#endif
@@ -0,0 +1,247 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <set>
+#include <thread>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "typedefs.hpp"
+#include "Exception.hpp"
+
+
+// How many worker threads the renderer uses and where they're allowed to run.
+//
+// The settings come from environment variables, which can be overridden by
+// command line flags:
+//   RAYTRACER_THREADS=8   or  --threads=8      (0 means "pick for me")
+//   RAYTRACER_PIN=cores   or  --pin=cores      (none, cores or numa)
+//
+// `cores` pins every worker to a different physical core, so that two workers
+// never fight over the two hyperthreads of one core. `numa` spreads the
+// workers over the NUMA nodes and lets each one run on any core of its node.
+// Pinning only works on Linux; elsewhere it's ignored. The other options are
+// in RenderSettings.hpp.
+
+
+enum class PinMode {
+  NONE,
+  CORES,
+  NUMA,
+};
+
+
+struct ThreadSettings {
+  uint threadCount = 0;  // 0: one thread per core (see calcThreadCount)
+  PinMode pinMode = PinMode::NONE;
+  
+  
+  uint calcThreadCount() const;
+};
+
+
+inline ThreadSettings threadSettings;
+
+
+
+//### Parsing ###
+
+inline PinMode parsePinMode(String$& text) {
+  if (text == "none")
+    return PinMode::NONE;
+  if (text == "cores")
+    return PinMode::CORES;
+  if (text == "numa")
+    return PinMode::NUMA;
+  THROW("Unknown pin mode \"" + text + "\". Use none, cores or numa.");
+  return PinMode::NONE;
+}
+
+
+inline uint parseThreadCount(String$& text) {
+  char* end = nullptr;
+  long count = std::strtol(text.c_str(), &end, 10);
+  if (text.empty() || *end != '\0' || count < 0 || count > 1024)
+    THROW("Invalid thread count \"" + text + "\"");
+  return uint(std::max(count, 0L));
+}
+
+
+/** Reads the thread settings from the environment and the command line.
+ * Arguments that aren't about threads are ignored. */
+inline ThreadSettings readThreadSettings(int argumentCount, char** arguments) {
+  ThreadSettings settings;
+  
+  if (const char* threads = std::getenv("RAYTRACER_THREADS"))
+    settings.threadCount = parseThreadCount(threads);
+  if (const char* pin = std::getenv("RAYTRACER_PIN"))
+    settings.pinMode = parsePinMode(pin);
+  
+  for (int i = 1; i < argumentCount; i++) {
+    String argument = arguments[i];
+    
+    if (argument.rfind("--threads=", 0) == 0)
+      settings.threadCount = parseThreadCount(argument.substr(10));
+    else if (argument.rfind("--pin=", 0) == 0)
+      settings.pinMode = parsePinMode(argument.substr(6));
+  }
+  
+  return settings;
+}
+
+
+/** Parses a Linux CPU list like "0-3,8,10-11". */
+inline List<uint> parseCpuList(String$& text) {
+  List<uint> cpus;
+  size_t start = 0;
+  
+  while (start < text.size()) {
+    size_t end = text.find(',', start);
+    if (end == String::npos)
+      end = text.size();
+    
+    String range = text.substr(start, end - start);
+    size_t dash = range.find('-');
+    if (!range.empty() && range.find_first_not_of(" \n") != String::npos) {
+      uint first = std::stoul(range.substr(0, dash));
+      uint last = first;
+      if (dash != String::npos)
+        last = std::stoul(range.substr(dash + 1));
+      for (uint cpu = first; cpu <= last; cpu++)
+        cpus.push_back(cpu);
+    }
+    
+    start = end + 1;
+  }
+  
+  return cpus;
+}
+
+
+
+//### Topology ###
+
+inline String readSmallFile(String$& path) {
+  std::ifstream file(path);
+  String text;
+  std::getline(file, text);
+  return text;
+}
+
+
+/** One logical CPU per physical core, so no two of them are hyperthreads of
+ * the same core. Empty if the topology can't be read. */
+inline List<uint> findPhysicalCores() {
+  List<uint> cores;
+  std::set<std::pair<String, String>> seen;  // (package, core)
+  
+  String online = readSmallFile("/sys/devices/system/cpu/online");
+  
+  for (uint cpu : parseCpuList(online)) {
+    String topology = "/sys/devices/system/cpu/cpu" + $(cpu) + "/topology/";
+    String package = readSmallFile(topology + "physical_package_id");
+    String core = readSmallFile(topology + "core_id");
+    
+    if (seen.insert({package, core}).second)
+      cores.push_back(cpu);
+  }
+  
+  return cores;
+}
+
+
+/** The CPUs of every NUMA node. Empty if the topology can't be read. */
+inline List<List<uint>> findNumaNodes() {
+  List<List<uint>> nodes;
+  String online = readSmallFile("/sys/devices/system/node/online");
+  
+  for (uint node : parseCpuList(online)) {
+    String path = "/sys/devices/system/node/node" + $(node) + "/cpulist";
+    List<uint> cpus = parseCpuList(readSmallFile(path));
+    if (!cpus.empty())
+      nodes.push_back(cpus);
+  }
+  
+  return nodes;
+}
+
+
+inline uint ThreadSettings::calcThreadCount() const {
+  if (threadCount != 0)
+    return threadCount;
+  
+  // Hyperthreads don't help much when all threads are pinned to cores.
+  if (pinMode == PinMode::CORES) {
+    uint cores = findPhysicalCores().size();
+    if (cores != 0)
+      return cores;
+  }
+  
+  return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+
+
+//### Pinning ###
+
+/** Restricts the calling thread to the given CPUs. */
+inline void pinCurrentThread(const List<uint>& cpus) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (uint cpu : cpus)
+    if (cpu < CPU_SETSIZE)
+      CPU_SET(cpu, &set);
+  
+  // On Linux, pid 0 means the calling thread.
+  if (sched_setaffinity(0, sizeof(set), &set) != 0)
+    fprintf(stderr, "Couldn't pin a worker thread to its CPUs.\n");
+#else
+  (void) cpus;
+#endif
+}
+
+
+/** Pins the calling worker thread according to the settings. Call this at the
+ * start of worker number `workerIndex`. */
+inline void pinWorkerThread(const ThreadSettings& settings, uint workerIndex) {
+  if (settings.pinMode == PinMode::CORES) {
+    static const List<uint> cores = findPhysicalCores();
+    if (!cores.empty())
+      pinCurrentThread({cores[workerIndex % cores.size()]});
+  } else if (settings.pinMode == PinMode::NUMA) {
+    static const List<List<uint>> nodes = findNumaNodes();
+    if (!nodes.empty())
+      pinCurrentThread(nodes[workerIndex % nodes.size()]);
+  }
+}
+
+
+
+#ifdef ENABLE_DOCTEST
+#include <doctest/doctest.h>
+TEST_CASE("thread settings") {
+  CHECK(parseCpuList("0-3,8,10-11\n") == List<uint>{0, 1, 2, 3, 8, 10, 11});
+  CHECK(parseCpuList("").empty());
+  
+  char program[] = "raytracer_4d";
+  char threads[] = "--threads=3";
+  char pin[] = "--pin=numa";
+  char other[] = "--something-else";
+  char queue[] = "--frame-queue=0";
+  char* arguments[] = {program, threads, other, pin, queue};
+  
+  ThreadSettings settings = readThreadSettings(5, arguments);
+  CHECK(settings.threadCount == 3);
+  CHECK(settings.pinMode == PinMode::NUMA);
+  CHECK(settings.calcThreadCount() == 3);
+  
+  CHECK_THROWS(parsePinMode("sideways"));
+  CHECK_THROWS(parseThreadCount("many"));
+}
+#endif
@@ -1,15 +1,19 @@
 // Copyright (c) 2020 Robert Vaser
 // Combination of ThreadPool implementation by progschj and
 //   task stealing by Sean Parent
+//   Modified to use lock-free Chase-Lev work-stealing deques
 
 #ifndef THREAD_POOL_THREAD_POOL_HPP_
 #define THREAD_POOL_THREAD_POOL_HPP_
 
 #include <algorithm>
 #include <atomic>
+#include <condition_variable>
+#include <cstdint>
 #include <functional>
 #include <future>  // NOLINT
 #include <memory>
+#include <mutex>
 #include <queue>
 #include <thread>  // NOLINT
 #include <unordered_map>
@@ -18,153 +22,723 @@
 
 namespace thread_pool {
 
+// The pool runs these. Tasks are intrusive so that the deques only have to
+// move pointers around.
+struct Task {
+  void (*run)(Task*) = nullptr;
+};
+
+// A lock-free work-stealing deque for one worker (Chase & Lev, "Dynamic
+// Circular Work-Stealing Deque", with the memory orders from Lê et al.,
+// "Correct and Efficient Work-Stealing for Weak Memory Models").
+//
+// Only the owner calls Push and Pop, which work on the bottom end (LIFO, so
+// the owner continues with the task it pushed last, which is still in its
+// caches). Any thread can call Steal, which takes from the top (FIFO, so
+// thieves take the oldest tasks).
+class WorkStealingDeque {
+public:
+  explicit WorkStealingDeque(std::int64_t capacity = 256)
+      : top_(0),
+        bottom_(0),
+        array_(new Array(capacity)) {
+    arrays_.emplace_back(array_.load(std::memory_order_relaxed));
+  }
+
+  WorkStealingDeque(const WorkStealingDeque&) = delete;
+  WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+  void Push(Task* task) {
+    std::int64_t b = bottom_.load(std::memory_order_relaxed);
+    std::int64_t t = top_.load(std::memory_order_acquire);
+    Array* a = array_.load(std::memory_order_relaxed);
+    if (b - t > a->capacity - 1) {
+      a = Grow(a, t, b);
+    }
+    a->Put(b, task);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom_.store(b + 1, std::memory_order_relaxed);
+  }
+
+  Task* Pop() {
+    std::int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+    Array* a = array_.load(std::memory_order_relaxed);
+    bottom_.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    std::int64_t t = top_.load(std::memory_order_relaxed);
+
+    if (t > b) {  // Empty
+      bottom_.store(b + 1, std::memory_order_relaxed);
+      return nullptr;
+    }
+
+    Task* task = a->Get(b);
+    if (t == b) {
+      // The last task. A thief might be trying to take it too.
+      if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                        std::memory_order_relaxed)) {
+        task = nullptr;
+      }
+      bottom_.store(b + 1, std::memory_order_relaxed);
+    }
+    return task;
+  }
+
+  Task* Steal() {
+    std::int64_t t = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    std::int64_t b = bottom_.load(std::memory_order_acquire);
+
+    if (t >= b) {  // Empty
+      return nullptr;
+    }
+
+    Task* task = array_.load(std::memory_order_acquire)->Get(t);
+    if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed)) {
+      return nullptr;  // Another thread took it first.
+    }
+    return task;
+  }
+
+private:
+  struct Array {
+    explicit Array(std::int64_t capacity)
+        : capacity(capacity),
+          slots(new std::atomic<Task*>[capacity]) {}
+
+    Task* Get(std::int64_t i) const {
+      return slots[i & (capacity - 1)].load(std::memory_order_relaxed);
+    }
+
+    void Put(std::int64_t i, Task* task) {
+      slots[i & (capacity - 1)].store(task, std::memory_order_relaxed);
+    }
+
+    std::int64_t capacity;  // Always a power of two
+    std::unique_ptr<std::atomic<Task*>[]> slots;
+  };
+
+  // Thieves might still be reading from the old array, so the old arrays are
+  // only deleted together with the deque.
+  Array* Grow(Array* old_array, std::int64_t t, std::int64_t b) {
+    Array* new_array = new Array(old_array->capacity * 2);
+    for (std::int64_t i = t; i != b; ++i) {
+      new_array->Put(i, old_array->Get(i));
+    }
+    arrays_.emplace_back(new_array);
+    array_.store(new_array, std::memory_order_release);
+    return new_array;
+  }
+
+  alignas(64) std::atomic<std::int64_t> top_;
+  alignas(64) std::atomic<std::int64_t> bottom_;
+  std::atomic<Array*> array_;
+  std::vector<std::unique_ptr<Array>> arrays_;
+};
+
+
+// Tasks of a higher priority always go first. Workers only pick a background
+// task when there's no frame work anywhere, and they check again after every
+// task, so a background job that consists of many small tasks can be
+// interrupted by a frame at any task boundary.
+enum class Priority {
+  kFrame,
+  kBackground,
+};
+
+
 class ThreadPool {
 public:
+  // `on_thread_start` is called by every worker before it runs any tasks,
+  // with the index of the worker. That's the place for things like pinning
+  // the worker to a core.
   explicit ThreadPool(
-      std::size_t num_threads = std::thread::hardware_concurrency())
+      std::size_t num_threads = std::thread::hardware_concurrency(),
+      std::function<void(std::size_t)> on_thread_start = nullptr)
       : threads_(),
         thread_map_(),
-        queues_(std::max<std::size_t>(1UL, num_threads)),
-        task_id_(0) {
-    for (std::size_t i = 0; i != queues_.size(); ++i) {
+        num_workers_(std::max<std::size_t>(1UL, num_threads)),
+        on_thread_start_(std::move(on_thread_start)) {
+    for (Lane& lane : lanes_) {
+      lane.deques = std::vector<WorkStealingDeque>(num_workers_);
+    }
+    for (std::size_t i = 0; i != num_workers_; ++i) {
       threads_.emplace_back([this, i] () -> void { Task(i); });
       thread_map_.emplace(threads_.back().get_id(), i);
     }
   }
-  
+
   ThreadPool(const ThreadPool&) = delete;
   ThreadPool& operator=(const ThreadPool&) = delete;
-  
+
   ThreadPool(ThreadPool&&) = delete;
   ThreadPool& operator=(ThreadPool&&) = delete;
-  
+
   ~ThreadPool() {
-    for (auto& it : queues_) {
-      it.Done();
+    {
+      std::unique_lock<std::mutex> lock(sleep_mutex_);
+      is_done_.store(true, std::memory_order_seq_cst);
     }
+    is_awake_.notify_all();
     for (auto& it : threads_) {
       it.join();
     }
   }
-  
+
   std::size_t num_threads() const {
     return threads_.size();
   }
-  
+
   const std::unordered_map<std::thread::id, std::size_t>& thread_map() const {
     return thread_map_;
   }
-  
+
+  // Runs a task with frame priority.
   template<typename T, typename... Ts>
   auto Submit(T&& routine, Ts&&... params)
+  -> std::future<typename std::result_of<T(Ts...)>::type> {
+    return SubmitWithPriority(Priority::kFrame, std::forward<T>(routine),
+                              std::forward<Ts>(params)...);
+  }
+
+  // Runs a task in the slack between frames. Long background jobs should be
+  // split into several tasks, or check IsFrameWorkPending() now and then.
+  template<typename T, typename... Ts>
+  auto SubmitBackground(T&& routine, Ts&&... params)
+  -> std::future<typename std::result_of<T(Ts...)>::type> {
+    return SubmitWithPriority(Priority::kBackground, std::forward<T>(routine),
+                              std::forward<Ts>(params)...);
+  }
+
+  template<typename T, typename... Ts>
+  auto SubmitWithPriority(Priority priority, T&& routine, Ts&&... params)
   -> std::future<typename std::result_of<T(Ts...)>::type> {
     auto task = std::make_shared<std::packaged_task<typename std::result_of<T(Ts...)>::type()>>(  // NOLINT
         std::bind(std::forward<T>(routine), std::forward<Ts>(params)...));
     auto task_result = task->get_future();
-    auto task_wrapper = [task] () {
+
+    auto* function_task = new FunctionTask();
+    function_task->function = [task] () {
       (*task)();
     };
-    
-    auto task_id = task_id_++;
-    bool is_submitted = false;
-    for (std::size_t i = 0; i != queues_.size() * 42; ++i) {
-      if (queues_[(task_id + i) % queues_.size()].TryPush(task_wrapper)) {
-        is_submitted = true;
-        break;
+    Push(priority, function_task);
+
+    return task_result;
+  }
+
+  // Whether any frame tasks (or ParallelFor calls) are waiting. Background
+  // tasks can use this to stop early and continue in a new task.
+  bool IsFrameWorkPending() const {
+    return lanes_[int(Priority::kFrame)].num_pending.load(
+               std::memory_order_relaxed) != 0
+           || num_parallel_jobs_.load(std::memory_order_relaxed) != 0;
+  }
+
+  // Calls body(i) for every i in [0, num_items) and returns when all calls
+  // are done. The items are handed out one by one through an atomic counter,
+  // and the calling thread works on them too instead of waiting idly.
+  //
+  // Unlike Submit, this doesn't allocate anything per call: The job lives on
+  // the caller's stack and is published in one of the pool's job slots,
+  // where idle workers find it before they look at any queue. When the items
+  // are gone, the caller takes the job out of its slot again and only waits
+  // for the workers that are inside of it right then. Workers that are busy
+  // with something else or asleep never hold up the caller.
+  template<typename F>
+  void ParallelFor(std::size_t num_items, F&& body) {
+    ParallelSlot* slot = nullptr;
+
+    // A worker that waits for other workers could wait forever if they're
+    // all waiting, so nested calls run on the calling thread (also on the
+    // thread that made the outer call). So do calls when every slot is taken
+    // by other threads.
+    WorkerInfo& caller = CurrentWorker();
+    if (num_items > 1 && caller.pool != this && caller.parallel_pool != this) {
+      slot = AcquireParallelSlot();
+    }
+    if (slot == nullptr) {
+      for (std::size_t i = 0; i != num_items; ++i) {
+        body(i);
       }
+      return;
     }
-    if (!is_submitted) {
-      queues_[task_id % queues_.size()].Push(task_wrapper);
+
+    ParallelJob job;
+    job.body = &body;
+    job.invoke = [] (const void* body, std::size_t i) -> void {
+      (*static_cast<std::remove_reference_t<F>*>(const_cast<void*>(body)))(i);
+    };
+    job.num_items = num_items;
+
+    slot->job.store(&job, std::memory_order_seq_cst);
+    const std::size_t num_helpers = std::min(num_workers_, num_items - 1);
+    for (std::size_t i = 0; i != num_helpers; ++i) {
+      WakeUp();
     }
-    
-    return task_result;
+
+    caller.parallel_pool = this;
+    job.Work();
+    caller.parallel_pool = nullptr;
+
+    // A worker that finds the job after this gets no item, because they're
+    // all handed out. The ones that found it before are counted as users.
+    slot->job.store(nullptr, std::memory_order_seq_cst);
+    while (slot->num_users.load(std::memory_order_seq_cst) != 0) {
+      std::this_thread::yield();
+    }
+    num_parallel_jobs_.fetch_sub(1, std::memory_order_release);
+    slot->is_taken.store(false, std::memory_order_release);
   }
 
 private:
-  void Task(std::size_t thread_id) {
-    while (true) {
-      std::function<void()> task;
-      
-      for (std::size_t i = 0; i != queues_.size(); ++i) {
-        if (queues_[(thread_id + i) % queues_.size()].TryPop(&task)) {
-          break;
+  // Workers look for work this many times before they go to sleep.
+  static constexpr int kSpinCount = 64;
+
+  struct FunctionTask : thread_pool::Task {
+    FunctionTask() {
+      run = [] (thread_pool::Task* task) -> void {
+        auto* self = static_cast<FunctionTask*>(task);
+        self->function();
+        delete self;
+      };
+    }
+
+    std::function<void()> function;
+  };
+
+  struct ParallelJob {
+    const void* body = nullptr;
+    void (*invoke)(const void*, std::size_t) = nullptr;
+    std::size_t num_items = 0;
+    std::atomic<std::size_t> next_item{0};
+
+    // Returns whether there was anything left to do.
+    bool Work() {
+      bool has_worked = false;
+      while (true) {
+        std::size_t i = next_item.fetch_add(1, std::memory_order_seq_cst);
+        if (i >= num_items) {
+          return has_worked;
         }
+        invoke(body, i);
+        has_worked = true;
       }
-      if (!task && !queues_[thread_id].Pop(&task)) {
-        break;
+    }
+  };
+
+  // Where a ParallelFor publishes its job. `num_users` counts the workers
+  // that may be looking at `job`, which is null when there's no job.
+  struct ParallelSlot {
+    std::atomic<bool> is_taken{false};
+    std::atomic<ParallelJob*> job{nullptr};
+    std::atomic<std::size_t> num_users{0};
+  };
+
+  // At most this many threads that aren't workers can run a ParallelFor at
+  // the same time. More than that run on the calling thread.
+  static constexpr std::size_t kNumParallelSlots = 8;
+
+  ParallelSlot* AcquireParallelSlot() {
+    for (ParallelSlot& slot : parallel_slots_) {
+      bool is_taken = false;
+      if (slot.is_taken.compare_exchange_strong(is_taken, true,
+                                                std::memory_order_acquire)) {
+        num_parallel_jobs_.fetch_add(1, std::memory_order_relaxed);
+        return &slot;
+      }
+    }
+    return nullptr;
+  }
+
+  // Works on the items of a ParallelFor, if there are any left. Returns
+  // whether it did anything.
+  bool HelpWithParallelJobs() {
+    if (num_parallel_jobs_.load(std::memory_order_acquire) == 0) {
+      return false;
+    }
+
+    for (ParallelSlot& slot : parallel_slots_) {
+      if (slot.job.load(std::memory_order_relaxed) == nullptr) {
+        continue;
       }
-      
-      task();
-    }
-  }
-  
-  struct TaskQueue {
-  public:
-    template<typename F>
-    void Push(F&& f) {
-      {
-        std::unique_lock<std::mutex> lock(mutex);
-        queue.emplace(std::forward<F>(f));
+      slot.num_users.fetch_add(1, std::memory_order_seq_cst);
+      ParallelJob* job = slot.job.load(std::memory_order_seq_cst);
+      const bool has_worked = job != nullptr && job->Work();
+      slot.num_users.fetch_sub(1, std::memory_order_seq_cst);
+      if (has_worked) {
+        return true;
       }
-      is_ready.notify_one();
     }
-    
-    bool Pop(std::function<void()>* f) {
-      std::unique_lock<std::mutex> lock(mutex);
-      while (queue.empty() && !is_done) {
-        is_ready.wait(lock);
+    return false;
+  }
+
+  struct WorkerInfo {
+    ThreadPool* pool = nullptr;  // Of which this thread is a worker
+    std::size_t index = 0;
+    ThreadPool* parallel_pool = nullptr;  // In whose ParallelFor it is
+  };
+
+  static WorkerInfo& CurrentWorker() {
+    static thread_local WorkerInfo info;
+    return info;
+  }
+
+  // Every priority has its own deques and injection queue.
+  struct Lane {
+    std::vector<WorkStealingDeque> deques;  // One per worker
+    std::mutex injection_mutex;
+    std::queue<thread_pool::Task*> injection_queue;
+    std::atomic<std::size_t> injection_size{0};
+    std::atomic<std::size_t> num_pending{0};  // Pushed but not started
+  };
+
+  // Workers push onto their own deque. Other threads can't (a Chase-Lev deque
+  // only has one owner), so they go through the shared injection queue.
+  void Push(Priority priority, thread_pool::Task* task) {
+    Lane& lane = lanes_[int(priority)];
+    lane.num_pending.fetch_add(1, std::memory_order_relaxed);
+
+    const WorkerInfo& worker = CurrentWorker();
+    if (worker.pool == this) {
+      lane.deques[worker.index].Push(task);
+    } else {
+      std::unique_lock<std::mutex> lock(lane.injection_mutex);
+      lane.injection_queue.push(task);
+      lane.injection_size.fetch_add(1, std::memory_order_release);
+    }
+    WakeUp();
+  }
+
+  void WakeUp() {
+    epoch_.fetch_add(1, std::memory_order_seq_cst);
+    if (num_sleeping_.load(std::memory_order_seq_cst) != 0) {
+      // Taking the lock makes sure that a worker that's about to sleep is
+      // either still checking the epoch or already waiting.
+      { std::unique_lock<std::mutex> lock(sleep_mutex_); }
+      is_awake_.notify_one();
+    }
+  }
+
+  thread_pool::Task* FindTaskInLane(Lane& lane, std::size_t thread_id) {
+    thread_pool::Task* task = lane.deques[thread_id].Pop();
+
+    if (task == nullptr
+        && lane.injection_size.load(std::memory_order_acquire) != 0) {
+      std::unique_lock<std::mutex> lock(lane.injection_mutex);
+      if (!lane.injection_queue.empty()) {
+        task = lane.injection_queue.front();
+        lane.injection_queue.pop();
+        lane.injection_size.fetch_sub(1, std::memory_order_relaxed);
       }
-      if (queue.empty()) {
-        return false;
+    }
+
+    for (std::size_t i = 1; task == nullptr && i != num_workers_; ++i) {
+      std::size_t victim = (thread_id + i) % num_workers_;
+      task = lane.deques[victim].Steal();
+    }
+
+    if (task != nullptr) {
+      lane.num_pending.fetch_sub(1, std::memory_order_relaxed);
+    }
+    return task;
+  }
+
+  // Looks through the lanes from the highest priority to the lowest.
+  thread_pool::Task* FindTask(std::size_t thread_id) {
+    for (Lane& lane : lanes_) {
+      if (thread_pool::Task* task = FindTaskInLane(lane, thread_id)) {
+        return task;
       }
-      *f = std::move(queue.front());
-      queue.pop();
-      return true;
-    }
-    
-    template<typename F>
-    bool TryPush(F&& f) {
-      {
-        std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
-        if (!lock) {
-          return false;
+    }
+    return nullptr;
+  }
+
+  void Task(std::size_t thread_id) {
+    CurrentWorker() = {this, thread_id};
+    if (on_thread_start_) {
+      on_thread_start_(thread_id);
+    }
+
+    while (true) {
+      // Look for work a few times before going to sleep...
+      std::uint64_t epoch = epoch_.load(std::memory_order_seq_cst);
+      thread_pool::Task* task = nullptr;
+
+      bool has_helped = false;
+
+      for (int i = 0; i != kSpinCount && task == nullptr && !has_helped; ++i) {
+        has_helped = HelpWithParallelJobs();
+        if (!has_helped) {
+          task = FindTask(thread_id);
+        }
+        if (task == nullptr && !has_helped) {
+          std::this_thread::yield();
         }
-        queue.emplace(std::forward<F>(f));
       }
-      is_ready.notify_one();
-      return true;
-    }
-    
-    bool TryPop(std::function<void()>* f) {
-      std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
-      if (!lock || queue.empty()) {
-        return false;
+
+      if (has_helped) {
+        continue;
       }
-      *f = std::move(queue.front());
-      queue.pop();
-      return true;
-    }
-    
-    void Done() {
-      {
-        std::unique_lock<std::mutex> lock(mutex);
-        is_done = true;
+      if (task != nullptr) {
+        task->run(task);
+        continue;
       }
-      is_ready.notify_all();
+
+      // Everything that was pushed before is_done_ was set has been seen by
+      // the last FindTask, so it's safe to stop.
+      if (is_done_.load(std::memory_order_seq_cst)) {
+        if ((task = FindTask(thread_id)) != nullptr) {
+          task->run(task);
+          continue;
+        }
+        break;
+      }
+
+      // Park until something is pushed.
+      std::unique_lock<std::mutex> lock(sleep_mutex_);
+      num_sleeping_.fetch_add(1, std::memory_order_seq_cst);
+      is_awake_.wait(lock, [&] () {
+        return epoch_.load(std::memory_order_seq_cst) != epoch
+               || is_done_.load(std::memory_order_seq_cst);
+      });
+      num_sleeping_.fetch_sub(1, std::memory_order_seq_cst);
     }
-    
-    std::queue<std::function<void()>> queue;
-    std::mutex mutex;
-    std::condition_variable is_ready;
-    bool is_done = false;
-  };
-  
+  }
+
   std::vector<std::thread> threads_;
   std::unordered_map<std::thread::id, std::size_t> thread_map_;
-  std::vector<TaskQueue> queues_;
-  std::atomic<std::size_t> task_id_;
+  std::size_t num_workers_;
+  std::function<void(std::size_t)> on_thread_start_;
+  Lane lanes_[2];  // Indexed by Priority
+  ParallelSlot parallel_slots_[kNumParallelSlots];
+  std::atomic<std::size_t> num_parallel_jobs_{0};  // Slots that are taken
+
+  std::mutex sleep_mutex_;
+  std::condition_variable is_awake_;
+  std::atomic<std::uint64_t> epoch_{0};
+  std::atomic<std::size_t> num_sleeping_{0};
+  std::atomic<bool> is_done_{false};
 };
 
 }  // namespace thread_pool
 
+
+
+#ifdef ENABLE_DOCTEST
+#include <doctest/doctest.h>
+#include <chrono>
+TEST_CASE("ThreadPool::ParallelFor") {
+  thread_pool::ThreadPool pool(4);
+
+  // Every item runs exactly once, also when calls follow each other fast.
+  std::vector<std::atomic<int>> counts(1000);
+  for (int call = 0; call != 50; ++call) {
+    pool.ParallelFor(counts.size(), [&] (std::size_t i) -> void {
+      counts[i].fetch_add(1);
+    });
+  }
+  bool is_every_item_run = true;
+  for (const std::atomic<int>& count : counts) {
+    is_every_item_run = is_every_item_run && count.load() == 50;
+  }
+  CHECK(is_every_item_run);
+
+  // Fewer items than workers, and no items at all.
+  std::atomic<int> sum{0};
+  pool.ParallelFor(2, [&] (std::size_t i) -> void { sum += int(i) + 1; });
+  CHECK(sum.load() == 3);
+  pool.ParallelFor(0, [&] (std::size_t) -> void { sum = -1; });
+  CHECK(sum.load() == 3);
+
+  // Nested calls run on the thread of the outer item.
+  std::atomic<int> num_inner{0};
+  std::atomic<bool> is_inline{true};
+  pool.ParallelFor(16, [&] (std::size_t) -> void {
+    const std::thread::id outer = std::this_thread::get_id();
+    pool.ParallelFor(8, [&] (std::size_t) -> void {
+      num_inner.fetch_add(1);
+      if (std::this_thread::get_id() != outer) {
+        is_inline = false;
+      }
+    });
+  });
+  CHECK(num_inner.load() == 16 * 8);
+  CHECK(is_inline.load());
+}
+
+
+TEST_CASE("ThreadPool priorities") {
+  // The only worker is busy with a long background task. A frame's
+  // ParallelFor still finishes, on the calling thread, without waiting for
+  // the background task.
+  thread_pool::ThreadPool pool(1);
+  std::atomic<bool> is_started{false};
+  std::atomic<bool> is_released{false};
+  std::atomic<bool> was_frame_pending{false};
+  auto background = pool.SubmitBackground([&] () -> void {
+    is_started = true;
+    while (!is_released.load()) {
+      was_frame_pending = was_frame_pending || pool.IsFrameWorkPending();
+      std::this_thread::yield();
+    }
+  });
+  while (!is_started.load()) {
+    std::this_thread::yield();
+  }
+
+  std::atomic<int> num_items{0};
+  pool.ParallelFor(100, [&] (std::size_t) -> void {
+    num_items.fetch_add(1);
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  });
+  CHECK(num_items.load() == 100);
+  CHECK(background.wait_for(std::chrono::seconds(0))
+        == std::future_status::timeout);
+
+  // The background task could see that a frame was waiting.
+  CHECK(was_frame_pending.load());
+  CHECK(!pool.IsFrameWorkPending());
+  is_released = true;
+  background.get();
+}
+
+
+TEST_CASE("ThreadPool runs queued frame tasks first") {
+  // The only worker is blocked while background tasks and then a frame
+  // task are queued. Once it's released, it takes the frame task first.
+  thread_pool::ThreadPool pool(1);
+  std::atomic<bool> is_started{false};
+  std::atomic<bool> is_released{false};
+  auto blocker = pool.Submit([&] () -> void {
+    is_started = true;
+    while (!is_released.load()) {
+      std::this_thread::yield();
+    }
+  });
+  while (!is_started.load()) {
+    std::this_thread::yield();
+  }
+
+  std::mutex order_mutex;
+  std::vector<int> order;
+  auto record = [&] (int task) -> void {
+    std::unique_lock<std::mutex> lock(order_mutex);
+    order.push_back(task);
+  };
+  std::vector<std::future<void>> results;
+  for (int i = 0; i != 3; ++i) {
+    results.push_back(pool.SubmitBackground(record, i));
+  }
+  results.push_back(pool.Submit(record, -1));
+
+  is_released = true;
+  blocker.get();
+  for (auto& result : results) {
+    result.get();
+  }
+  REQUIRE(order.size() == 4);
+  CHECK(order[0] == -1);
+}
+
+
+TEST_CASE("WorkStealingDeque") {
+  using thread_pool::Task;
+  using thread_pool::WorkStealingDeque;
+
+  // The owner takes the task it pushed last, thieves the one pushed first.
+  std::vector<Task> tasks(10000);
+  auto index_of = [&] (Task* task) -> std::size_t {
+    return std::size_t(task - tasks.data());
+  };
+  {
+    WorkStealingDeque deque(4);
+    for (std::size_t i = 0; i != 6; ++i) {
+      deque.Push(&tasks[i]);
+    }
+    CHECK(index_of(deque.Pop()) == 5);
+    CHECK(index_of(deque.Steal()) == 0);
+    CHECK(index_of(deque.Pop()) == 4);
+    CHECK(index_of(deque.Steal()) == 1);
+    CHECK(index_of(deque.Pop()) == 3);
+    CHECK(index_of(deque.Pop()) == 2);
+    CHECK(deque.Pop() == nullptr);
+    CHECK(deque.Steal() == nullptr);
+  }
+
+  // Thieves steal while the owner pushes and pops, and the deque grows from
+  // 4 tasks while they do. Every task is taken exactly once, and every thief
+  // gets its tasks in the order they were pushed.
+  WorkStealingDeque deque(4);
+  std::vector<std::atomic<int>> num_taken(tasks.size());
+  std::atomic<bool> is_pushing{true};
+  std::atomic<bool> is_in_order{true};
+
+  std::vector<std::thread> thieves;
+  for (int t = 0; t != 3; ++t) {
+    thieves.emplace_back([&] () -> void {
+      std::size_t previous = 0;
+      bool is_first = true;
+      while (true) {
+        const bool was_pushing = is_pushing.load();
+        Task* task = deque.Steal();
+        if (task == nullptr) {
+          if (!was_pushing) {
+            return;
+          }
+          continue;
+        }
+        const std::size_t i = index_of(task);
+        if (!is_first && i <= previous) {
+          is_in_order = false;
+        }
+        previous = i;
+        is_first = false;
+        num_taken[i].fetch_add(1);
+      }
+    });
+  }
+
+  for (std::size_t i = 0; i != tasks.size(); ++i) {
+    deque.Push(&tasks[i]);
+    if (i % 3 == 0) {
+      if (Task* task = deque.Pop()) {
+        num_taken[index_of(task)].fetch_add(1);
+      }
+    }
+  }
+  is_pushing = false;
+  while (Task* task = deque.Pop()) {
+    num_taken[index_of(task)].fetch_add(1);
+  }
+  for (std::thread& thief : thieves) {
+    thief.join();
+  }
+
+  bool is_taken_once = true;
+  for (const std::atomic<int>& count : num_taken) {
+    is_taken_once = is_taken_once && count.load() == 1;
+  }
+  CHECK(is_taken_once);
+  CHECK(is_in_order.load());
+}
+
+
+TEST_CASE("ThreadPool shutdown") {
+  // The tasks that are still queued when the pool is destroyed are run
+  // before the workers stop.
+  std::atomic<int> num_run{0};
+  {
+    thread_pool::ThreadPool pool(2);
+    for (int i = 0; i != 200; ++i) {
+      pool.Submit([&] () -> void {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+        num_run.fetch_add(1);
+      });
+    }
+  }
+  CHECK(num_run.load() == 200);
+}
+#endif
+
 #endif  // THREAD_POOL_THREAD_POOL_HPP_